@@ -0,0 +1,89 @@
+/*
+ * Name        : async.cpp
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : libzen coroutine example, polls all connected players from one thread
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "libzen-async.hpp"
+
+#define MAX_DEVICES 64
+
+static zen::task<void> poll_device(zen::device& dev, int no, int rounds, int interval, int bank) {
+    for(int i=0; i<rounds; i++) {
+        int level = co_await zen::battery(dev);
+        int limit = co_await zen::vol_limit(dev);
+
+        printf("device=%d battery=%d limit=%d\n", no, level, limit);
+        if(i + 1 < rounds)
+            co_await dev.ev.sleep(std::chrono::milliseconds(interval * 1000));
+    }
+
+    if(bank >= 0) {
+        char    filename[32];
+        FILE*   f;
+
+        snprintf(filename, sizeof(filename), "bank%d-dev%d.bin", bank, no);
+        if((f = fopen(filename, "wb")) == NULL) {
+            printf("Creating %s failed, check privileges\n", filename);
+            co_return;
+        }
+
+        int res = co_await zen::read_bank(dev, (u8)bank, [f](const u8* data, size_t len) {
+            return fwrite(data, 1, len, f) == len;
+        });
+        printf("device=%d bank=%d %s\n", no, bank, res == ZEN_SUCC ? "ok" : "failed");
+        fclose(f);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    usb_dev_handle*                 handles[MAX_DEVICES];
+    std::vector<zen::device>        devices;
+    zen::loop                       ev;
+    int                             vid, pid, count, rounds, interval, bank, argpos;
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    rounds = 1;
+    interval = 10;
+    bank = -1;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-n") == 0 && argpos + 1 < argc)
+            rounds = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-t") == 0 && argpos + 1 < argc)
+            interval = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-bank") == 0 && argpos + 1 < argc)
+            bank = atoi(argv[++argpos]);
+        else {
+            printf("Usage: %s [-vid 0x1234] [-pid 0x1234] [-n rounds] [-t seconds] [-bank no]\n", argv[0]);
+            return ZEN_ERROR;
+        }
+    }
+
+    count = init_zen_list(vid, pid, handles, MAX_DEVICES);
+    if(count == 0) {
+        puts("Zen Stone not found or error occured.");
+        return ZEN_ERROR;
+    }
+
+    devices.reserve(count);
+    for(int i=0; i<count; i++) {
+        devices.emplace_back(ev, handles[i]);
+        ev.spawn(poll_device(devices.back(), i, rounds, interval, bank));
+    }
+    ev.run();
+
+    for(int i=0; i<count; i++)
+        deinit_zen(handles[i]);
+
+    return ZEN_SUCC;
+}
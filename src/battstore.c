@@ -0,0 +1,365 @@
+/*
+ * Name        : battstore.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Fixed-size memory-mapped battery history with downsampling
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "battstore.h"
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#ifdef _MSC_VER
+# define BATT_BARRIER() MemoryBarrier()
+#else
+# define BATT_BARRIER() __sync_synchronize()
+#endif
+
+/* Slots of first tier start here */
+#define BATT_SLOTS_OFFSET   256
+
+static const u32 tierIntervals[BATT_TIERS] = BATT_TIER_INTERVALS;
+static const u32 tierCapacity[BATT_TIERS] = BATT_TIER_CAPACITY;
+
+static size_t store_size(void) {
+    size_t  size = BATT_SLOTS_OFFSET;
+    int     i;
+
+    for(i=0; i<BATT_TIERS; i++)
+        size += tierCapacity[i] * sizeof(struct sBattSample);
+
+    return size;
+}
+
+static void store_init(struct sBattStoreHeader* h, int vid, int pid) {
+    u32 offset = BATT_SLOTS_OFFSET;
+    int i;
+
+    memset(h, 0, sizeof(struct sBattStoreHeader));
+    memcpy(h->magic, BATT_STORE_MAGIC, sizeof(h->magic));
+    h->version = BATT_STORE_VERSION;
+    h->vid = vid;
+    h->pid = pid;
+    h->tiersCount = BATT_TIERS;
+    for(i=0; i<BATT_TIERS; i++) {
+        h->tiers[i].interval = tierIntervals[i];
+        h->tiers[i].capacity = tierCapacity[i];
+        h->tiers[i].offset = offset;
+        offset += tierCapacity[i] * sizeof(struct sBattSample);
+    }
+}
+
+static int store_valid(const struct sBattStore* st) {
+    const struct sBattStoreHeader*  h = st->header;
+    u32                             offset = BATT_SLOTS_OFFSET;
+    int                             i;
+
+    if(memcmp(h->magic, BATT_STORE_MAGIC, sizeof(h->magic)) != 0 || h->version != BATT_STORE_VERSION
+        || h->tiersCount != BATT_TIERS)
+        return 0;
+
+    for(i=0; i<BATT_TIERS; i++) {
+        if(h->tiers[i].interval != tierIntervals[i] || h->tiers[i].capacity != tierCapacity[i]
+            || h->tiers[i].offset != offset)
+            return 0;
+        offset += tierCapacity[i] * sizeof(struct sBattSample);
+    }
+
+    return 1;
+}
+
+/** Maps file of given size, writer extends new file to that size. */
+static int map_store(struct sBattStore* st, const char* path, size_t size, int* created) {
+#ifndef WIN32
+    struct stat info;
+    char        magic[4];
+    int         fd;
+    void*       map;
+
+    if((fd = open(path, st->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(fstat(fd, &info) < 0) {
+        close(fd);
+        return ZEN_ERROR;
+    }
+
+    /* only new file or store of other version may be (re)initialized, never a mistyped path */
+    if(info.st_size != 0 && (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)
+        || memcmp(magic, BATT_STORE_MAGIC, sizeof(magic)) != 0)) {
+        zen_log("%s is not a battery store, leaving it untouched\n", path);
+        close(fd);
+        return ZEN_ERROR;
+    }
+
+    *created = (size_t)info.st_size != size;
+    if(*created && (!st->writable || ftruncate(fd, size) < 0)) {
+        zen_log("%s is not a battery store\n", path);
+        close(fd);
+        return ZEN_ERROR;
+    }
+
+    map = mmap(NULL, size, st->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        zen_log("Mapping %s failed\n", path);
+        return ZEN_ERROR;
+    }
+    st->header = (struct sBattStoreHeader*)map;
+#else
+    LARGE_INTEGER   fileSize;
+    char            magic[4];
+    DWORD           got;
+
+    st->file = CreateFileA(path, st->writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, st->writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(st->file == INVALID_HANDLE_VALUE) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(!GetFileSizeEx(st->file, &fileSize) || (fileSize.QuadPart != 0
+        && (!ReadFile(st->file, magic, sizeof(magic), &got, NULL) || got != sizeof(magic)
+        || memcmp(magic, BATT_STORE_MAGIC, sizeof(magic)) != 0))) {
+        zen_log("%s is not a battery store, leaving it untouched\n", path);
+        CloseHandle(st->file);
+        return ZEN_ERROR;
+    }
+
+    *created = (size_t)fileSize.QuadPart != size;
+    if(*created && !st->writable) {
+        zen_log("%s is not a battery store\n", path);
+        CloseHandle(st->file);
+        return ZEN_ERROR;
+    }
+
+    /* mapping extends the file */
+    st->mapping = CreateFileMappingA(st->file, NULL, st->writable ? PAGE_READWRITE : PAGE_READONLY, 0, (DWORD)size, NULL);
+    if(st->mapping == NULL) {
+        CloseHandle(st->file);
+        return ZEN_ERROR;
+    }
+
+    st->header = (struct sBattStoreHeader*)MapViewOfFile(st->mapping, st->writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    if(st->header == NULL) {
+        zen_log("Mapping %s failed\n", path);
+        CloseHandle(st->mapping);
+        CloseHandle(st->file);
+        return ZEN_ERROR;
+    }
+#endif
+    st->size = size;
+
+    return ZEN_SUCC;
+}
+
+int batt_store_open(struct sBattStore* st, const char* path, int vid, int pid, int writable) {
+    int created, i;
+
+    memset(st, 0, sizeof(struct sBattStore));
+    st->writable = writable;
+
+    if(map_store(st, path, store_size(), &created) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(created || !store_valid(st)) {
+        if(!writable) {
+            zen_log("%s is not a battery store\n", path);
+            batt_store_close(st);
+            return ZEN_ERROR;
+        }
+
+        memset(st->header, 0, st->size);
+        store_init(st->header, vid, pid);
+    }
+
+    /* writer died in the middle of update */
+    if(writable)
+        for(i=0; i<BATT_TIERS; i++)
+            st->header->tiers[i].seq &= ~1u;
+
+    return ZEN_SUCC;
+}
+
+void batt_store_close(struct sBattStore* st) {
+    if(st->header == NULL)
+        return;
+
+#ifndef WIN32
+    munmap(st->header, st->size);
+#else
+    UnmapViewOfFile(st->header);
+    CloseHandle(st->mapping);
+    CloseHandle(st->file);
+#endif
+    memset(st, 0, sizeof(struct sBattStore));
+}
+
+static struct sBattSample* slots(const struct sBattStore* st, int tier) {
+    return (struct sBattSample*)((u8*)st->header + st->header->tiers[tier].offset);
+}
+
+/** Publishes sample, readers see either old or new state of the tier. */
+static void put_sample(struct sBattStore* st, int tier, const struct sBattSample* s) {
+    struct sBattTier* t = &st->header->tiers[tier];
+
+    t->seq++;
+    BATT_BARRIER();
+    slots(st, tier)[t->head % t->capacity] = *s;
+    t->head++;
+    BATT_BARRIER();
+    t->seq++;
+}
+
+static void flush_acc(struct sBattStore* st, int tier) {
+    struct sBattTier*   t = &st->header->tiers[tier];
+    struct sBattSample  s;
+
+    if(t->accCount == 0)
+        return;
+
+    memset(&s, 0, sizeof(struct sBattSample));
+    s.time = t->accStart;
+    s.level = (u8)((t->accSum + t->accCount / 2) / t->accCount);
+    s.levelMin = t->accMin;
+    s.levelMax = t->accMax;
+    s.state = t->accState;
+    s.volLimit = t->accVolLimit;
+    s.count = t->accCount;
+    put_sample(st, tier, &s);
+
+    t->accCount = 0;
+}
+
+int batt_store_append(struct sBattStore* st, u32 time, const struct sBattResp* batt, int volLimit) {
+    struct sBattTier*   t = &st->header->tiers[0];
+    struct sBattSample  s;
+    u32                 start;
+    int                 i;
+
+    if(!st->writable)
+        return ZEN_ERROR;
+
+    /* keeps every tier sorted by time, so readers can search it */
+    if(t->head > 0 && time < slots(st, 0)[(t->head - 1) % t->capacity].time)
+        return ZEN_ERROR;
+
+    memset(&s, 0, sizeof(struct sBattSample));
+    s.time = time;
+    s.level = s.levelMin = s.levelMax = batt->level;
+    s.state = batt->full;
+    s.volLimit = volLimit == ZEN_ERROR ? 0xFF : (u8)volLimit;
+    s.count = 1;
+    put_sample(st, 0, &s);
+
+    for(i=1; i<BATT_TIERS; i++) {
+        t = &st->header->tiers[i];
+        start = time - time % t->interval;
+        if(t->accCount && (t->accStart != start || t->accCount == 0xFFFF))
+            flush_acc(st, i);
+
+        if(t->accCount == 0) {
+            t->accStart = start;
+            t->accSum = 0;
+            t->accMin = t->accMax = batt->level;
+        }
+        t->accSum += batt->level;
+        t->accCount++;
+        if(batt->level < t->accMin)
+            t->accMin = batt->level;
+        if(batt->level > t->accMax)
+            t->accMax = batt->level;
+        t->accState = s.state;
+        t->accVolLimit = s.volLimit;
+    }
+
+    return ZEN_SUCC;
+}
+
+int batt_store_query(const struct sBattStore* st, int tier, u32 from, u32 to, struct sBattSample* out, int max) {
+    const volatile struct sBattTier*    t;
+    const struct sBattSample*           ring;
+    u64                                 head, lo, hi, mid, first;
+    u32                                 seq;
+    int                                 tries, count;
+
+    if(st->header == NULL || tier < 0 || tier >= BATT_TIERS)
+        return ZEN_ERROR;
+
+    t = &st->header->tiers[tier];
+    ring = slots(st, tier);
+    for(tries=0; tries<BATT_READ_RETRIES; tries++) {
+        seq = t->seq;
+        BATT_BARRIER();
+        if(seq & 1)
+            continue;
+
+        head = t->head;
+        lo = head > t->capacity ? head - t->capacity : 0;
+
+        /* first sample with time >= from */
+        hi = head;
+        while(lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if(ring[mid % t->capacity].time < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        count = 0;
+        for(first=lo; first<head && count<max && ring[first % t->capacity].time <= to; first++)
+            out[count++] = ring[first % t->capacity];
+
+        BATT_BARRIER();
+        if(t->seq == seq)
+            return count;
+    }
+
+    return ZEN_ERROR;
+}
+
+int batt_store_read(const struct sBattStore* st, int tier, u64* pos, struct sBattSample* out, int max) {
+    const volatile struct sBattTier*    t;
+    const struct sBattSample*           ring;
+    u64                                 head, first;
+    u32                                 seq;
+    int                                 tries, count;
+
+    if(st->header == NULL || tier < 0 || tier >= BATT_TIERS)
+        return ZEN_ERROR;
+
+    t = &st->header->tiers[tier];
+    ring = slots(st, tier);
+    for(tries=0; tries<BATT_READ_RETRIES; tries++) {
+        seq = t->seq;
+        BATT_BARRIER();
+        if(seq & 1)
+            continue;
+
+        /* samples overwritten since last call are skipped */
+        head = t->head;
+        first = head > t->capacity && *pos < head - t->capacity ? head - t->capacity : *pos;
+
+        for(count=0; first + count < head && count < max; count++)
+            out[count] = ring[(first + count) % t->capacity];
+
+        BATT_BARRIER();
+        if(t->seq == seq) {
+            *pos = first + count;
+            return count;
+        }
+    }
+
+    return ZEN_ERROR;
+}
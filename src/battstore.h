@@ -0,0 +1,160 @@
+/*
+ * Name        : battstore.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Fixed-size memory-mapped battery history with downsampling
+ */
+
+#ifndef BATTSTORE_H
+#define BATTSTORE_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Store is a single file of fixed size: header and one ring buffer per tier.
+ * Tier 0 keeps every sample, higher tiers keep averages of BATT_TIER_INTERVALS
+ * seconds so old history takes little space. There is one writer (the poller),
+ * readers in any process map the file read-only and don't take locks: every
+ * tier has a sequence number which is odd while writer updates it, readers
+ * retry if it changed during their copy.
+ */
+
+#define BATT_STORE_MAGIC    "ZBTS"
+#define BATT_STORE_VERSION  1
+
+#define BATT_TIERS          4
+/* Raw, 5 minutes, 1 hour, 1 day */
+#define BATT_TIER_INTERVALS {0, 300, 3600, 86400}
+/* ~22 hours of 10s polls, 14 days, 341 days, 11 years */
+#define BATT_TIER_CAPACITY  {8192, 4096, 8192, 4096}
+
+/* Reader gives up if writer keeps the tier busy that many times */
+#define BATT_READ_RETRIES   100
+
+#pragma pack(push, 1)
+
+struct sBattSample {
+    /** Unix time, start of interval for downsampled tiers. */
+    u32 time;
+    /** Average level in %. */
+    u8  level;
+    u8  levelMin;
+    u8  levelMax;
+    /** ZEN_BATT_FULL/ZEN_BATT_NOT_FULL, last one in interval. */
+    u8  state;
+    /** Volume limit in %, last one in interval, 0xFF if unknown. */
+    u8  volLimit;
+    u8  pad;
+    /** Number of raw samples merged into this one. */
+    u16 count;
+};
+
+struct sBattTier {
+    /** Seconds per sample, 0 for raw samples. */
+    u32 interval;
+    u32 capacity;
+    /** Offset of first slot in file. */
+    u32 offset;
+    /** Odd while writer updates the tier. */
+    u32 seq;
+    /** Samples written since store was created, slot is head % capacity. */
+    u64 head;
+    /* downsampling accumulator, used by writer only */
+    u32 accStart;
+    u32 accSum;
+    u16 accCount;
+    u8  accMin;
+    u8  accMax;
+    u8  accState;
+    u8  accVolLimit;
+    u8  pad[2];
+};
+
+struct sBattStoreHeader {
+    char                magic[4];
+    u32                 version;
+    u32                 vid;
+    u32                 pid;
+    u32                 tiersCount;
+    u32                 pad;
+    struct sBattTier    tiers[BATT_TIERS];
+};
+
+#pragma pack(pop)
+
+struct sBattStore {
+    struct sBattStoreHeader*    header;
+    size_t                      size;
+    int                         writable;
+#ifdef WIN32
+    HANDLE                      file;
+    HANDLE                      mapping;
+#endif
+};
+
+/**
+ * @brief
+ * Maps store file, writer creates it (or recreates store of other layout), other files are refused
+ * @param st store
+ * @param path file name, one file per device
+ * @param vid vendor id saved in new store
+ * @param pid product id saved in new store
+ * @param writable 1 for the poller, 0 for readers
+ * @return ZEN_SUCC if store is mapped
+**/
+int batt_store_open(struct sBattStore* st, const char* path, int vid, int pid, int writable);
+
+/**
+ * @brief
+ * Unmaps store
+ * @param st store
+**/
+void batt_store_close(struct sBattStore* st);
+
+/**
+ * @brief
+ * Appends sample to tier 0 and to downsampling accumulators of other tiers
+ * @param st store opened as writable
+ * @param time unix time, samples older than the last one are refused
+ * @param batt battery response from read_batt_info()
+ * @param volLimit volume limit in %, ZEN_ERROR if unknown
+ * @return ZEN_SUCC if sample was stored
+**/
+int batt_store_append(struct sBattStore* st, u32 time, const struct sBattResp* batt, int volLimit);
+
+/**
+ * @brief
+ * Copies samples of tier with time in from..to, oldest first, without locking
+ * @param st store
+ * @param tier 0..BATT_TIERS-1
+ * @param from first time
+ * @param to last time
+ * @param out samples
+ * @param max size of out, samples may share time, so use batt_store_read() to get all of them in pages
+ * @return number of samples, ZEN_ERROR if tier doesn't exist or writer kept it busy
+**/
+int batt_store_query(const struct sBattStore* st, int tier, u32 from, u32 to, struct sBattSample* out, int max);
+
+/**
+ * @brief
+ * Copies samples of tier by position, oldest first, without locking, for paging through whole tier
+ * @param st store
+ * @param tier 0..BATT_TIERS-1
+ * @param pos number of samples written before the first one to copy, 0 for the oldest kept;
+ * moved after the last copied sample, samples overwritten meanwhile are skipped
+ * @param out samples
+ * @param max size of out
+ * @return number of samples, 0 at the end, ZEN_ERROR if tier doesn't exist or writer kept it busy
+**/
+int batt_store_read(const struct sBattStore* st, int tier, u64* pos, struct sBattSample* out, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * Name        : bindiff.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Binary diff and delta of firmware dumps
+ */
+
+#include <stdlib.h>
+#include "bindiff.h"
+
+/* Rolling hash multiplier and mixing constant of hash table index */
+#define HASH_MUL        0x01000193u
+#define HASH_MIX        0x9E3779B1u
+/* Equal data is skipped with memcmp() of that many bytes at once */
+#define CMP_BLOCK       256
+/* Candidates checked per hash table lookup */
+#define CHAIN_MAX       8
+
+/** Old image blocks by hash, heads and next hold block numbers, -1 ends chain. */
+struct sDiffIndex {
+    int*    heads;
+    int*    next;
+    u32     bits;
+    u32     pow;
+};
+
+/** Length of equal prefix of a and b, at most max. */
+static u32 match_len(const u8* a, const u8* b, u32 max) {
+    u32 i = 0;
+    u64 x, y;
+
+    while(max - i >= CMP_BLOCK && memcmp(a + i, b + i, CMP_BLOCK) == 0)
+        i += CMP_BLOCK;
+
+    for(; max - i >= 8; i += 8) {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if(x != y)
+            break;
+    }
+
+    while(i < max && a[i] == b[i])
+        i++;
+
+    return i;
+}
+
+static u32 block_hash(const u8* p) {
+    u32 h = 0;
+    int i;
+
+    for(i=0; i<DIFF_BLOCK; i++)
+        h = h * HASH_MUL + p[i];
+
+    return h;
+}
+
+static u32 slot(const struct sDiffIndex* idx, u32 h) {
+    return (h * HASH_MIX) >> (32 - idx->bits);
+}
+
+static int build_index(struct sDiffIndex* idx, const u8* src, u32 srcSize) {
+    u32 blocks = srcSize / DIFF_BLOCK, i;
+    int k;
+
+    for(idx->bits=10; (1u << idx->bits) < blocks * 2 && idx->bits < 30; idx->bits++)
+        ;
+
+    idx->heads = (int*)malloc(sizeof(int) << idx->bits);
+    idx->next = (int*)malloc(sizeof(int) * (blocks ? blocks : 1));
+    if(idx->heads == NULL || idx->next == NULL)
+        return ZEN_ERROR;
+
+    memset(idx->heads, 0xFF, sizeof(int) << idx->bits);
+    /* inserted backwards, so chains start with the lowest offset */
+    for(k=(int)blocks-1; k>=0; k--) {
+        i = slot(idx, block_hash(src + (u32)k * DIFF_BLOCK));
+        idx->next[k] = idx->heads[i];
+        idx->heads[i] = k;
+    }
+
+    for(idx->pow=1, i=1; i<DIFF_BLOCK; i++)
+        idx->pow *= HASH_MUL;
+
+    return ZEN_SUCC;
+}
+
+/** Finds longest match of dst among old image blocks with hash h. */
+static u32 find_match(const struct sDiffIndex* idx, const u8* src, u32 srcSize, const u8* dst, u32 max,
+    u32 h, u32* srcOffset) {
+    u32 best = 0, len, s;
+    int k, tries;
+
+    for(k=idx->heads[slot(idx, h)], tries=0; k>=0 && tries<CHAIN_MAX; k=idx->next[k], tries++) {
+        s = (u32)k * DIFF_BLOCK;
+        len = match_len(src + s, dst, srcSize - s < max ? srcSize - s : max);
+        if(len >= DIFF_BLOCK && len > best) {
+            best = len;
+            *srcOffset = s;
+        }
+    }
+
+    return best;
+}
+
+static int add_op(struct sDiff* diff, u8 type, u32 dstOffset, u32 srcOffset, u32 len) {
+    struct sDiffOp* ops;
+
+    if(len == 0)
+        return ZEN_SUCC;
+
+    if(diff->count == diff->capacity) {
+        ops = (struct sDiffOp*)realloc(diff->ops, sizeof(struct sDiffOp) * (diff->capacity ? diff->capacity * 2 : 64));
+        if(ops == NULL)
+            return ZEN_ERROR;
+        diff->ops = ops;
+        diff->capacity = diff->capacity ? diff->capacity * 2 : 64;
+    }
+
+    diff->ops[diff->count].type = type;
+    diff->ops[diff->count].dstOffset = dstOffset;
+    diff->ops[diff->count].srcOffset = srcOffset;
+    diff->ops[diff->count].len = len;
+    diff->count++;
+
+    if(type == DIFF_OP_DATA)
+        diff->changedBytes += len;
+    else if(srcOffset != dstOffset)
+        diff->movedBytes += len;
+
+    return ZEN_SUCC;
+}
+
+int bin_diff(const u8* src, u32 srcSize, const u8* dst, u32 dstSize, struct sDiff* diff) {
+    struct sDiffIndex   idx;
+    u32                 pos, expected, literal, len, s, h, hashPos;
+    int                 hashValid, res = ZEN_ERROR;
+
+    memset(diff, 0, sizeof(struct sDiff));
+    memset(&idx, 0, sizeof(struct sDiffIndex));
+
+    pos = expected = literal = hashPos = h = 0;
+    hashValid = 0;
+    while(pos < dstSize) {
+        /* nothing moved, the cheap case */
+        if(expected < srcSize) {
+            len = match_len(src + expected, dst + pos, srcSize - expected < dstSize - pos ? srcSize - expected : dstSize - pos);
+            if(len >= DIFF_MIN_COPY || (len > 0 && pos + len == dstSize)) {
+                if(add_op(diff, DIFF_OP_DATA, literal, 0, pos - literal) != ZEN_SUCC
+                    || add_op(diff, DIFF_OP_COPY, pos, expected, len) != ZEN_SUCC)
+                    goto cleanup;
+                pos += len;
+                expected += len;
+                literal = pos;
+                hashValid = 0;
+                continue;
+            }
+        }
+
+        /* maybe data was inserted or removed, look for this block anywhere */
+        if(pos + DIFF_BLOCK <= dstSize && srcSize >= DIFF_BLOCK) {
+            if(idx.heads == NULL && build_index(&idx, src, srcSize) != ZEN_SUCC)
+                goto cleanup;
+
+            if(hashValid && hashPos + 1 == pos)
+                h = (h - dst[pos - 1] * idx.pow) * HASH_MUL + dst[pos + DIFF_BLOCK - 1];
+            else
+                h = block_hash(dst + pos);
+            hashPos = pos;
+            hashValid = 1;
+
+            if((len = find_match(&idx, src, srcSize, dst + pos, dstSize - pos, h, &s)) > 0) {
+                /* match may start inside pending literal data */
+                while(pos > literal && s > 0 && src[s - 1] == dst[pos - 1]) {
+                    s--;
+                    pos--;
+                    len++;
+                }
+
+                if(add_op(diff, DIFF_OP_DATA, literal, 0, pos - literal) != ZEN_SUCC
+                    || add_op(diff, DIFF_OP_COPY, pos, s, len) != ZEN_SUCC)
+                    goto cleanup;
+                pos += len;
+                expected = s + len;
+                literal = pos;
+                hashValid = 0;
+                continue;
+            }
+        }
+
+        /* changed byte, alignment stays */
+        pos++;
+        expected++;
+    }
+
+    if(add_op(diff, DIFF_OP_DATA, literal, 0, pos - literal) == ZEN_SUCC)
+        res = ZEN_SUCC;
+
+cleanup:
+    free(idx.heads);
+    free(idx.next);
+    if(res != ZEN_SUCC) {
+        zen_log("Out of memory\n");
+        bin_diff_free(diff);
+    }
+
+    return res;
+}
+
+void bin_diff_free(struct sDiff* diff) {
+    free(diff->ops);
+    memset(diff, 0, sizeof(struct sDiff));
+}
+
+static int put_varint(u8* buff, u64 v) {
+    int n = 0;
+
+    do {
+        buff[n++] = (u8)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while(v);
+
+    return n;
+}
+
+static int get_varint(const u8* buff, u32 size, u32* pos, u64* v) {
+    int shift;
+
+    for(*v=0, shift=0; *pos<size && shift<64; shift+=7) {
+        *v |= (u64)(buff[*pos] & 0x7F) << shift;
+        if((buff[(*pos)++] & 0x80) == 0)
+            return ZEN_SUCC;
+    }
+
+    return ZEN_ERROR;
+}
+
+int bin_diff_write(const struct sDiff* diff, const u8* dst, struct sZenSink* sink) {
+    const struct sDiffOp*   op;
+    u8                      buff[32];
+    u64                     expected = 0;
+    long long               skip;
+    u32                     i;
+    int                     n;
+
+    for(i=0; i<diff->count; i++) {
+        op = &diff->ops[i];
+        buff[0] = op->type;
+        if(op->type == DIFF_OP_COPY) {
+            skip = (long long)op->srcOffset - (long long)expected;
+            n = 1 + put_varint(buff + 1, ((u64)skip << 1) ^ (u64)(skip >> 63));
+            n += put_varint(buff + n, op->len);
+            expected = (u64)op->srcOffset + op->len;
+        } else {
+            n = 1 + put_varint(buff + 1, op->len);
+            expected += op->len;
+        }
+
+        if(sink->write(sink, buff, n) != ZEN_SUCC)
+            return ZEN_ERROR;
+        if(op->type == DIFF_OP_DATA && sink->write(sink, dst + op->dstOffset, op->len) != ZEN_SUCC)
+            return ZEN_ERROR;
+    }
+
+    buff[0] = DIFF_OP_END;
+    return sink->write(sink, buff, 1);
+}
+
+int bin_patch(const u8* src, u32 srcSize, const u8* delta, u32 deltaSize, struct sZenSink* sink) {
+    u64         expected = 0, v, len;
+    long long   skip;
+    u32         pos = 0;
+    u8          type;
+
+    while(pos < deltaSize) {
+        type = delta[pos++];
+        if(type == DIFF_OP_END)
+            return (int)pos;
+
+        if(type == DIFF_OP_COPY) {
+            if(get_varint(delta, deltaSize, &pos, &v) != ZEN_SUCC || get_varint(delta, deltaSize, &pos, &len) != ZEN_SUCC)
+                break;
+            skip = (long long)(v >> 1) ^ -(long long)(v & 1);
+            expected += skip;
+            if(expected > srcSize || len > srcSize - expected)
+                break;
+            if(sink->write(sink, src + expected, (size_t)len) != ZEN_SUCC)
+                return ZEN_ERROR;
+            expected += len;
+        } else if(type == DIFF_OP_DATA) {
+            if(get_varint(delta, deltaSize, &pos, &len) != ZEN_SUCC || len > deltaSize - pos)
+                break;
+            if(sink->write(sink, delta + pos, (size_t)len) != ZEN_SUCC)
+                return ZEN_ERROR;
+            pos += (u32)len;
+            expected += len;
+        } else
+            break;
+    }
+
+    zen_log("Delta is broken at byte %u\n", pos);
+    return ZEN_ERROR;
+}
@@ -0,0 +1,107 @@
+/*
+ * Name        : bindiff.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Binary diff and delta of firmware dumps
+ */
+
+#ifndef BINDIFF_H
+#define BINDIFF_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * New image is described as copies from old image and literal data. Equal
+ * parts are found with memcmp() (vectorized by libc) at the current
+ * alignment; after a mismatch the new image is scanned with a rolling hash
+ * over old image blocks, so inserted or removed bytes shift the alignment
+ * instead of turning the rest of the bank into changes. Old image is indexed
+ * only when the first mismatch is found, identical banks cost one memcmp.
+ *
+ * Encoded delta is a stream of operations, numbers are LEB128 varints:
+ *   DIFF_OP_COPY, zigzag(src - expected), len
+ *   DIFF_OP_DATA, len, len bytes
+ *   DIFF_OP_END
+ * expected is where old image continues if nothing moved: end of last copy
+ * advanced by literal data written since.
+ */
+
+#define DIFF_OP_COPY    0x00
+#define DIFF_OP_DATA    0x01
+#define DIFF_OP_END     0x02
+
+/* Size of indexed old image blocks */
+#define DIFF_BLOCK      32
+/* Shorter runs at current alignment are kept in literal data */
+#define DIFF_MIN_COPY   8
+
+struct sDiffOp {
+    u8  type;
+    /** Offset in new image. */
+    u32 dstOffset;
+    /** Offset in old image, copies only. */
+    u32 srcOffset;
+    u32 len;
+};
+
+struct sDiff {
+    struct sDiffOp* ops;
+    u32             count;
+    u32             capacity;
+    /** Bytes of new image sent as literal data. */
+    u32             changedBytes;
+    /** Bytes copied from other offset than in new image. */
+    u32             movedBytes;
+};
+
+/**
+ * @brief
+ * Compares two images
+ * @param src old image
+ * @param srcSize size of src
+ * @param dst new image
+ * @param dstSize size of dst
+ * @param diff result, free with bin_diff_free()
+ * @return ZEN_SUCC if succeded, ZEN_ERROR if out of memory
+**/
+int bin_diff(const u8* src, u32 srcSize, const u8* dst, u32 dstSize, struct sDiff* diff);
+
+/**
+ * @brief
+ * Frees operations of diff
+ * @param diff diff
+**/
+void bin_diff_free(struct sDiff* diff);
+
+/**
+ * @brief
+ * Encodes delta of diff
+ * @param diff result of bin_diff()
+ * @param dst new image the diff was made for, literal data is taken from it
+ * @param sink destination, isn't closed
+ * @return ZEN_SUCC if sink took the whole delta
+**/
+int bin_diff_write(const struct sDiff* diff, const u8* dst, struct sZenSink* sink);
+
+/**
+ * @brief
+ * Rebuilds new image from old image and encoded delta
+ * @param src old image
+ * @param srcSize size of src
+ * @param delta encoded delta
+ * @param deltaSize bytes available in delta
+ * @param sink destination of new image, isn't closed
+ * @return bytes of delta consumed (up to DIFF_OP_END), ZEN_ERROR if delta is broken
+**/
+int bin_patch(const u8* src, u32 srcSize, const u8* delta, u32 deltaSize, struct sZenSink* sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
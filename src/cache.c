@@ -0,0 +1,357 @@
+/*
+ * Name        : cache.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : LRU sector cache with sequential readahead for libzen
+ */
+
+#include <stdlib.h>
+#include "libzen.h"
+
+/* Maximal number of chunks fetched with one read */
+#define FETCH_MAX   (ZEN_READAHEAD_MAX * 2)
+#define BANKS_MAX   256
+
+struct sCacheEntry {
+    usb_dev_handle* hdev;
+    u8      bank;
+    u32     chunk;
+    int     valid;
+    /** LRU list, prev is more recently used. */
+    int     prev;
+    int     next;
+    /** Next entry with the same hash. */
+    int     hnext;
+    u8*     data;
+};
+
+/** Remembered bank size and access pattern. */
+struct sBankGeom {
+    int     known;
+    u32     sectorSize;
+    u32     sectorsCount;
+    /** Chunk which will be read next if access is sequential. */
+    u32     nextChunk;
+    /** Readahead window in chunks. */
+    u32     window;
+};
+
+/** Banks of one device, devices may differ. */
+struct sDevGeom {
+    usb_dev_handle*     hdev;
+    struct sBankGeom    bank[BANKS_MAX];
+};
+
+static struct sCacheEntry*      entries;
+static u8*                      pool;
+static int*                     hashHeads;
+static int                      entriesCount;
+static int                      lruHead = -1; /* most recently used */
+static int                      lruTail = -1; /* least recently used */
+static u8*                      fetchBuff;
+static struct sDevGeom*         geoms[ZEN_DEVS_MAX];
+static struct sZenCacheStats    cstats;
+
+static int cache_hash(usb_dev_handle* hdev, u8 bank, u32 chunk) {
+    u32 h = (u32)((size_t)hdev >> 4);
+
+    return (int)(((chunk * 2654435761u) ^ bank ^ (h * 40503u)) % (u32)entriesCount);
+}
+
+/** Finds geometry of device, creates it on first use, NULL if too many devices. */
+static struct sDevGeom* geom_of(usb_dev_handle* hdev) {
+    int i, empty = -1;
+
+    for(i=0; i<ZEN_DEVS_MAX; i++) {
+        if(geoms[i] && geoms[i]->hdev == hdev)
+            return geoms[i];
+        if(geoms[i] == NULL && empty < 0)
+            empty = i;
+    }
+
+    if(empty < 0 || (geoms[empty] = (struct sDevGeom*)calloc(1, sizeof(struct sDevGeom))) == NULL)
+        return NULL;
+    geoms[empty]->hdev = hdev;
+
+    return geoms[empty];
+}
+
+static void lru_unlink(int i) {
+    if(entries[i].prev >= 0) entries[entries[i].prev].next = entries[i].next; else lruHead = entries[i].next;
+    if(entries[i].next >= 0) entries[entries[i].next].prev = entries[i].prev; else lruTail = entries[i].prev;
+}
+
+static void lru_push(int i) {
+    entries[i].prev = -1;
+    entries[i].next = lruHead;
+    if(lruHead >= 0)
+        entries[lruHead].prev = i;
+    lruHead = i;
+    if(lruTail < 0)
+        lruTail = i;
+}
+
+static void cache_free(void) {
+    free(entries);
+    free(pool);
+    free(hashHeads);
+    free(fetchBuff);
+    entries = NULL;
+    pool = NULL;
+    hashHeads = NULL;
+    fetchBuff = NULL;
+    entriesCount = 0;
+    lruHead = lruTail = -1;
+    cstats.capacity = 0;
+}
+
+/** Removes entry from its hash chain, it becomes least recently used. */
+static void cache_drop(int i) {
+    int* p;
+
+    if(entries[i].valid) {
+        for(p=&hashHeads[cache_hash(entries[i].hdev, entries[i].bank, entries[i].chunk)]; *p!=i; p=&entries[*p].hnext);
+        *p = entries[i].hnext;
+    }
+    entries[i].valid = 0;
+    entries[i].hdev = NULL;
+    if(lruTail != i) {
+        lru_unlink(i);
+        entries[i].next = -1;
+        entries[i].prev = lruTail;
+        entries[lruTail].next = i;
+        lruTail = i;
+    }
+}
+
+void zen_cache_flush(void) {
+    int i;
+
+    for(i=0; i<ZEN_DEVS_MAX; i++) {
+        free(geoms[i]);
+        geoms[i] = NULL;
+    }
+
+    lruHead = lruTail = -1;
+    for(i=0; i<entriesCount; i++) {
+        hashHeads[i] = -1;
+        entries[i].valid = 0;
+        entries[i].hdev = NULL;
+        lru_push(i);
+    }
+}
+
+void zen_cache_forget(usb_dev_handle* hdev) {
+    int i;
+
+    for(i=0; i<ZEN_DEVS_MAX; i++) {
+        if(geoms[i] && geoms[i]->hdev == hdev) {
+            free(geoms[i]);
+            geoms[i] = NULL;
+        }
+    }
+
+    for(i=0; i<entriesCount; i++)
+        if(entries[i].valid && entries[i].hdev == hdev)
+            cache_drop(i);
+}
+
+int zen_cache_enable(u32 budget) {
+    int i;
+
+    cache_free();
+    memset(&cstats, 0, sizeof(struct sZenCacheStats));
+    if(budget == 0)
+        return ZEN_SUCC;
+
+    /* one fetch with readahead has to fit */
+    if(budget / ZEN_CACHE_CHUNK < FETCH_MAX) {
+        zen_log("Sector cache needs at least %uB, %uB given\n", FETCH_MAX * ZEN_CACHE_CHUNK, budget);
+        return ZEN_ERROR;
+    }
+    entriesCount = budget / ZEN_CACHE_CHUNK;
+
+    entries = (struct sCacheEntry*)calloc(entriesCount, sizeof(struct sCacheEntry));
+    pool = (u8*)malloc((size_t)entriesCount * ZEN_CACHE_CHUNK);
+    hashHeads = (int*)malloc(entriesCount * sizeof(int));
+    fetchBuff = (u8*)malloc(FETCH_MAX * ZEN_CACHE_CHUNK);
+    if(entries == NULL || pool == NULL || hashHeads == NULL || fetchBuff == NULL) {
+        zen_log("Not enough memory for %uB sector cache\n", budget);
+        cache_free();
+        return ZEN_ERROR;
+    }
+
+    for(i=0; i<entriesCount; i++)
+        entries[i].data = pool + (size_t)i * ZEN_CACHE_CHUNK;
+    cstats.capacity = entriesCount;
+    zen_cache_flush();
+
+    return ZEN_SUCC;
+}
+
+void zen_cache_stats(struct sZenCacheStats* dst) {
+    memcpy(dst, &cstats, sizeof(struct sZenCacheStats));
+}
+
+/** Returns entry index or -1, found entry becomes most recently used. */
+static int cache_find(usb_dev_handle* hdev, u8 bank, u32 chunk) {
+    int i;
+
+    for(i=hashHeads[cache_hash(hdev, bank, chunk)]; i>=0; i=entries[i].hnext) {
+        if(entries[i].hdev == hdev && entries[i].bank == bank && entries[i].chunk == chunk) {
+            lru_unlink(i);
+            lru_push(i);
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/** Reuses least recently used entry for given chunk, data has to be filled by caller. */
+static int cache_insert(usb_dev_handle* hdev, u8 bank, u32 chunk) {
+    int     i = lruTail;
+    int*    p;
+
+    if(entries[i].valid) {
+        for(p=&hashHeads[cache_hash(entries[i].hdev, entries[i].bank, entries[i].chunk)]; *p!=i; p=&entries[*p].hnext);
+        *p = entries[i].hnext;
+    }
+
+    entries[i].hdev = hdev;
+    entries[i].bank = bank;
+    entries[i].chunk = chunk;
+    entries[i].valid = 1;
+    entries[i].hnext = hashHeads[cache_hash(hdev, bank, chunk)];
+    hashHeads[cache_hash(hdev, bank, chunk)] = i;
+    lru_unlink(i);
+    lru_push(i);
+
+    return i;
+}
+
+/** Reads count chunks of bank starting from chunk with as few commands as possible. */
+static int fetch(usb_dev_handle* hdev, const struct sBankGeom* g, u8 bank, u8* buff, u32 chunk, u32 count) {
+    u32 spc = ZEN_CACHE_CHUNK / g->sectorSize; /* sectors per chunk */
+    u32 sectors = count * spc;
+
+    if(chunk * spc + sectors > g->sectorsCount)
+        sectors = g->sectorsCount - chunk * spc;
+
+    memset(buff + sectors * g->sectorSize, 0, count * ZEN_CACHE_CHUNK - sectors * g->sectorSize);
+
+    return read_sector_buf(hdev, buff, bank, g->sectorSize, chunk * spc, sectors);
+}
+
+/** Reads range without cache, whole sectors go straight to buff, partial ones at the edges through stack. */
+static int read_direct(usb_dev_handle* hdev, const struct sBankGeom* g, u8 bank, u64 offset, u64 end, u8* buff) {
+    u8  edge[ZEN_CACHE_CHUNK]; /* sector size divides chunk size */
+    u64 pos = offset;
+    u32 ss = g->sectorSize, from, n;
+
+    if(pos % ss != 0 || end - pos < ss) {
+        from = (u32)(pos % ss);
+        n = end - pos < ss - from ? (u32)(end - pos) : ss - from;
+        if(read_sector_buf(hdev, edge, bank, ss, (u32)(pos / ss), 1) != ZEN_SUCC)
+            return ZEN_ERROR;
+        memcpy(buff, edge + from, n);
+        pos += n;
+    }
+
+    if((n = (u32)((end - pos) / ss)) > 0) {
+        if(read_sector_buf(hdev, buff + (pos - offset), bank, ss, (u32)(pos / ss), n) != ZEN_SUCC)
+            return ZEN_ERROR;
+        pos += (u64)n * ss;
+    }
+
+    if(pos < end) {
+        if(read_sector_buf(hdev, edge, bank, ss, (u32)(pos / ss), 1) != ZEN_SUCC)
+            return ZEN_ERROR;
+        memcpy(buff + (pos - offset), edge, (size_t)(end - pos));
+    }
+
+    return ZEN_SUCC;
+}
+
+s64 zen_read_bank_range(usb_dev_handle *hdev, u8 bank, u64 offset, u32 len, u8* buff) {
+    struct sDevGeom*    dg;
+    struct sBankGeom*   g;
+    struct sBankSize    bankSize;
+    u64                 size, end, pos;
+    u32                 chunk, first, last, lastChunk, run, i;
+    int                 e;
+
+    if(hdev==NULL) 
+        return ZEN_ERROR;
+
+    if((dg = geom_of(hdev)) == NULL) {
+        zen_log("Sector cache can't track more than %d devices\n", ZEN_DEVS_MAX);
+        return ZEN_ERROR;
+    }
+    g = &dg->bank[bank];
+
+    if(!g->known) {
+        if(read_bank_size(hdev, bank, &bankSize) == ZEN_ERROR)
+            return ZEN_ERROR;
+        if(bankSize.sectorSize == 0 || ZEN_CACHE_CHUNK % bankSize.sectorSize != 0) {
+            zen_log("Bank %u has unsupported sector size %u\n", bank, bankSize.sectorSize);
+            return ZEN_ERROR;
+        }
+        g->sectorSize = bankSize.sectorSize;
+        g->sectorsCount = bankSize.sectorsCount;
+        g->known = 1;
+    }
+
+    size = (u64)g->sectorsCount * g->sectorSize;
+    if(offset >= size || len == 0)
+        return 0;
+    end = offset + len < size ? offset + len : size;
+
+    first = (u32)(offset / ZEN_CACHE_CHUNK);
+    last = (u32)((end - 1) / ZEN_CACHE_CHUNK);
+    lastChunk = (u32)((size - 1) / ZEN_CACHE_CHUNK);
+
+    /* sequential access grows the readahead window, random access resets it */
+    if(first == g->nextChunk || first + 1 == g->nextChunk)
+        g->window = g->window ? (g->window * 2 > ZEN_READAHEAD_MAX ? ZEN_READAHEAD_MAX : g->window * 2) : 1;
+    else
+        g->window = 0;
+    g->nextChunk = last + 1;
+
+    /* no cache, read only what is needed */
+    if(entriesCount == 0)
+        return read_direct(hdev, g, bank, offset, end, buff) == ZEN_SUCC ? (s64)(end - offset) : ZEN_ERROR;
+
+    for(chunk=first, pos=offset; chunk<=last; chunk++) {
+        u32 from, n;
+        u8* src;
+
+        if((e = cache_find(hdev, bank, chunk)) >= 0) {
+            cstats.hits++;
+            src = entries[e].data;
+        } else {
+            cstats.misses++;
+            /* fetch all missing chunks of the request plus readahead at once */
+            for(run=1; chunk + run <= last + g->window && chunk + run <= lastChunk && run < FETCH_MAX; run++)
+                if(cache_find(hdev, bank, chunk + run) >= 0)
+                    break;
+            if(fetch(hdev, g, bank, fetchBuff, chunk, run) != ZEN_SUCC)
+                return ZEN_ERROR;
+            cstats.fetches++;
+            if(chunk + run - 1 > last)
+                cstats.readahead += chunk + run - 1 - last;
+
+            for(i=0; i<run; i++)
+                memcpy(entries[cache_insert(hdev, bank, chunk + i)].data, fetchBuff + i * ZEN_CACHE_CHUNK, ZEN_CACHE_CHUNK);
+            src = entries[cache_find(hdev, bank, chunk)].data;
+        }
+
+        from = (u32)(pos - (u64)chunk * ZEN_CACHE_CHUNK);
+        n = (u32)((u64)(chunk + 1) * ZEN_CACHE_CHUNK < end ? (u64)(chunk + 1) * ZEN_CACHE_CHUNK - pos : end - pos);
+        memcpy(buff + (pos - offset), src + from, n);
+        pos += n;
+    }
+
+    return (s64)(end - offset);
+}
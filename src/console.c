@@ -9,7 +9,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "libzen.h"
+#include "metrics.h"
+#include "simdev.h"
+#include "battstore.h"
+#include "verify.h"
+#include "fingerprint.h"
+
+#ifndef WIN32
+# include <unistd.h>
+# include "fastopen.h"
+# include "sgopen.h"
+#endif
 
 void drawGauge(int val, int max, int width) {
     int i, unit, complete, _max;
@@ -35,11 +47,367 @@ void drawGauge(int val, int max, int width) {
 #define MODE_BASIC_INFO     0
 #define MODE_ZEN_INFO       1
 #define MODE_READ_FIRMWARE  2
+#define MODE_METRICS        3
+#define MODE_WRITE_BANK     4
+#define MODE_IMAGE          5
+#define MODE_HISTORY        6
+#define MODE_BATCH          7
+#define MODE_LAYOUT         8
+#define MODE_VERIFY         9
+#define MODE_MANIFEST       10
+#define MODE_FINGERPRINT    11
+
+/* Default interval between metrics polls in seconds */
+#define METRICS_INTERVAL    15
+
+/* How device is opened */
+#define OPEN_LIBUSB         0
+#define OPEN_SIM            1
+#define OPEN_FAST           2
+#define OPEN_SG             3
+
+/* How long to wait for device to become ready, ms */
+#define READY_WAIT          5000
+
+/* Maximal number of words in batch script line */
+#define BATCH_MAX_ARGS      8
+
+/* Progress line is refreshed at most that often, us */
+#define PROGRESS_INTERVAL   250000
+
+/* Remembers port of last device opened with -fast, in home directory */
+#define FAST_CACHE_FILE     ".zen-path"
+
+static volatile sig_atomic_t interrupted;
+
+/** Ctrl+C stops reading after current chunk, second Ctrl+C kills the program. */
+static void onInterrupt(int sig) {
+    interrupted = 1;
+    signal(sig, SIG_DFL);
+}
+
+/** Prints progress of bank reads on one line. */
+static void printProgress(void* ctx, const struct sZenProgress* p) {
+    static u64  last;
+    u64         now = zen_time_us();
+    int         finished = p->sectorsDone >= p->sectorsTotal;
+
+    if(!finished && now - last < PROGRESS_INTERVAL)
+        return;
+    last = now;
+
+    fprintf(stderr, "\rBank %u: %u/%u sectors, %.2f MB/s (avg %.2f MB/s), ", p->bank, p->sectorsDone,
+        p->sectorsTotal, p->rate, p->avgRate);
+    if(p->eta < 0)
+        fprintf(stderr, "ETA ?   ");
+    else
+        fprintf(stderr, "ETA %.0fs   ", p->eta);
+    if(finished)
+        fputc('\n', stderr);
+}
+
+usb_dev_handle* openZen(int vid, int pid, int how, const char* usbPath) {
+#ifndef WIN32
+    char        cacheFile[1024];
+    const char* home;
+
+    if(how == OPEN_FAST) {
+        if((home = getenv("HOME")) == NULL)
+            return init_zen_fast(vid, pid, usbPath, NULL);
+
+        snprintf(cacheFile, sizeof(cacheFile), "%s/%s", home, FAST_CACHE_FILE);
+        return init_zen_fast(vid, pid, usbPath, cacheFile);
+    }
+
+    if(how == OPEN_SG)
+        return init_zen_sg(vid, pid, usbPath);
+#endif
+    if(how == OPEN_SIM)
+        return sim_open();
+
+    return init_zen(vid, pid);
+}
+
+/** Metrics exporter loop, keeps the session open between polls and reopens it if device is gone. */
+int exportMetrics(int vid, int pid, const char* path, int interval, int how, const char* usbPath, const char* storePath) {
+    usb_dev_handle*     hdev = NULL;
+    struct sZenMetrics  m;
+    struct sBattStore   store;
+
+    if(storePath && batt_store_open(&store, storePath, vid, pid, 1) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    metrics_init(&m, vid, pid);
+    for(;;) {
+        if(hdev == NULL) {
+            hdev = openZen(vid, pid, how, usbPath);
+            if(hdev && zen_wait_ready(hdev, READY_WAIT) != ZEN_SUCC) {
+                deinit_zen(hdev);
+                hdev = NULL;
+            }
+        }
+
+        if(metrics_poll(hdev, &m) != ZEN_SUCC && hdev) {
+            deinit_zen(hdev);
+            hdev = NULL;
+        }
+
+        if(storePath && m.up && m.haveBatt)
+            batt_store_append(&store, (u32)time(NULL), &m.batt, m.volLimit);
+
+        if(metrics_write(path, &m) != ZEN_SUCC || interval <= 0)
+            break;
+
+#ifdef WIN32
+        Sleep(interval * 1000);
+#else
+        sleep(interval);
+#endif
+    }
+
+    if(hdev)
+        deinit_zen(hdev);
+    if(storePath)
+        batt_store_close(&store);
+
+    return m.up ? ZEN_SUCC : ZEN_ERROR;
+}
+
+/** Prints all samples of one tier of battery history. */
+int printHistory(const char* path, int tier) {
+    struct sBattStore   store;
+    struct sBattSample  samples[256];
+    u64                 pos;
+    int                 i, count;
+    char                date[32];
+    time_t              t;
+
+    if(batt_store_open(&store, path, 0, 0, 0) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    printf("VID=0x%.4X, PID=0x%.4X, tier %d\n", store.header->vid, store.header->pid, tier);
+    /* paged by position, samples with the same time would be skipped by time */
+    pos = 0;
+    do {
+        if((count = batt_store_read(&store, tier, &pos, samples, 256)) == ZEN_ERROR) {
+            puts("Reading history failed, tier doesn't exist or store is busy");
+            batt_store_close(&store);
+            return ZEN_ERROR;
+        }
+
+        for(i=0; i<count; i++) {
+            t = samples[i].time;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("%s\t%d%% (%d-%d%%)\t%s\t", date, samples[i].level, samples[i].levelMin, samples[i].levelMax,
+                samples[i].state == ZEN_BATT_FULL ? "FULL" : "CHARGING");
+            if(samples[i].volLimit != 0xFF)
+                printf("vol %d%%\t", samples[i].volLimit);
+            printf("%u samples\n", samples[i].count);
+        }
+    } while(count == 256);
+
+    batt_store_close(&store);
+    return ZEN_SUCC;
+}
+
+/**
+ * Appends " key=value" to record, value is quoted if always is set or if it has spaces, '=' or
+ * quotes, quotes and backslashes inside are escaped. Too long value is cut, quotes stay paired.
+ */
+static void recStr(char* rec, size_t len, const char* key, const char* val, int always) {
+    size_t  used = strlen(rec);
+    int     n;
+
+    if(!always && val[0] != '\0' && strpbrk(val, " \t=\"\\") == NULL) {
+        snprintf(rec + used, len - used, " %s=%s", key, val);
+        return;
+    }
+
+    n = snprintf(rec + used, len - used, " %s=\"", key);
+    if(n < 0 || used + n + 2 > len) {
+        rec[used] = '\0';
+        return;
+    }
+    for(used+=n; *val && used + 4 < len; val++) {
+        if(*val == '"' || *val == '\\')
+            rec[used++] = '\\';
+        rec[used++] = *val;
+    }
+    rec[used++] = '"';
+    rec[used] = '\0';
+}
+
+/** Runs one batch operation, appends its results to rec. */
+static int runOp(usb_dev_handle* hdev, int argc, char* argv[], char* rec, size_t len) {
+    size_t used = strlen(rec);
+
+#define REC(...) snprintf(rec + used, len - used, __VA_ARGS__), used = strlen(rec)
+#define REC_STR(key, val, always) recStr(rec, len, key, val, always), used = strlen(rec)
+
+    if(strcmp(argv[0], "info") == 0 && argc == 1) {
+        int chipId, protoVer, capacity;
+
+        if((chipId = read_chip_id(hdev)) == ZEN_ERROR || (protoVer = read_protocol_ver(hdev)) == ZEN_ERROR
+            || (capacity = read_capacity(hdev)) == ZEN_ERROR)
+            return ZEN_ERROR;
+        REC(" cid=0x%.4X pver=0x%.4X mb=%d", chipId, protoVer, capacity);
+        REC_STR("profile", zen_get_profile(hdev)->name, 1);
+    } else if(strcmp(argv[0], "version") == 0 && argc == 1) {
+        struct sFirmwVer ver;
+
+        if(read_firmware_ver(hdev, &ver) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" version=%c.%c%c.%c", ver.major, ver.minor[0], ver.minor[1], ver.micro);
+    } else if(strcmp(argv[0], "batt") == 0 && argc == 1) {
+        struct sBattResp batt;
+
+        if(read_batt_info(hdev, &batt) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" level=%d full=%d", batt.level, batt.full == ZEN_BATT_FULL);
+    } else if(strcmp(argv[0], "vol") == 0 && argc == 1) {
+        int limit;
+
+        if((limit = read_vol_limit(hdev)) == ZEN_ERROR)
+            return ZEN_ERROR;
+        REC(" limit=%d", limit);
+    } else if(strcmp(argv[0], "vol") == 0 && (argc == 2 || argc == 3)) {
+        int limit = atoi(argv[1]);
+
+        if(limit < 0 || limit > 100 || write_vol_limit_pass(hdev, (u8)limit, argc == 3 ? argv[2] : NULL) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" limit=%d", limit);
+    } else if(strcmp(argv[0], "layout") == 0 && argc == 1) {
+        struct sZenLayout   layout;
+        int                 i;
+
+        if(read_device_layout(hdev, &layout) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" media=%u media_size=%llu drives=%u", layout.mediaCount, layout.mediaSize, layout.drivesCount);
+        for(i=0; i<layout.drivesCount; i++)
+            REC(" bank%u=0x%.2X:0x%.2X:%u:%u", layout.drive[i].bankNo, layout.drive[i].type, layout.drive[i].tag,
+                layout.drive[i].sectorSize, layout.drive[i].sectorsCount);
+    } else if(strcmp(argv[0], "bank") == 0 && argc == 3) {
+        struct sZenSink sink;
+        FILE*           f;
+        long            size;
+        int             res;
+
+        if((f = fopen(argv[2], "wb")) == NULL)
+            return ZEN_ERROR;
+        zen_sink_file(&sink, f);
+        res = read_bank_sink(hdev, (u8)atoi(argv[1]), &sink);
+        size = ftell(f);
+        if(fclose(f) != 0 || res != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" bank=%d", atoi(argv[1]));
+        REC_STR("file", argv[2], 0);
+        REC(" bytes=%ld", size);
+    } else if(strcmp(argv[0], "firmware") == 0 && argc == 2) {
+        if(read_firmware_dir(hdev, argv[1]) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC_STR("dir", argv[1], 0);
+    } else if(strcmp(argv[0], "verify") == 0 && argc == 2) {
+        struct sVerifyResult vr;
+        int                  res = verify_firmware(hdev, argv[1], &vr);
+
+        REC_STR("ref", argv[1], 0);
+        REC(" banks=%u bytes=%llu", vr.banks, vr.bytes);
+        if(vr.mismatch) {
+            REC(" match=0 bank=%u", vr.bankNo);
+            REC_STR("name", vr.name, 0);
+            REC_STR("reason", vr.reason, 1);
+            REC(" from=%llu to=%llu sectors=%u-%u", vr.from, vr.to, vr.sectorFrom, vr.sectorTo);
+        } else if(res == ZEN_SUCC)
+            REC(" match=1");
+        if(res != ZEN_SUCC)
+            return ZEN_ERROR;
+    } else if(strcmp(argv[0], "fingerprint") == 0 && argc == 2) {
+        struct sFingerprint fp;
+
+        if(fingerprint_identify(hdev, argv[1], NULL, &fp) != ZEN_SUCC)
+            return ZEN_ERROR;
+        REC(" sample=%08x sectors=%u", fp.sample, fp.sectors);
+        if(fp.hasFull)
+            REC(" full=%08x", fp.full);
+        REC_STR("build", fp.name, 1);
+    } else {
+        REC(" error=usage");
+        return ZEN_ERROR;
+    }
+#undef REC_STR
+#undef REC
+
+    return ZEN_SUCC;
+}
+
+/**
+ * Executes operations from script in one session, one per line: info, version, batt,
+ * vol [limit [pass]], layout, bank n file, firmware dir, verify ref,
+ * fingerprint db. Prints one record per operation, values which could break key=value
+ * parsing are quoted.
+ */
+int runBatch(usb_dev_handle* hdev, FILE* script) {
+    char    line[512], rec[1024];
+    char*   args[BATCH_MAX_ARGS];
+    int     argc, lineNo, res = ZEN_SUCC, c;
+    u64     start;
 
+    for(lineNo=1; fgets(line, sizeof(line), script) != NULL; lineNo++) {
+        /* cut line would run as two operations */
+        if(strchr(line, '\n') == NULL && !feof(script)) {
+            while((c = fgetc(script)) != EOF && c != '\n')
+                ;
+            printf("op=? line=%d status=error reason=\"line longer than %d characters\"\n", lineNo, (int)sizeof(line) - 2);
+            res = ZEN_ERROR;
+            continue;
+        }
+
+        line[strcspn(line, "#\r\n")] = '\0';
+        for(argc=0; argc<BATCH_MAX_ARGS && (args[argc] = strtok(argc ? NULL : line, " \t")) != NULL; argc++)
+            ;
+        if(argc == 0)
+            continue;
+
+        /* operation with words cut off would run with other arguments */
+        if(argc == BATCH_MAX_ARGS && strtok(NULL, " \t") != NULL) {
+            rec[0] = '\0';
+            recStr(rec, sizeof(rec), "op", args[0], 0);
+            /* record starts without separator */
+            printf("%s line=%d status=error reason=\"more than %d words\"\n", rec + 1, lineNo, BATCH_MAX_ARGS);
+            res = ZEN_ERROR;
+            continue;
+        }
+
+        rec[0] = '\0';
+        recStr(rec, sizeof(rec), "op", args[0], 0);
+        memmove(rec, rec + 1, strlen(rec));
+        snprintf(rec + strlen(rec), sizeof(rec) - strlen(rec), " line=%d", lineNo);
+        start = zen_time_us();
+        if(runOp(hdev, argc, args, rec, sizeof(rec) - 32) == ZEN_SUCC)
+            printf("%s status=ok ms=%llu\n", rec, (zen_time_us() - start) / 1000);
+        else {
+            printf("%s status=error ms=%llu\n", rec, (zen_time_us() - start) / 1000);
+            res = ZEN_ERROR;
+        }
+        fflush(stdout);
+    }
+
+    return res;
+}
 
 int main(int argc, char* argv[]) {
     usb_dev_handle* hdev;
-    int             mode, vid, pid, argpos;
+    int             mode, vid, pid, argpos, interval, how, confirmed;
+    const char*     usbPath = NULL;
+    const char*     metricsPath = NULL;
+    const char*     storePath = NULL;
+    const char*     bankPath = NULL;
+    const char*     scriptPath = NULL;
+    const char*     outDir = ".";
+    const char*     learnName = NULL;
+    int             bankNo = 0;
+    int             tier = 0;
+    int             result = ZEN_SUCC;
 
     if(argc <= 1) { /* do not use getopt */
         printf("Usage: %s <mode> <options>\n", argv[0]);
@@ -47,9 +415,38 @@ int main(int argc, char* argv[]) {
         puts("-i\t=> shows basic information about your mp3, saves it to .txt file");
         puts("-z\t=> shows information specific to Zen Stone");
         puts("-r\t=> reads firmware");
+        puts("-m file\t=> exports metrics in OpenMetrics format to file");
+        puts("-d file\t=> images data partition to file");
+        puts("-w 6 file => writes file to memory bank 6 and verifies it, may brick your mp3!");
+        puts("-hist file => prints battery history saved with -store");
+        puts("-b file => runs operations from file (- for stdin) in one session, one per line:");
+        puts("\tinfo, version, batt, vol, vol 80 [pass], layout, bank 6 file, firmware dir, verify ref,");
+        puts("\tfingerprint db");
+        puts("-l\t=> shows logical media and drives (memory banks)");
+        puts("-verify ref => compares firmware with files of -r in directory ref or with manifest file ref,");
+        puts("\tstops at first difference, exit code 1 if it differs");
+        puts("-fingerprint db => identifies firmware build by few sampled sectors using database db,");
+        puts("\treads whole firmware only if sample is unknown, exit code 1 if build is unknown");
+        puts("-manifest file => reads firmware and saves its manifest (crc32 of every 64KB) for -verify");
         puts("Option:");
         puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
         puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+#ifndef WIN32
+        puts("-fast => opens device through sysfs without scanning all USB devices, remembers its port");
+        puts("-path 1-1.4 => opens device connected to port 1-1.4 (see /sys/bus/usb/devices)");
+        puts("-sg => sends commands through SG_IO of usb_storage, device stays mounted");
+        puts("-sgnode /dev/sg2 => same as -sg with given device node");
+#endif
+        puts("-yes => doesn't ask for confirmation before writing");
+        printf("-t 15 => metrics are refreshed every 15 seconds (default %d), 0 to write once\n", METRICS_INTERVAL);
+        puts("-o dir => saves firmware read with -r to dir instead of current directory");
+        puts("-learn name => adds build unknown to -fingerprint to its database as name");
+        puts("-profiles file => loads device profiles (transfer size, timeouts, endpoints, quirks) overriding built-in ones,");
+        puts("\tone per line: name: vid=041E pid=4154 chip=3500 sectors=128 timeout=3000 timeout_min=250 in=81 out=02");
+        puts("\tquirks=24bit bad=C081,C082");
+        puts("-store file => saves battery history to file while exporting metrics");
+        printf("-tier 1 => history tier to print: 0 all samples, 1-%d downsampled (5 min, 1 hour, 1 day)\n", BATT_TIERS - 1);
         return ZEN_ERROR;
     }
 
@@ -63,7 +460,34 @@ int main(int argc, char* argv[]) {
         mode = MODE_ZEN_INFO;
     else if(strcmp(argv[argpos], "-r") == 0)
         mode = MODE_READ_FIRMWARE;
-    else {
+    else if(strcmp(argv[argpos], "-l") == 0)
+        mode = MODE_LAYOUT;
+    else if(strcmp(argv[argpos], "-m") == 0 && argpos + 1 < argc) {
+        mode = MODE_METRICS;
+        metricsPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-d") == 0 && argpos + 1 < argc) {
+        mode = MODE_IMAGE;
+        bankPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-w") == 0 && argpos + 2 < argc) {
+        mode = MODE_WRITE_BANK;
+        bankNo = atoi(argv[++argpos]);
+        bankPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-b") == 0 && argpos + 1 < argc) {
+        mode = MODE_BATCH;
+        scriptPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-verify") == 0 && argpos + 1 < argc) {
+        mode = MODE_VERIFY;
+        bankPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-manifest") == 0 && argpos + 1 < argc) {
+        mode = MODE_MANIFEST;
+        bankPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-fingerprint") == 0 && argpos + 1 < argc) {
+        mode = MODE_FINGERPRINT;
+        bankPath = argv[++argpos];
+    } else if(strcmp(argv[argpos], "-hist") == 0 && argpos + 1 < argc) {
+        mode = MODE_HISTORY;
+        storePath = argv[++argpos];
+    } else {
         printf("Unknown mode: %s\n", argv[argpos]);
         return ZEN_ERROR;
     }
@@ -72,11 +496,46 @@ int main(int argc, char* argv[]) {
     /* reading options */
     vid = ZEN_VENDOR;
     pid = ZEN_PRODUCT;
+    interval = METRICS_INTERVAL;
+    how = OPEN_LIBUSB;
+    confirmed = 0;
     while(argpos < argc) {
         if(strcmp(argv[argpos], "-vid") == 0)
             sscanf(argv[++argpos], "%x", &vid);
         else if(strcmp(argv[argpos], "-pid") == 0)
             sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-t") == 0 && argpos + 1 < argc)
+            interval = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            how = OPEN_SIM;
+#ifndef WIN32
+        else if(strcmp(argv[argpos], "-fast") == 0)
+            how = OPEN_FAST;
+        else if(strcmp(argv[argpos], "-path") == 0 && argpos + 1 < argc) {
+            how = OPEN_FAST;
+            usbPath = argv[++argpos];
+        }
+        else if(strcmp(argv[argpos], "-sg") == 0)
+            how = OPEN_SG;
+        else if(strcmp(argv[argpos], "-sgnode") == 0 && argpos + 1 < argc) {
+            how = OPEN_SG;
+            usbPath = argv[++argpos];
+        }
+#endif
+        else if(strcmp(argv[argpos], "-yes") == 0)
+            confirmed = 1;
+        else if(strcmp(argv[argpos], "-store") == 0 && argpos + 1 < argc)
+            storePath = argv[++argpos];
+        else if(strcmp(argv[argpos], "-tier") == 0 && argpos + 1 < argc)
+            tier = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-o") == 0 && argpos + 1 < argc)
+            outDir = argv[++argpos];
+        else if(strcmp(argv[argpos], "-learn") == 0 && argpos + 1 < argc)
+            learnName = argv[++argpos];
+        else if(strcmp(argv[argpos], "-profiles") == 0 && argpos + 1 < argc) {
+            if(zen_profile_load(argv[++argpos]) == ZEN_ERROR)
+                return ZEN_ERROR;
+        }
         else {
             printf("Unknown option: %s\n", argv[argpos]);
             return ZEN_ERROR;
@@ -87,7 +546,13 @@ int main(int argc, char* argv[]) {
     if(vid != ZEN_VENDOR || pid != ZEN_PRODUCT)
         printf("Using non default ids -> VID=0x%.4X, PID=0x%.4X\n", vid, pid);
 
-    hdev = init_zen(vid, pid);
+    if(mode == MODE_METRICS)
+        return exportMetrics(vid, pid, metricsPath, interval, how, usbPath, storePath);
+
+    if(mode == MODE_HISTORY)
+        return printHistory(storePath, tier);
+
+    hdev = openZen(vid, pid, how, usbPath);
 
     if(!hdev) {
         puts("Zen Stone not found or error occured.");
@@ -96,12 +561,13 @@ int main(int argc, char* argv[]) {
         puts("Unix:");
         puts("If you get error \"Device or resource busy\" " \
              "probably some other driver is using your Zen, " \
-             "try to umount your device or unload its driver (usb_storage) with rmmod driver_name.");
+             "try to umount your device or unload its driver (usb_storage) with rmmod driver_name, " \
+             "or use -sg to send commands through usb_storage.");
         return ZEN_ERROR;
     }
 
-    if(device_ready(hdev) != ZEN_SUCC) {
-        puts("Device detected, but is not ready, try running the program again.");
+    if(zen_wait_ready(hdev, READY_WAIT) != ZEN_SUCC) {
+        printf("Device detected, but wasn't ready within %d seconds.\n", READY_WAIT / 1000);
         deinit_zen(hdev);
         return ZEN_ERROR;
     }
@@ -127,6 +593,8 @@ int main(int argc, char* argv[]) {
             }
             printf("Chip id: 0x%.4X\n", chipId);
             fprintf(f, "CID=0x%.4X\n", chipId);
+            printf("Profile: %s\n", zen_get_profile(hdev)->name);
+            fprintf(f, "PROFILE=%s\n", zen_get_profile(hdev)->name);
 
             if((protoVer = read_protocol_ver(hdev)) == ZEN_ERROR) {
                 fclose(f);
@@ -180,9 +648,177 @@ int main(int argc, char* argv[]) {
                 puts("Continuing anyway...");
             }
                     
-            if(read_firmware(hdev) == ZEN_SUCC)
+            puts("Press Ctrl+C to stop reading, device will be released");
+            zen_set_progress(printProgress, NULL);
+            zen_set_cancel(&interrupted);
+            signal(SIGINT, onInterrupt);
+
+            if(read_firmware_dir(hdev, outDir) == ZEN_SUCC)
                 printf("Reading firmware succeded\n");
+            else if(zen_cancelled())
+                fprintf(stderr, "\nReading firmware cancelled, files may be incomplete\n");
+
+            signal(SIGINT, SIG_DFL);
+            zen_set_cancel(NULL);
+            zen_set_progress(NULL, NULL);
+
+            break;
+        }
+        case MODE_WRITE_BANK: {
+            FILE*   f;
+            char    answer[8];
+
+            if(!confirmed) {
+                printf("Writing memory bank %d with %s may make your mp3 unusable.\n", bankNo, bankPath);
+                printf("Type YES to continue: ");
+                fflush(stdout);
+                if(fgets(answer, sizeof(answer), stdin) == NULL || strcmp(answer, "YES\n") != 0) {
+                    puts("Aborted");
+                    result = ZEN_ERROR;
+                    goto deinit;
+                }
+            }
+
+            f = fopen(bankPath, "rb");
+            if(f == NULL) {
+                printf("Opening %s failed\n", bankPath);
+                result = ZEN_ERROR;
+                goto deinit;
+            }
+
+            if(write_bank(hdev, (u8)bankNo, f, ZEN_WRITE_CONFIRM) == ZEN_SUCC)
+                printf("Writing memory bank %d succeded\n", bankNo);
+            else {
+                printf("Writing memory bank %d failed\n", bankNo);
+                result = ZEN_ERROR;
+            }
+
+            fclose(f);
+            break;
+        }
+        case MODE_IMAGE: {
+            FILE*   f;
+
+            f = fopen(bankPath, "wb");
+            if(f == NULL) {
+                printf("Creating %s failed, check privileges\n", bankPath);
+                result = ZEN_ERROR;
+                goto deinit;
+            }
+
+            if(read_image(hdev, f) == ZEN_SUCC)
+                printf("Imaging data partition succeded\n");
+            else {
+                printf("Imaging data partition failed\n");
+                result = ZEN_ERROR;
+            }
+
+            fclose(f);
+            break;
+        }
+        case MODE_LAYOUT: {
+            struct sZenLayout   layout;
+            const char*         name;
+            int                 i;
+
+            if(read_device_layout(hdev, &layout) != ZEN_SUCC) {
+                puts("Reading device layout failed");
+                result = ZEN_ERROR;
+                goto deinit;
+            }
+
+            printf("Logical media: %u, default one has %u drives, %lluB", layout.mediaCount, layout.mediaDrives,
+                layout.mediaSize);
+            if(layout.mediaType != 0xFF)
+                printf(", type 0x%.2X", layout.mediaType);
+            putchar('\n');
+
+            puts("Bank\tType\tTag\tSector\tSectors\tSize\tName");
+            for(i=0; i<layout.drivesCount; i++) {
+                name = bank_tag_name(layout.drive[i].tag);
+                printf("%u\t0x%.2X\t0x%.2X\t%u\t%u\t%llu\t%s\n", layout.drive[i].bankNo, layout.drive[i].type,
+                    layout.drive[i].tag, layout.drive[i].sectorSize, layout.drive[i].sectorsCount, layout.drive[i].size,
+                    name ? name : "-");
+            }
+            break;
+        }
+        case MODE_VERIFY: {
+            struct sVerifyResult    vr;
+            u64                     start = zen_time_us();
 
+            zen_set_progress(printProgress, NULL);
+            zen_set_cancel(&interrupted);
+            signal(SIGINT, onInterrupt);
+
+            if(verify_firmware(hdev, bankPath, &vr) == ZEN_SUCC)
+                printf("Firmware matches %s: %u banks, %lluB in %.1fs\n", bankPath, vr.banks, vr.bytes,
+                    (zen_time_us() - start) / 1e6);
+            else if(vr.mismatch) {
+                printf("\nFirmware differs from %s in bank %u (%s): %s, bytes 0x%llX-0x%llX", bankPath, vr.bankNo,
+                    vr.name, vr.reason, vr.from, vr.to - 1);
+                if(vr.sectorTo > vr.sectorFrom)
+                    printf(", sectors %u-%u", vr.sectorFrom, vr.sectorTo - 1);
+                printf(", found after %lluB in %.1fs\n", vr.bytes, (zen_time_us() - start) / 1e6);
+                result = 1;
+            } else
+                result = ZEN_ERROR;
+
+            signal(SIGINT, SIG_DFL);
+            zen_set_cancel(NULL);
+            zen_set_progress(NULL, NULL);
+            break;
+        }
+        case MODE_MANIFEST: {
+            if(verify_make_manifest(hdev, bankPath) == ZEN_SUCC)
+                printf("Manifest saved to %s\n", bankPath);
+            else
+                result = ZEN_ERROR;
+            break;
+        }
+        case MODE_FINGERPRINT: {
+            struct sFingerprint fp;
+            u64                 start = zen_time_us();
+
+            zen_set_progress(printProgress, NULL);
+            zen_set_cancel(&interrupted);
+            signal(SIGINT, onInterrupt);
+
+            if(fingerprint_identify(hdev, bankPath, learnName, &fp) != ZEN_SUCC)
+                result = ZEN_ERROR;
+            else {
+                printf("%sSampled fingerprint %08x (%u sectors of %u banks)", fp.hasFull ? "\n" : "", fp.sample,
+                    fp.sectors, fp.banks);
+                if(fp.hasFull)
+                    printf(", full %08x", fp.full);
+                printf(" in %.0fms\n", (zen_time_us() - start) / 1e3);
+
+                if(fp.name[0] == '\0') {
+                    puts("Unknown build, add it with -learn name");
+                    result = 1;
+                } else if(fp.learned)
+                    printf("Build: %s (added to %s)\n", fp.name, bankPath);
+                else
+                    printf("Build: %s\n", fp.name);
+            }
+
+            signal(SIGINT, SIG_DFL);
+            zen_set_cancel(NULL);
+            zen_set_progress(NULL, NULL);
+            break;
+        }
+        case MODE_BATCH: {
+            FILE*   f = stdin;
+
+            if(strcmp(scriptPath, "-") != 0 && (f = fopen(scriptPath, "r")) == NULL) {
+                printf("Opening %s failed\n", scriptPath);
+                result = ZEN_ERROR;
+                goto deinit;
+            }
+
+            result = runBatch(hdev, f);
+
+            if(f != stdin)
+                fclose(f);
             break;
         }
     }
@@ -197,6 +833,6 @@ deinit:
         puts("Thank you. E-mail: 4m2@wp.pl");
     }
 
-    return ZEN_SUCC;
+    return result;
 }
 
@@ -0,0 +1,459 @@
+/*
+ * Name        : diff.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Compares firmware dumps or dump and device, writes and applies deltas
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "libzen.h"
+#include "simdev.h"
+#include "bindiff.h"
+
+/*
+ * Delta file is DELTA_MAGIC, u32 version and one entry per bank: u8 name
+ * length, name, u32 old size, u32 new size, u32 crc32 of new image (little
+ * endian) and encoded delta of bin_diff_write() ending with DIFF_OP_END.
+ */
+#define DELTA_MAGIC     "ZDLT"
+#define DELTA_VERSION   1
+
+#define MAX_BANKS       16
+/* Regions listed per bank without -v */
+#define REGIONS_SHOWN   16
+
+/** Image of one bank, from file or device. */
+struct sImage {
+    char    name[32];
+    u8*     data;
+    u32     size;
+};
+
+struct sImageSet {
+    struct sImage   image[MAX_BANKS];
+    int             count;
+};
+
+static int load_file(const char* path, struct sImage* img) {
+    FILE*   f;
+    long    size;
+
+    if((f = fopen(path, "rb")) == NULL)
+        return ZEN_ERROR;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+
+    img->size = size > 0 ? (u32)size : 0;
+    if((img->data = (u8*)malloc(img->size ? img->size : 1)) == NULL
+        || fread(img->data, 1, img->size, f) != img->size) {
+        zen_log("Reading %s failed\n", path);
+        free(img->data);
+        img->data = NULL;
+        fclose(f);
+        return ZEN_ERROR;
+    }
+    fclose(f);
+
+    return ZEN_SUCC;
+}
+
+static int is_dir(const char* path) {
+    struct stat info;
+
+    return stat(path, &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+/** Loads every file read_firmware() could have written to dir. */
+static int load_dir(const char* dir, struct sImageSet* set) {
+    static const u8 tags[] = {SIGMATEL_BANK_TAG_STMPSYS, SIGMATEL_BANK_TAG_USBMSC, SIGMATEL_BANK_TAG_RESOURCE_BIN,
+        SIGMATEL_BANK_TAG_BOOTMANAGER};
+    char            path[1024], name[32];
+    int             i;
+
+    set->count = 0;
+    for(i=0; i<(int)sizeof(tags) + 256 && set->count<MAX_BANKS; i++) {
+        if(i < (int)sizeof(tags))
+            snprintf(name, sizeof(name), "%s", bank_tag_name(tags[i]));
+        else
+            snprintf(name, sizeof(name), "bank%d.bin", i - (int)sizeof(tags));
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if(load_file(path, &set->image[set->count]) == ZEN_SUCC) {
+            strcpy(set->image[set->count].name, name);
+            set->count++;
+        }
+    }
+
+    return set->count ? ZEN_SUCC : ZEN_ERROR;
+}
+
+static const char* base_name(const char* path) {
+    const char* s = strrchr(path, '/');
+#ifdef WIN32
+    const char* b = strrchr(path, '\\');
+
+    if(b > s)
+        s = b;
+#endif
+    return s ? s + 1 : path;
+}
+
+static int load_any(const char* path, struct sImageSet* set) {
+    if(is_dir(path))
+        return load_dir(path, set);
+
+    set->count = 1;
+    snprintf(set->image[0].name, sizeof(set->image[0].name), "%s", base_name(path));
+    return load_file(path, &set->image[0]);
+}
+
+/** Hands buffer of memory sink over to its image. */
+static int keep_image(struct sZenSink* sink, int ok) {
+    struct sImage* img = (struct sImage*)sink->ctx;
+
+    img->data = sink->data;
+    img->size = (u32)sink->size;
+
+    return ZEN_SUCC;
+}
+
+/** Sink factory keeping every bank in memory. */
+static int mem_sink(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink) {
+    struct sImageSet* set = (struct sImageSet*)ctx;
+
+    if(set->count == MAX_BANKS)
+        return ZEN_SUCC;
+
+    zen_sink_mem(sink, NULL, (size_t)row->size);
+    sink->close = keep_image;
+    sink->ctx = &set->image[set->count];
+    snprintf(set->image[set->count].name, sizeof(set->image[0].name), "%s", name);
+    set->count++;
+
+    return ZEN_SUCC;
+}
+
+static struct sImage* find_image(struct sImageSet* set, const char* name) {
+    int i;
+
+    for(i=0; i<set->count; i++)
+        if(strcmp(set->image[i].name, name) == 0)
+            return &set->image[i];
+
+    return NULL;
+}
+
+static void free_set(struct sImageSet* set) {
+    int i;
+
+    for(i=0; i<set->count; i++)
+        free(set->image[i].data);
+    set->count = 0;
+}
+
+static int put_u32(struct sZenSink* sink, u32 v) {
+    u8 buff[4];
+
+    buff[0] = v & 0xFF;
+    buff[1] = (v >> 8) & 0xFF;
+    buff[2] = (v >> 16) & 0xFF;
+    buff[3] = (v >> 24) & 0xFF;
+
+    return sink->write(sink, buff, 4);
+}
+
+static u32 get_u32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void print_regions(const struct sDiff* diff, int verbose) {
+    const struct sDiffOp*   op;
+    u32                     i, shown;
+
+    for(i=0, shown=0; i<diff->count; i++) {
+        op = &diff->ops[i];
+        if(op->type == DIFF_OP_COPY && op->srcOffset == op->dstOffset)
+            continue;
+
+        if(!verbose && shown++ == REGIONS_SHOWN) {
+            puts("  ...");
+            return;
+        }
+
+        if(op->type == DIFF_OP_DATA)
+            printf("  0x%.8X +%u changed\n", op->dstOffset, op->len);
+        else
+            printf("  0x%.8X +%u moved from 0x%.8X\n", op->dstOffset, op->len, op->srcOffset);
+    }
+}
+
+/**
+ * Compares every bank, writes delta of changed ones, returns number of different banks.
+ * Two single file dumps are compared with each other whatever their names are.
+**/
+static int compare(struct sImageSet* oldSet, struct sImageSet* newSet, struct sZenSink* delta, int verbose, int single) {
+    struct sImage*  src;
+    struct sImage*  dst;
+    struct sImage   empty;
+    struct sDiff    diff;
+    struct sZenSink counter;
+    u64             start, time;
+    u8              nameLen;
+    int             i, differ = 0;
+
+    memset(&empty, 0, sizeof(struct sImage));
+    for(i=0; i<newSet->count; i++) {
+        dst = &newSet->image[i];
+        if((src = single ? &oldSet->image[0] : find_image(oldSet, dst->name)) == NULL) {
+            printf("%s: only in new\n", dst->name);
+            src = &empty;
+        }
+
+        start = zen_time_us();
+        if(bin_diff(src->data, src->size, dst->data, dst->size, &diff) != ZEN_SUCC)
+            return ZEN_ERROR;
+        time = zen_time_us() - start;
+
+        if(src != &empty && src->size == dst->size && diff.changedBytes == 0 && diff.movedBytes == 0) {
+            printf("%s: %uB identical, %.2f ms\n", dst->name, dst->size, time / 1000.0);
+            bin_diff_free(&diff);
+            continue;
+        }
+        differ++;
+
+        zen_sink_mem(&counter, NULL, 0);
+        if(bin_diff_write(&diff, dst->data, &counter) != ZEN_SUCC) {
+            printf("%s: encoding delta failed\n", dst->name);
+            free(counter.data);
+            bin_diff_free(&diff);
+            return ZEN_ERROR;
+        }
+        printf("%s: %uB -> %uB, %uB changed, %uB moved, delta %luB, %.2f ms\n", dst->name, src->size, dst->size,
+            diff.changedBytes, diff.movedBytes, (unsigned long)counter.size, time / 1000.0);
+        print_regions(&diff, verbose);
+
+        if(delta) {
+            nameLen = (u8)strlen(dst->name);
+            if(delta->write(delta, &nameLen, 1) != ZEN_SUCC || delta->write(delta, (const u8*)dst->name, nameLen) != ZEN_SUCC
+                || put_u32(delta, src->size) != ZEN_SUCC || put_u32(delta, dst->size) != ZEN_SUCC
+                || put_u32(delta, zen_crc32(0, dst->data, dst->size)) != ZEN_SUCC
+                || delta->write(delta, counter.data, counter.size) != ZEN_SUCC) {
+                free(counter.data);
+                bin_diff_free(&diff);
+                return ZEN_ERROR;
+            }
+        }
+        free(counter.data);
+        bin_diff_free(&diff);
+    }
+
+    for(i=0; i<oldSet->count && !single; i++)
+        if(find_image(newSet, oldSet->image[i].name) == NULL) {
+            printf("%s: only in old\n", oldSet->image[i].name);
+            differ++;
+        }
+
+    return differ;
+}
+
+static int write_file(const char* path, const u8* data, u32 size) {
+    struct sZenSink file;
+    int             res;
+
+    if(zen_sink_path(&file, path) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    res = file.write(&file, data, size);
+    if(zen_sink_close(&file, res == ZEN_SUCC) != ZEN_SUCC)
+        res = ZEN_ERROR;
+
+    return res;
+}
+
+/** Rebuilds changed banks from old dump and delta file, unchanged banks aren't written. */
+static int apply(struct sImageSet* oldSet, const char* deltaPath, const char* out, int single) {
+    struct sImage   deltaFile;
+    struct sImage   empty;
+    struct sImage*  src;
+    struct sZenSink sink;
+    char            name[256], path[1024];
+    u32             pos, srcSize, dstSize, crc;
+    int             used;
+
+    if(load_file(deltaPath, &deltaFile) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(deltaFile.size < 8 || memcmp(deltaFile.data, DELTA_MAGIC, 4) != 0 || get_u32(deltaFile.data + 4) != DELTA_VERSION) {
+        printf("%s is not a delta file\n", deltaPath);
+        free(deltaFile.data);
+        return ZEN_ERROR;
+    }
+
+    memset(&empty, 0, sizeof(struct sImage));
+    for(pos=8; pos<deltaFile.size; pos+=used) {
+        if(deltaFile.size - pos < 1u + deltaFile.data[pos] + 12)
+            break;
+        memcpy(name, deltaFile.data + pos + 1, deltaFile.data[pos]);
+        name[deltaFile.data[pos]] = '\0';
+        pos += 1 + deltaFile.data[pos];
+        srcSize = get_u32(deltaFile.data + pos);
+        dstSize = get_u32(deltaFile.data + pos + 4);
+        crc = get_u32(deltaFile.data + pos + 8);
+        pos += 12;
+
+        src = single ? &oldSet->image[0] : find_image(oldSet, name);
+        if(src == NULL && srcSize == 0)
+            src = &empty;
+        if(src == NULL || src->size != srcSize) {
+            printf("%s: old image doesn't match delta\n", name);
+            break;
+        }
+
+        zen_sink_mem(&sink, NULL, dstSize);
+        if((used = bin_patch(src->data, src->size, deltaFile.data + pos, deltaFile.size - pos, &sink)) == ZEN_ERROR
+            || sink.size != dstSize || zen_crc32(0, sink.data, dstSize) != crc) {
+            printf("%s: rebuilt image doesn't match delta\n", name);
+            free(sink.data);
+            break;
+        }
+
+        if(single)
+            snprintf(path, sizeof(path), "%s", out);
+        else
+            snprintf(path, sizeof(path), "%s/%s", out, name);
+
+        if(write_file(path, sink.data, dstSize) != ZEN_SUCC) {
+            free(sink.data);
+            break;
+        }
+        printf("%s: rebuilt %uB\n", name, dstSize);
+        free(sink.data);
+    }
+
+    free(deltaFile.data);
+    return pos == deltaFile.size ? ZEN_SUCC : ZEN_ERROR;
+}
+
+int main(int argc, char* argv[]) {
+    struct sImageSet    oldSet, newSet;
+    struct sZenSink     delta;
+    usb_dev_handle*     hdev;
+    const char*         paths[2];
+    const char*         deltaPath;
+    const char*         applyPath;
+    int                 argpos, vid, pid, device, simulate, verbose, pathsCount, res;
+    u32                 version;
+
+    if(argc <= 2) {
+        printf("Usage: %s <options> old [new]\n", argv[0]);
+        puts("old, new => directories written by zen_console -r, or single dump files");
+        puts("Returns 0 if dumps are the same, 1 if they differ");
+        puts("Option:");
+        puts("-dev => compares old with firmware read from device");
+        puts("-o file => writes delta of changed banks to file");
+        puts("-apply file => writes banks changed by delta file to new (directory or file), rebuilt from old");
+        puts("-v => lists all changed regions");
+        puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
+        puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+        return ZEN_ERROR;
+    }
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    device = simulate = verbose = pathsCount = 0;
+    deltaPath = applyPath = NULL;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-dev") == 0)
+            device = 1;
+        else if(strcmp(argv[argpos], "-o") == 0 && argpos + 1 < argc)
+            deltaPath = argv[++argpos];
+        else if(strcmp(argv[argpos], "-apply") == 0 && argpos + 1 < argc)
+            applyPath = argv[++argpos];
+        else if(strcmp(argv[argpos], "-v") == 0)
+            verbose = 1;
+        else if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            simulate = device = 1;
+        else if(pathsCount < 2)
+            paths[pathsCount++] = argv[argpos];
+        else {
+            printf("Unknown option: %s\n", argv[argpos]);
+            return ZEN_ERROR;
+        }
+    }
+
+    if(pathsCount != (device ? 1 : 2)) {
+        puts(device ? "Give only old dump with -dev" : "Give old and new dump");
+        return ZEN_ERROR;
+    }
+
+    if(load_any(paths[0], &oldSet) != ZEN_SUCC) {
+        printf("No dump found in %s\n", paths[0]);
+        return ZEN_ERROR;
+    }
+
+    if(applyPath) {
+        res = apply(&oldSet, applyPath, paths[1], !is_dir(paths[0]));
+        free_set(&oldSet);
+        return res;
+    }
+
+    if(device) {
+        hdev = simulate ? sim_open() : init_zen(vid, pid);
+        if(!hdev) {
+            puts("Zen Stone not found or error occured.");
+            free_set(&oldSet);
+            return ZEN_ERROR;
+        }
+
+        newSet.count = 0;
+        res = device_ready(hdev) == ZEN_SUCC ? read_firmware_sink(hdev, mem_sink, &newSet) : ZEN_ERROR;
+        deinit_zen(hdev);
+    } else
+        res = load_any(paths[1], &newSet);
+
+    if(res != ZEN_SUCC) {
+        puts("Reading new dump failed");
+        free_set(&oldSet);
+        free_set(&newSet);
+        return ZEN_ERROR;
+    }
+
+    if(deltaPath) {
+        if(zen_sink_path(&delta, deltaPath) != ZEN_SUCC) {
+            free_set(&oldSet);
+            free_set(&newSet);
+            return ZEN_ERROR;
+        }
+        version = DELTA_VERSION;
+        if(delta.write(&delta, (const u8*)DELTA_MAGIC, 4) != ZEN_SUCC || put_u32(&delta, version) != ZEN_SUCC) {
+            printf("Writing %s failed\n", deltaPath);
+            zen_sink_close(&delta, 0);
+            free_set(&oldSet);
+            free_set(&newSet);
+            return ZEN_ERROR;
+        }
+    }
+
+    res = compare(&oldSet, &newSet, deltaPath ? &delta : NULL, verbose, !device && !is_dir(paths[0]) && !is_dir(paths[1]));
+    if(deltaPath && zen_sink_close(&delta, res != ZEN_ERROR) != ZEN_SUCC)
+        res = ZEN_ERROR;
+
+    free_set(&oldSet);
+    free_set(&newSet);
+
+    if(res == ZEN_ERROR)
+        return ZEN_ERROR;
+
+    return res ? 1 : ZEN_SUCC;
+}
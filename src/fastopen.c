@@ -0,0 +1,277 @@
+/*
+ * Name        : fastopen.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Opens Zen Stone through sysfs and usbfs without libusb bus enumeration
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include "fastopen.h"
+
+#define SYSFS_USB       "/sys/bus/usb/devices"
+#define USBFS_DEV       "/dev/bus/usb/%03d/%03d"
+
+/* Zen Stone has single configuration and interface */
+#define FAST_CONFIG     1
+#define FAST_INTERFACE  0
+
+/* Older kernels refuse bulk transfers over 16KB per USBDEVFS_BULK */
+#define FAST_BULK_MAX   16384
+
+/* Handle returned by init_zen_fast(), it isn't libusb handle and only libzen may get it */
+struct sFastDev {
+    int fd;
+};
+
+#define FAST_FD(hdev)   (((struct sFastDev*)(hdev))->fd)
+
+/** Reads one line sysfs attribute of device, newline is stripped. */
+static int read_attr(const char* dev, const char* attr, char* buff, size_t len) {
+    char    path[128];
+    FILE*   f;
+
+    snprintf(path, sizeof(path), SYSFS_USB "/%s/%s", dev, attr);
+    if((f = fopen(path, "r")) == NULL)
+        return ZEN_ERROR;
+
+    if(fgets(buff, len, f) == NULL) {
+        fclose(f);
+        return ZEN_ERROR;
+    }
+    fclose(f);
+
+    buff[strcspn(buff, "\n")] = '\0';
+    return ZEN_SUCC;
+}
+
+static int read_num_attr(const char* dev, const char* attr, int base) {
+    char buff[16];
+
+    if(read_attr(dev, attr, buff, sizeof(buff)) != ZEN_SUCC || buff[0] == '\0')
+        return ZEN_ERROR;
+
+    return (int)strtol(buff, NULL, base);
+}
+
+static int match_ids(const char* dev, int vid, int pid) {
+    return read_num_attr(dev, "idVendor", 16) == vid && read_num_attr(dev, "idProduct", 16) == pid;
+}
+
+/** Finds device by ids reading only two small attributes of each device. */
+static int find_dev(int vid, int pid, char* out) {
+    struct dirent*  entry;
+    DIR*            dir;
+
+    if((dir = opendir(SYSFS_USB)) == NULL) {
+        zen_log("Opening %s failed\n", SYSFS_USB);
+        return ZEN_ERROR;
+    }
+
+    while((entry = readdir(dir)) != NULL) {
+        /* skip ., .., root hubs (usbN) and interfaces (1-1:1.0) */
+        if(entry->d_name[0] < '0' || entry->d_name[0] > '9' || strchr(entry->d_name, ':'))
+            continue;
+
+        if(strlen(entry->d_name) < FAST_PATH_LEN && match_ids(entry->d_name, vid, pid)) {
+            strcpy(out, entry->d_name);
+            closedir(dir);
+            return ZEN_SUCC;
+        }
+    }
+    closedir(dir);
+
+    return ZEN_ERROR;
+}
+
+static int load_cache(const char* cacheFile, char* out) {
+    FILE* f;
+
+    if(cacheFile == NULL || (f = fopen(cacheFile, "r")) == NULL)
+        return ZEN_ERROR;
+
+    if(fgets(out, FAST_PATH_LEN, f) == NULL) {
+        fclose(f);
+        return ZEN_ERROR;
+    }
+    fclose(f);
+
+    out[strcspn(out, "\n")] = '\0';
+    return out[0] ? ZEN_SUCC : ZEN_ERROR;
+}
+
+static void save_cache(const char* cacheFile, const char* dev) {
+    FILE* f;
+
+    if(cacheFile == NULL || (f = fopen(cacheFile, "w")) == NULL)
+        return;
+
+    fprintf(f, "%s\n", dev);
+    fclose(f);
+}
+
+static int fast_bulk(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout) {
+    struct usbdevfs_bulktransfer    bulk;
+    int                             done, res;
+
+    for(done=0; done<size; done+=res) {
+        bulk.ep = ep;
+        bulk.len = size - done > FAST_BULK_MAX ? FAST_BULK_MAX : size - done;
+        bulk.timeout = timeout;
+        bulk.data = bytes + done;
+
+        if((res = ioctl(FAST_FD(hdev), USBDEVFS_BULK, &bulk)) < 0)
+            return -errno;
+        /* short packet ends transfer */
+        if(res < (int)bulk.len)
+            return done + res;
+    }
+
+    return done;
+}
+
+static int fast_clear_halt(usb_dev_handle* hdev, int ep) {
+    unsigned int endpoint = ep;
+
+    return ioctl(FAST_FD(hdev), USBDEVFS_CLEAR_HALT, &endpoint) < 0 ? -errno : 0;
+}
+
+static int fast_reset(usb_dev_handle* hdev) {
+    struct usbdevfs_ctrltransfer ctrl;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    ctrl.bRequest = BOT_RESET;
+    ctrl.wIndex = FAST_INTERFACE;
+    ctrl.timeout = zen_get_profile(hdev)->timeout;
+
+    return ioctl(FAST_FD(hdev), USBDEVFS_CONTROL, &ctrl) < 0 ? -errno : 0;
+}
+
+#ifdef NP_DRIVER_DEATTACH
+/** Binds kernel driver to interface again, as usb_attach_kernel_driver_np() does for libusb handles. */
+static void fast_attach_driver(int fd) {
+    struct usbdevfs_ioctl command;
+
+    command.ifno = FAST_INTERFACE;
+    command.ioctl_code = USBDEVFS_CONNECT;
+    command.data = NULL;
+    ioctl(fd, USBDEVFS_IOCTL, &command);
+}
+#endif
+
+static void fast_close(usb_dev_handle* hdev) {
+    int fd = FAST_FD(hdev);
+    int ifno = FAST_INTERFACE;
+
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &ifno);
+#ifdef NP_DRIVER_DEATTACH
+    fast_attach_driver(fd);
+#endif
+    /** To prevent -110 (timeout) error */
+    ioctl(fd, USBDEVFS_RESET, NULL);
+    close(fd);
+    free(hdev);
+}
+
+static int fast_fd(usb_dev_handle* hdev) {
+    return FAST_FD(hdev);
+}
+
+static const struct sZenTransport fastTransport = { fast_bulk, fast_bulk, fast_close, fast_clear_halt, fast_reset, fast_fd };
+
+/** Opens usbfs node of device, detaches kernel driver, sets configuration and claims interface. */
+static struct sFastDev* open_dev(const char* dev) {
+    struct sFastDev*    fast;
+    char                path[64];
+    int                 busnum, devnum, config, ifno;
+
+    busnum = read_num_attr(dev, "busnum", 10);
+    devnum = read_num_attr(dev, "devnum", 10);
+    if(busnum == ZEN_ERROR || devnum == ZEN_ERROR)
+        return NULL;
+
+    if((fast = (struct sFastDev*)malloc(sizeof(struct sFastDev))) == NULL)
+        return NULL;
+
+    snprintf(path, sizeof(path), USBFS_DEV, busnum, devnum);
+    if((fast->fd = open(path, O_RDWR)) < 0) {
+        zen_log("Opening %s failed: %s\n", path, strerror(errno));
+        free(fast);
+        return NULL;
+    }
+
+#ifdef NP_DRIVER_DEATTACH
+    {
+        struct usbdevfs_ioctl command;
+
+        command.ifno = FAST_INTERFACE;
+        command.ioctl_code = USBDEVFS_DISCONNECT;
+        command.data = NULL;
+        if(ioctl(fast->fd, USBDEVFS_IOCTL, &command) < 0 && errno != ENODATA)
+            zen_log("USBDEVFS_DISCONNECT: %s\nContinuing anyway...\n", strerror(errno));
+    }
+#endif
+
+    /* setting active configuration again would reset the device */
+    config = FAST_CONFIG;
+    if(read_num_attr(dev, "bConfigurationValue", 10) != FAST_CONFIG
+        && ioctl(fast->fd, USBDEVFS_SETCONFIGURATION, &config) < 0) {
+        zen_log("USBDEVFS_SETCONFIGURATION: %s\n", strerror(errno));
+        close(fast->fd);
+        free(fast);
+        return NULL;
+    }
+
+    ifno = FAST_INTERFACE;
+    if(ioctl(fast->fd, USBDEVFS_CLAIMINTERFACE, &ifno) < 0) {
+        zen_log("USBDEVFS_CLAIMINTERFACE: %s\n", strerror(errno));
+        close(fast->fd);
+        free(fast);
+        return NULL;
+    }
+
+    if(zen_attach((usb_dev_handle*)fast, &fastTransport) != ZEN_SUCC) {
+        fast_close((usb_dev_handle*)fast);
+        return NULL;
+    }
+
+    return fast;
+}
+
+usb_dev_handle* init_zen_fast(int vid, int pid, const char* usbPath, const char* cacheFile) {
+    usb_dev_handle* hdev;
+    char            dev[FAST_PATH_LEN];
+
+    if(vid == 0)
+        vid = ZEN_VENDOR;
+
+    if(pid == 0)
+        pid = ZEN_PRODUCT;
+
+    if(usbPath) {
+        snprintf(dev, sizeof(dev), "%s", usbPath);
+        if(!match_ids(dev, vid, pid)) {
+            zen_log("No device 0x%.4X:0x%.4X at %s\n", vid, pid, dev);
+            return NULL;
+        }
+    } else if(load_cache(cacheFile, dev) != ZEN_SUCC || !match_ids(dev, vid, pid)) {
+        /* device moved to other port or was never opened */
+        if(find_dev(vid, pid, dev) != ZEN_SUCC)
+            return NULL;
+        save_cache(cacheFile, dev);
+    }
+
+    if((hdev = (usb_dev_handle*)open_dev(dev)) != NULL)
+        zen_profile_select(hdev, vid, pid);
+
+    return hdev;
+}
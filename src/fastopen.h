@@ -0,0 +1,39 @@
+/*
+ * Name        : fastopen.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Opens Zen Stone through sysfs and usbfs without libusb bus enumeration
+ */
+
+#ifndef FASTOPEN_H
+#define FASTOPEN_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Device name in /sys/bus/usb/devices, bus-port.port... e.g. "1-1.4" */
+#define FAST_PATH_LEN   32
+
+/**
+ * @brief
+ * Opens device without usb_find_busses()/usb_find_devices() (linux only). Device is
+ * found by port path, or by path remembered in cacheFile, or by scanning ids in sysfs.
+ * Returned handle works with all libzen functions and has its own usbfs transport
+ * attached with zen_attach(), it isn't libusb handle and must not be passed to libusb
+ * @param vid vendor id, 0 for default
+ * @param pid product id, 0 for default
+ * @param usbPath port path like "1-1.4", NULL to find device by ids
+ * @param cacheFile file remembering path of last opened device, may be NULL
+ * @return handle, NULL if device wasn't found or can't be claimed
+**/
+usb_dev_handle* init_zen_fast(int vid, int pid, const char* usbPath, const char* cacheFile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Name        : fingerprint.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Identifies firmware build from few sampled sectors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fingerprint.h"
+
+/** Banks read by read_firmware_sink(), others don't belong to firmware. */
+static int is_firmware_bank(u8 tag) {
+    return tag != SIGMATEL_BANK_TAG_DATA && tag != SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM;
+}
+
+/** Hashes geometry, so banks of other size or order don't match. */
+static u32 crc_drive(u32 crc, const struct sZenDrive* d) {
+    u8 row[10];
+    int i;
+
+    row[0] = d->bankNo;
+    row[1] = d->tag;
+    for(i=0; i<8; i++)
+        row[2 + i] = (u8)(d->size >> (8 * i));
+
+    return zen_crc32(crc, row, sizeof(row));
+}
+
+int fingerprint_sample(usb_dev_handle* hdev, struct sFingerprint* fp) {
+    struct sAllocTable  table;
+    struct sBankSize    bankSize;
+    struct sZenDrive    d;
+    u8*                 buff = NULL;
+    u8*                 grown;
+    u32                 crc = 0, sector, prev;
+    int                 i, j;
+
+    fp->banks = 0;
+    fp->sectors = 0;
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    for(i=0; i<table.rowsCount; i++) {
+        if(!is_firmware_bank(table.row[i].tag))
+            continue;
+
+        /* only sampled banks are sized */
+        if(read_bank_size(hdev, table.row[i].bankNo, &bankSize) == ZEN_ERROR) {
+            free(buff);
+            return ZEN_ERROR;
+        }
+        memset(&d, 0, sizeof(struct sZenDrive));
+        d.bankNo = table.row[i].bankNo;
+        d.tag = table.row[i].tag;
+        d.size = table.row[i].size;
+        d.sectorSize = bankSize.sectorSize;
+        d.sectorsCount = bankSize.sectorsCount;
+
+        crc = crc_drive(crc, &d);
+        fp->banks++;
+        if(d.sectorsCount == 0 || d.sectorSize == 0)
+            continue;
+
+        if((grown = (u8*)realloc(buff, d.sectorSize)) == NULL) {
+            free(buff);
+            return ZEN_ERROR;
+        }
+        buff = grown;
+
+        /* same sectors every time, small banks get each sector once */
+        for(j=0, prev=0; j<FINGERPRINT_SAMPLES; j++) {
+            sector = (u32)((u64)(d.sectorsCount - 1) * j / (FINGERPRINT_SAMPLES - 1));
+            if(j > 0 && sector == prev)
+                continue;
+            prev = sector;
+
+            if(read_sector_buf(hdev, buff, d.bankNo, d.sectorSize, sector, 1) != ZEN_SUCC) {
+                free(buff);
+                return ZEN_ERROR;
+            }
+            crc = zen_crc32(crc, buff, d.sectorSize);
+            fp->sectors++;
+        }
+    }
+    free(buff);
+
+    fp->sample = crc;
+    return ZEN_SUCC;
+}
+
+static int full_write(struct sZenSink* sink, const u8* data, size_t len) {
+    struct sFingerprint* fp = (struct sFingerprint*)sink->ctx;
+
+    fp->full = zen_crc32(fp->full, data, len);
+    return ZEN_SUCC;
+}
+
+static int full_factory(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink) {
+    struct sFingerprint*    fp = (struct sFingerprint*)ctx;
+    struct sZenDrive        d;
+
+    memset(&d, 0, sizeof(struct sZenDrive));
+    d.bankNo = row->bankNo;
+    d.tag = row->tag;
+    d.size = row->size;
+    fp->full = crc_drive(fp->full, &d);
+
+    sink->write = full_write;
+    sink->ctx = fp;
+
+    return ZEN_SUCC;
+}
+
+int fingerprint_full(usb_dev_handle* hdev, struct sFingerprint* fp) {
+    fp->full = 0;
+    fp->hasFull = 0;
+    if(read_firmware_sink(hdev, full_factory, fp) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    fp->hasFull = 1;
+    return ZEN_SUCC;
+}
+
+int fingerprint_find(const char* path, const struct sFingerprint* fp, char name[FINGERPRINT_NAME_LEN]) {
+    FILE*       f;
+    char        line[256];
+    unsigned    sample, full;
+    int         pos, len;
+
+    if((f = fopen(path, "r")) == NULL) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#' || sscanf(line, "%x %x %n", &sample, &full, &pos) != 2)
+            continue;
+
+        if(fp->hasFull ? full != fp->full : sample != fp->sample)
+            continue;
+
+        len = (int)strcspn(line + pos, "\r\n");
+        snprintf(name, FINGERPRINT_NAME_LEN, "%.*s", len, line + pos);
+        fclose(f);
+        return ZEN_SUCC;
+    }
+
+    fclose(f);
+    return ZEN_ERROR;
+}
+
+int fingerprint_learn(const char* path, const struct sFingerprint* fp, const char* name) {
+    FILE*   f;
+    int     res = ZEN_SUCC;
+
+    if(!fp->hasFull || (f = fopen(path, "a")) == NULL) {
+        zen_log("Adding build to %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(fprintf(f, "%08x %08x %s\n", fp->sample, fp->full, name) < 0)
+        res = ZEN_ERROR;
+    if(fclose(f) != 0)
+        res = ZEN_ERROR;
+
+    return res;
+}
+
+int fingerprint_identify(usb_dev_handle* hdev, const char* path, const char* learn, struct sFingerprint* fp) {
+    memset(fp, 0, sizeof(struct sFingerprint));
+    if(fingerprint_sample(hdev, fp) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(fingerprint_find(path, fp, fp->name) == ZEN_SUCC)
+        return ZEN_SUCC;
+
+    /* sampled sectors may miss a difference, only full read tells for sure */
+    zen_log("Sampled fingerprint %08x is unknown, reading whole firmware\n", fp->sample);
+    if(fingerprint_full(hdev, fp) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(fingerprint_find(path, fp, fp->name) == ZEN_SUCC)
+        return ZEN_SUCC;
+
+    if(learn) {
+        if(fingerprint_learn(path, fp, learn) != ZEN_SUCC)
+            return ZEN_ERROR;
+        snprintf(fp->name, sizeof(fp->name), "%s", learn);
+        fp->learned = 1;
+    }
+
+    return ZEN_SUCC;
+}
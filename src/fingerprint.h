@@ -0,0 +1,100 @@
+/*
+ * Name        : fingerprint.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Identifies firmware build from few sampled sectors
+ */
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sampled fingerprint is crc32 of allocation table of firmware banks and of
+ * FINGERPRINT_SAMPLES sectors spread evenly over each of them (first and last
+ * included), so it takes few commands instead of whole firmware. Full
+ * fingerprint is crc32 of all firmware banks, it's used when sampled one
+ * isn't known. Database is text file, one build per line:
+ *   # sample full name
+ *   5e1a07c2 0d4f2b91 Zen Stone 1.11.01
+ */
+
+/* Sectors read from each bank */
+#define FINGERPRINT_SAMPLES     8
+#define FINGERPRINT_NAME_LEN    64
+
+struct sFingerprint {
+    u32     sample;
+    u32     full;
+    /** Set when full was computed. */
+    int     hasFull;
+    /** Banks and sectors read for sample. */
+    u32     banks;
+    u32     sectors;
+    /** Build name, empty if build is unknown. */
+    char    name[FINGERPRINT_NAME_LEN];
+    /** Set when unknown build was added to database. */
+    int     learned;
+};
+
+/**
+ * @brief
+ * Identifies firmware build: looks sampled fingerprint up in database and reads whole
+ * firmware only when it isn't there
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param path database file
+ * @param learn name to add unknown build to database with, NULL to only identify
+ * @param fp result, name is empty if build is unknown, hasFull is set if firmware was read
+ * @return ZEN_SUCC if fingerprint was computed, even for unknown build
+**/
+int fingerprint_identify(usb_dev_handle* hdev, const char* path, const char* learn, struct sFingerprint* fp);
+
+/**
+ * @brief
+ * Computes sampled fingerprint of firmware banks
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param fp result, full is left untouched
+ * @return ZEN_SUCC if succeded
+**/
+int fingerprint_sample(usb_dev_handle* hdev, struct sFingerprint* fp);
+
+/**
+ * @brief
+ * Reads whole firmware and computes its full fingerprint
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param fp result, sets full and hasFull
+ * @return ZEN_SUCC if succeded
+**/
+int fingerprint_full(usb_dev_handle* hdev, struct sFingerprint* fp);
+
+/**
+ * @brief
+ * Looks fingerprint up in database, by full fingerprint if fp->hasFull is set, by sampled one otherwise
+ * @param path database file
+ * @param fp fingerprint
+ * @param name result, build name
+ * @return ZEN_SUCC if build was found, ZEN_ERROR if not found or database can't be read
+**/
+int fingerprint_find(const char* path, const struct sFingerprint* fp, char name[FINGERPRINT_NAME_LEN]);
+
+/**
+ * @brief
+ * Appends build to database, creates database if needed
+ * @param path database file
+ * @param fp fingerprint with full computed
+ * @param name build name
+ * @return ZEN_SUCC if succeded
+**/
+int fingerprint_learn(const char* path, const struct sFingerprint* fp, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * Name        : fuse.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Read-only FUSE filesystem exposing memory banks of Zen Stone
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "libzen.h"
+#include "simdev.h"
+
+#define CACHE_DEFAULT_MB    16
+
+#define ALLOC_TABLE_FILE    "alloc_table.txt"
+
+struct sBankFile {
+    char    name[24];
+    u8      bankNo;
+    u32     sectorSize;
+    u32     sectorsCount;
+    u64     size;
+};
+
+static usb_dev_handle*      hdev;
+static struct sBankFile     files[10];
+static int                  filesCount;
+static char                 tableText[1024];
+
+static struct sBankFile* find_name(const char* name) {
+    int i;
+
+    for(i=0; i<filesCount; i++)
+        if(strcmp(name, files[i].name) == 0)
+            return &files[i];
+
+    return NULL;
+}
+
+static struct sBankFile* find_file(const char* path) {
+    return find_name(path + 1);
+}
+
+static int zfs_getattr(const char* path, struct stat* st) {
+    struct sBankFile* f;
+
+    memset(st, 0, sizeof(struct stat));
+    if(strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else if(strcmp(path + 1, ALLOC_TABLE_FILE) == 0) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = strlen(tableText);
+    } else if((f = find_file(path)) != NULL) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = f->size;
+    } else
+        return -ENOENT;
+
+    return 0;
+}
+
+static int zfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info* fi) {
+    int i;
+
+    if(strcmp(path, "/") != 0)
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, ALLOC_TABLE_FILE, NULL, 0);
+    for(i=0; i<filesCount; i++)
+        filler(buf, files[i].name, NULL, 0);
+
+    return 0;
+}
+
+static int zfs_open(const char* path, struct fuse_file_info* fi) {
+    if(strcmp(path + 1, ALLOC_TABLE_FILE) != 0 && find_file(path) == NULL)
+        return -ENOENT;
+
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    return 0;
+}
+
+static int zfs_read(const char* path, char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+    struct sBankFile*   f;
+    s64                 res;
+
+    if(strcmp(path + 1, ALLOC_TABLE_FILE) == 0) {
+        size_t len = strlen(tableText);
+
+        if((size_t)off >= len)
+            return 0;
+        if(off + size > len)
+            size = len - off;
+        memcpy(buf, tableText + off, size);
+        return size;
+    }
+
+    if((f = find_file(path)) == NULL)
+        return -ENOENT;
+
+    if((res = zen_read_bank_range(hdev, f->bankNo, off, (u32)size, (u8*)buf)) == ZEN_ERROR)
+        return -EIO;
+
+    return (int)res;
+}
+
+static void zfs_destroy(void* data) {
+    struct sZenCacheStats st;
+
+    zen_cache_stats(&st);
+    zen_log("Cache: %llu hits, %llu misses, %llu device reads, %llu chunks read ahead\n", 
+        st.hits, st.misses, st.fetches, st.readahead);
+    deinit_zen(hdev);
+}
+
+static struct fuse_operations zfsOps;
+
+static int load_banks(void) {
+    struct sAllocTable  table;
+    struct sBankSize    bankSize;
+    const char*         name;
+    int                 i, len;
+
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    len = 0;
+    for(i=0; i<table.rowsCount; i++) {
+        struct sBankFile* f = &files[filesCount];
+
+        len += snprintf(tableText + len, sizeof(tableText) - len, "bank=%u type=%u tag=0x%.2X size=%llu\n", 
+            table.row[i].bankNo, table.row[i].type, table.row[i].tag, table.row[i].size);
+
+        if(read_bank_size(hdev, table.row[i].bankNo, &bankSize) == ZEN_ERROR)
+            return ZEN_ERROR;
+        if(bankSize.sectorsCount == 0)
+            continue;
+        if(bankSize.sectorSize == 0 || ZEN_CACHE_CHUNK % bankSize.sectorSize != 0) {
+            zen_log("Bank %u has unsupported sector size %u, skipping\n", table.row[i].bankNo, bankSize.sectorSize);
+            continue;
+        }
+
+        if((name = bank_tag_name(table.row[i].tag)) != NULL)
+            snprintf(f->name, sizeof(f->name), "%s", name);
+        else
+            snprintf(f->name, sizeof(f->name), "bank%u.bin", table.row[i].bankNo);
+        /* resource.bin is stored in two banks */
+        if(find_name(f->name) != NULL)
+            snprintf(f->name, sizeof(f->name), "bank%u.bin", table.row[i].bankNo);
+
+        f->bankNo = table.row[i].bankNo;
+        f->sectorSize = bankSize.sectorSize;
+        f->sectorsCount = bankSize.sectorsCount;
+        f->size = (u64)bankSize.sectorsCount * bankSize.sectorSize;
+        filesCount++;
+    }
+
+    return ZEN_SUCC;
+}
+
+int main(int argc, char* argv[]) {
+    char*   fuseArgv[64];
+    int     fuseArgc, argpos, vid, pid, simulate, cacheMb;
+
+    if(argc <= 1) {
+        printf("Usage: %s <options> mountpoint [FUSE options]\n", argv[0]);
+        puts("Option:");
+        puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
+        puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        printf("-cache 16 => uses 16MB for sector cache (default %d)\n", CACHE_DEFAULT_MB);
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+        return ZEN_ERROR;
+    }
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    simulate = 0;
+    cacheMb = CACHE_DEFAULT_MB;
+    fuseArgv[0] = argv[0];
+    fuseArgc = 1;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-cache") == 0 && argpos + 1 < argc)
+            cacheMb = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            simulate = 1;
+        else if(fuseArgc < 62)
+            fuseArgv[fuseArgc++] = argv[argpos];
+    }
+    /* libzen is not thread safe */
+    fuseArgv[fuseArgc++] = "-s";
+    fuseArgv[fuseArgc] = NULL;
+
+    if(zen_cache_enable((u32)cacheMb << 20) != ZEN_SUCC) {
+        puts("Not enough memory for cache");
+        return ZEN_ERROR;
+    }
+
+    hdev = simulate ? sim_open() : init_zen(vid, pid);
+    if(!hdev) {
+        puts("Zen Stone not found or error occured.");
+        return ZEN_ERROR;
+    }
+
+    if(device_ready(hdev) != ZEN_SUCC || load_banks() != ZEN_SUCC) {
+        puts("Device detected, but reading allocation table failed, try running the program again.");
+        deinit_zen(hdev);
+        return ZEN_ERROR;
+    }
+
+    zfsOps.getattr = zfs_getattr;
+    zfsOps.readdir = zfs_readdir;
+    zfsOps.open = zfs_open;
+    zfsOps.read = zfs_read;
+    zfsOps.destroy = zfs_destroy;
+
+    return fuse_main(fuseArgc, fuseArgv, &zfsOps, NULL);
+}
@@ -36,6 +36,10 @@ struct usb_ioctl {
 #define IOCTL_USB_IOCTL     _IOWR('U', 18, struct usb_ioctl)
 #define IOCTL_USB_CONNECT   _IO('U', 23)
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * @brief
  * Reattaches the USB device (was in older versions of libusb)
@@ -44,5 +48,9 @@ struct usb_ioctl {
 **/
 int usb_attach_kernel_driver_np(usb_dev_handle* dev, int interFace); /* capital F because interface is a keyword */
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
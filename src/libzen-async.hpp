@@ -0,0 +1,504 @@
+/*
+ * Name        : libzen-async.hpp
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : C++20 coroutine API over libzen, one thread drives many devices
+ */
+
+#ifndef LIBZEN_ASYNC_HPP
+#define LIBZEN_ASYNC_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include "libzen.h"
+#include "probes.h"
+
+/*
+ * libusb 0.1 has only blocking transfers, so bulk transfers are submitted
+ * as URBs directly to usbfs file descriptor of the handle (linux only), the
+ * transport of handle tells it, see zen_usbfs_fd(). Completed URBs make the
+ * descriptor writable, loop polls all of them. Handles without descriptor
+ * (SG_IO, simulated device) run whole commands with blocking libzen calls.
+ */
+
+namespace zen {
+
+using clock = std::chrono::steady_clock;
+
+class loop;
+
+/** Coroutine returning T, starts when awaited. */
+template<class T>
+class task {
+public:
+    struct promise_type {
+        std::optional<T>        value;
+        std::exception_ptr      error;
+        std::coroutine_handle<> continuation;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation ? h.promise().continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    task(task&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    task(const task&) = delete;
+    ~task() { if(h) h.destroy(); }
+
+    bool await_ready() const noexcept { return !h || h.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+        h.promise().continuation = cont;
+        return h;
+    }
+    T await_resume() {
+        if(h.promise().error)
+            std::rethrow_exception(h.promise().error);
+        return std::move(*h.promise().value);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+template<>
+class task<void> {
+public:
+    struct promise_type {
+        std::exception_ptr      error;
+        std::coroutine_handle<> continuation;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation ? h.promise().continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    task(task&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    task(const task&) = delete;
+    ~task() { if(h) h.destroy(); }
+
+    bool await_ready() const noexcept { return !h || h.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+        h.promise().continuation = cont;
+        return h;
+    }
+    void await_resume() {
+        if(h.promise().error)
+            std::rethrow_exception(h.promise().error);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+/** Same layout as usbdevfs_urb without iso_frame_desc, which can't be embedded. */
+struct bulk_urb {
+    unsigned char   type;
+    unsigned char   endpoint;
+    int             status;
+    unsigned int    flags;
+    void*           buffer;
+    int             buffer_length;
+    int             actual_length;
+    int             start_frame;
+    int             number_of_packets;
+    int             error_count;
+    unsigned int    signr;
+    void*           usercontext;
+};
+
+static_assert(sizeof(bulk_urb) == sizeof(usbdevfs_urb), "usbdevfs_urb layout changed");
+
+/** Bulk transfer in flight, lives in the frame of awaiting coroutine. */
+struct transfer {
+    loop&                   ev;
+    int                     fd;
+    bulk_urb                urb;
+    clock::time_point       deadline;
+    std::stop_token         stop;
+    std::coroutine_handle<> waiter;
+    /** Transferred bytes or -errno, -ETIMEDOUT and -ECANCELED are set by loop. */
+    int                     result;
+    int                     discardReason;
+
+    transfer(loop& l, int fd_, int ep, void* buff, int len, clock::time_point dl, std::stop_token st)
+        : ev(l), fd(fd_), urb(), deadline(dl), stop(std::move(st)), result(0), discardReason(0) {
+        urb.type = USBDEVFS_URB_TYPE_BULK;
+        urb.endpoint = (unsigned char)ep;
+        urb.buffer = buff;
+        urb.buffer_length = len;
+        urb.usercontext = this;
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    int await_resume() const noexcept { return result; }
+};
+
+/** Timer, resumes the coroutine after given time. */
+struct sleeper {
+    loop&                   ev;
+    clock::time_point       when;
+
+    bool await_ready() const noexcept { return clock::now() >= when; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() const noexcept {}
+};
+
+/** Event loop, all coroutines using it have to run on the same thread. */
+class loop {
+public:
+    /** Starts coroutine right away, it is destroyed when finished. */
+    void spawn(task<void> t) { start(std::move(t)); }
+
+    /** Sleeps without blocking other devices. */
+    sleeper sleep(std::chrono::milliseconds ms) { return sleeper{*this, clock::now() + ms}; }
+
+    /** Runs until there are no transfers and timers left. */
+    void run() {
+        while(!pending.empty() || !timers.empty()) {
+            std::vector<pollfd> fds;
+            clock::time_point   next = clock::time_point::max();
+            clock::time_point   now = clock::now();
+
+            for(transfer* t : pending) {
+                if(!t->discardReason && (t->stop.stop_requested() || now >= t->deadline)) {
+                    t->discardReason = t->stop.stop_requested() ? -ECANCELED : -ETIMEDOUT;
+                    ioctl(t->fd, USBDEVFS_DISCARDURB, &t->urb);
+                }
+                if(!t->discardReason && t->deadline < next)
+                    next = t->deadline;
+                add_fd(fds, t->fd);
+            }
+            for(auto& tm : timers)
+                if(tm.first < next)
+                    next = tm.first;
+
+            int timeout = next == clock::time_point::max() ? -1 :
+                next <= now ? 0 : (int)std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+            /* stop requests have no descriptor to wake us, check them regularly */
+            if(!pending.empty() && (timeout < 0 || timeout > 100))
+                timeout = 100;
+
+            if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+                break;
+
+            for(pollfd& p : fds)
+                if(p.revents & (POLLOUT | POLLERR | POLLHUP))
+                    reap(p.fd);
+
+            now = clock::now();
+            for(size_t i=0; i<timers.size();) {
+                if(timers[i].first <= now) {
+                    std::coroutine_handle<> h = timers[i].second;
+                    timers.erase(timers.begin() + i);
+                    h.resume();
+                } else
+                    i++;
+            }
+        }
+    }
+
+private:
+    friend struct transfer;
+    friend struct sleeper;
+
+    struct detached {
+        struct promise_type {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    static detached start(task<void> t) { co_await t; }
+
+    static void add_fd(std::vector<pollfd>& fds, int fd) {
+        for(pollfd& p : fds)
+            if(p.fd == fd)
+                return;
+        fds.push_back(pollfd{fd, POLLOUT, 0});
+    }
+
+    void reap(int fd) {
+        bulk_urb* urb;
+
+        while(ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+            transfer* t = (transfer*)urb->usercontext;
+
+            if(t->discardReason && urb->status < 0)
+                t->result = t->discardReason;
+            else
+                t->result = urb->status < 0 ? urb->status : urb->actual_length;
+
+            for(size_t i=0; i<pending.size(); i++) {
+                if(pending[i] == t) {
+                    pending.erase(pending.begin() + i);
+                    break;
+                }
+            }
+            t->waiter.resume();
+        }
+    }
+
+    std::vector<transfer*>                                              pending;
+    std::vector<std::pair<clock::time_point, std::coroutine_handle<>>>  timers;
+};
+
+inline bool transfer::await_suspend(std::coroutine_handle<> h) {
+    if(ioctl(fd, USBDEVFS_SUBMITURB, &urb) < 0) {
+        result = -errno;
+        return false;
+    }
+    waiter = h;
+    ev.pending.push_back(this);
+    return true;
+}
+
+inline void sleeper::await_suspend(std::coroutine_handle<> h) {
+    ev.timers.push_back(std::make_pair(when, h));
+}
+
+/** Device opened with libzen and driven by a loop. */
+struct device {
+    loop&                       ev;
+    usb_dev_handle*             hdev;
+    /** Cancels all transfers of this device. */
+    std::stop_token             stop;
+    /** usbfs descriptor, ZEN_ERROR if transport has none. */
+    int                         fd;
+
+    device(loop& l, usb_dev_handle* h, std::stop_token st = std::stop_token())
+        : ev(l), hdev(h), stop(std::move(st)), fd(zen_usbfs_fd(h)) {}
+
+    transfer bulk(int ep, void* buff, int len, int timeout) {
+        return transfer(ev, fd, ep, buff, len, clock::now() + std::chrono::milliseconds(timeout), stop);
+    }
+};
+
+/** Ends failed command with reset recovery, device may still be in the middle of it. */
+inline int command_failed(device& dev, const sZenCommand& cmd, const char* phase, int r, size_t in, size_t out) {
+    zen_log("async, %s: %d %s\n", phase, r, r < 0 ? strerror(-r) : "short transfer");
+    zen_reset_recovery(dev.hdev);
+    return zen_command_end(&cmd, in, out, ZEN_ERROR);
+}
+
+/**
+ * Bulk-Only Transport command: CBW, optional data phase and CSW, counterpart of read_packet_len()
+ * and send_packet() with the same recovery: stalled data phase is cleared, stalled CSW read once
+ * more, CSW sent instead of data is recognized, anything else out of sync, transfers discarded on
+ * timeout or stop too, ends with reset recovery. Recovery is blocking, it's rare and short.
+ * Without actual short data phase fails like in read_packet(), with it the length is returned there.
+ */
+inline task<int> command(device& dev, const sCBW& request, void* data, int len, size_t* actual = nullptr) {
+    const sZenProfile*  profile = zen_get_profile(dev.hdev);
+    sZenCommand         cmd;
+    sCBW                cbw;
+    sCSW                csw;
+    size_t              done = 0;
+    int                 r, in, ep, timeout, gotCsw = 0;
+
+    memcpy(&cbw, &request, sizeof(sCBW));
+    in = cbw.direction == CBW_DIR_IN;
+
+    if(dev.stop.stop_requested())
+        co_return ZEN_ERROR;
+
+    if(actual)
+        *actual = 0;
+
+    if(dev.fd == ZEN_ERROR) {
+        if(in && actual)
+            co_return read_packet_len(dev.hdev, &cbw, data, len, actual);
+        if(in)
+            co_return read_packet(dev.hdev, &cbw, data, len);
+        co_return send_packet(dev.hdev, &cbw, data, len);
+    }
+
+    if((timeout = zen_command_begin(&cmd, dev.hdev, &cbw, len > 0 ? len : 0)) == ZEN_ERROR)
+        co_return ZEN_ERROR;
+
+    if((r = co_await dev.bulk(profile->endpOut, &cbw, sizeof(sCBW), timeout)) != (int)sizeof(sCBW)) {
+        ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_CBW, r);
+        co_return command_failed(dev, cmd, "CBW", r, 0, 0);
+    }
+
+    if(len > 0) {
+        ep = in ? profile->endpIn : profile->endpOut;
+        r = co_await dev.bulk(ep, data, len, timeout);
+
+        if(r == -EPIPE) {
+            /* device ended data phase with stall, CSW tells what happened */
+            if(zen_clear_halt(dev.hdev, ep) != ZEN_SUCC) {
+                ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_DATA, r);
+                co_return command_failed(dev, cmd, "data", r, 0, 0);
+            }
+            r = 0;
+        } else if(r < 0) {
+            ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_DATA, r);
+            co_return command_failed(dev, cmd, "data", r, 0, 0);
+        } else if(in && r < len && zen_is_csw(data, r, &cbw)) {
+            memcpy(&csw, data, sizeof(sCSW));
+            gotCsw = 1;
+            r = 0;
+        }
+
+        done = (size_t)r;
+        ZEN_PROBE4(data_done, cbw.tag, cbw.command[0], len, r);
+    }
+
+    if(!gotCsw) {
+        r = co_await dev.bulk(profile->endpIn, &csw, sizeof(sCSW), timeout);
+        if(r == -EPIPE && zen_clear_halt(dev.hdev, profile->endpIn) == ZEN_SUCC) {
+            r = co_await dev.bulk(profile->endpIn, &csw, sizeof(sCSW), timeout);
+            ZEN_PROBE3(csw_retry, cbw.tag, cbw.command[0], r);
+        }
+
+        if(r != (int)sizeof(sCSW)) {
+            ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_CSW, r);
+            co_return command_failed(dev, cmd, "CSW", r, in ? done : 0, in ? 0 : done);
+        }
+    }
+    ZEN_PROBE5(csw_done, csw.tag, cbw.command[0], done, csw.dataResidue, csw.status);
+
+    if(csw.signature != CSW_SIG || csw.tag != cbw.tag || csw.status > CSW_CMD_FAILED || csw.dataResidue > cbw.transferLength) {
+        ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_CHECK, csw.status);
+        co_return command_failed(dev, cmd, "CSW check", csw.status, in ? done : 0, in ? 0 : done);
+    }
+
+    if(csw.status != CSW_OK) {
+        ZEN_PROBE4(transfer_error, cbw.tag, cbw.command[0], ZEN_PHASE_CHECK, csw.status);
+        co_return zen_command_end(&cmd, in ? done : 0, in ? 0 : done, ZEN_ERROR);
+    }
+
+    if(actual)
+        *actual = done;
+    else if(len > 0 && done != (size_t)len) {
+        zen_log("async, short data phase %luB of %dB\n", (unsigned long)done, len);
+        co_return zen_command_end(&cmd, in ? done : 0, in ? 0 : done, ZEN_ERROR);
+    }
+
+    co_return zen_command_end(&cmd, in ? done : 0, in ? 0 : done, ZEN_SUCC);
+}
+
+/** Fills Sigmatel vendor read CBW, arguments are command bytes 1..15. */
+inline void vendor_cbw(sCBW& cbw, u32 len, std::initializer_list<u8> args) {
+    int i = 1;
+
+    memset(&cbw, 0, sizeof(sCBW));
+    cbw.signature = CBW_SIG;
+    cbw.tag = rand();
+    cbw.transferLength = len;
+    cbw.direction = CBW_DIR_IN;
+    cbw.lengthOfCommand = 0x10;
+    cbw.command[0] = CMD_SCSI_SIGMATEL_READ;
+    for(u8 a : args)
+        cbw.command[i++] = a;
+}
+
+/** Battery level in % or ZEN_ERROR, counterpart of read_batt_level(). */
+inline task<int> battery(device& dev) {
+    sCBW        cbw;
+    sBattResp   resp;
+
+    vendor_cbw(cbw, sizeof(sBattResp), { CMD_ZEN_BATT_LEVEL });
+    if(co_await command(dev, cbw, &resp, sizeof(sBattResp)) != ZEN_SUCC)
+        co_return ZEN_ERROR;
+
+    co_return resp.level;
+}
+
+/** Volume limit in % or ZEN_ERROR, counterpart of read_vol_limit(). */
+inline task<int> vol_limit(device& dev) {
+    sCBW            cbw;
+    sVolLimitRead   vol;
+
+    vendor_cbw(cbw, sizeof(sVolLimitRead), { CMD_ZEN_VOL_LIMIT_READ });
+    if(co_await command(dev, cbw, &vol, sizeof(sVolLimitRead)) != ZEN_SUCC)
+        co_return ZEN_ERROR;
+
+    co_return vol.limit;
+}
+
+/** Receives bank content, returning false stops the read. */
+using sink = std::function<bool(const u8* data, size_t len)>;
+
+/** Streams whole memory bank to sink, counterpart of read_bank(). */
+inline task<int> read_bank(device& dev, u8 bank, sink out) {
+    const sZenProfile*  profile = zen_get_profile(dev.hdev);
+    sCBW                cbw;
+    u32                 count[2] = { 0, 0 };
+    u32                 sectorSize, sectorsCount, i, n, max;
+    std::vector<u8>     buff;
+
+    vendor_cbw(cbw, 8, { CMD_SIGMATEL_GET_LOGICAL_DRIVE_INFO, bank, CMD2_SIGMATEL_BANK_SIZE });
+    if(co_await command(dev, cbw, count, 8) != ZEN_SUCC)
+        co_return ZEN_ERROR;
+    vendor_cbw(cbw, 4, { CMD_SIGMATEL_GET_LOGICAL_DRIVE_INFO, bank, CMD2_SIGMATEL_SECTOR_SIZE });
+    if(co_await command(dev, cbw, &sectorSize, 4) != ZEN_SUCC)
+        co_return ZEN_ERROR;
+
+    /* see read_bank_size() */
+    if(profile->quirks & ZEN_QUIRK_SECTORS_24BIT)
+        sectorsCount = DWSWAP(count[1] & 0xFFFFFF00);
+    else if(count[0] != 0)
+        co_return ZEN_ERROR;
+    else
+        sectorsCount = DWSWAP(count[1]);
+    sectorSize = DWSWAP(sectorSize);
+    max = profile->readSectors > 0 && profile->readSectors < ZEN_READ_MAX_SECTORS ? profile->readSectors : ZEN_READ_MAX_SECTORS;
+    buff.resize((size_t)sectorSize * max);
+
+    for(i=0; i<sectorsCount; i+=n) {
+        n = sectorsCount - i < max ? sectorsCount - i : max;
+
+        vendor_cbw(cbw, n * sectorSize, { CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR, bank,
+            0, 0, 0, 0, (u8)(i >> 24), (u8)(i >> 16), (u8)(i >> 8), (u8)i, /* start sector */
+            0, 0, (u8)(n >> 8), (u8)n /* sector count */ });
+
+        if(co_await command(dev, cbw, buff.data(), (int)(n * sectorSize)) != ZEN_SUCC)
+            co_return ZEN_ERROR;
+        if(!out(buff.data(), (size_t)n * sectorSize))
+            co_return ZEN_ERROR;
+    }
+
+    co_return ZEN_SUCC;
+}
+
+} /* namespace zen */
+
+#endif
@@ -7,10 +7,342 @@
  */
 
 #include "libzen.h"
+#include "probes.h"
+#include <errno.h>
 
-usb_dev_handle* init_zen(int vid, int pid) {
+#ifndef WIN32
+# include <time.h>
+# include <unistd.h>
+#endif
+
+static struct sZenStats stats;
+static const u32        latBounds[ZEN_LAT_BUCKETS] = ZEN_LAT_BOUNDS;
+
+/* Round-trip estimators in us per ZEN_RTT_UNIT, SCSI opcodes then vendor subcommands */
+#define RTT_KEYS    512
+
+struct sRtt {
+    u32 srtt;
+    u32 rttvar;
+    u32 samples;
+};
+
+static int          adaptive = 1;
+
+/* Progress reporting and cancellation of sector reads */
+static zen_progress_cb              progressCb;
+static void*                        progressCtx;
+static volatile sig_atomic_t*       cancelToken;
+static int                          cancelled;
+
+static int libusb_clear_halt(usb_dev_handle* hdev, int ep) {
+    return usb_clear_halt(hdev, (unsigned int)ep);
+}
+
+static int libusb_reset(usb_dev_handle* hdev) {
+    return usb_control_msg(hdev, USB_TYPE_CLASS | USB_RECIP_INTERFACE, BOT_RESET, 0, 0, NULL, 0, zen_get_profile(hdev)->timeout);
+}
+
+#ifdef LIBUSB_HAS_ATTACH_KERNEL_DRIVER_NP
+/** Handle layout mirrored by libusb-attach-dev.h tells usbfs descriptor. */
+static int libusb_fd(usb_dev_handle* hdev) {
+    return hdev->fd;
+}
+#else
+# define libusb_fd NULL
+#endif
+
+static const struct sZenTransport libusbTransport = { usb_bulk_write, usb_bulk_read, NULL, libusb_clear_halt, libusb_reset, libusb_fd };
+
+/* State of opened device, handles that weren't attached get libusb transport */
+struct sZenDev {
+    usb_dev_handle*             hdev;
+    const struct sZenTransport* transport;
+    /** Profile, NULL for generic one, and ids it was picked by, vid is 0 until zen_profile_select(). */
+    const struct sZenProfile*   profile;
+    int                         vid;
+    int                         pid;
+    int                         chipId;
+    /** Estimators of this device, devices differ in speed. */
+    struct sRtt                 rtt[RTT_KEYS];
+};
+
+static struct sZenDev   devs[ZEN_DEVS_MAX];
+static struct sZenDev   unattached = { NULL, &libusbTransport, NULL, 0, 0, ZEN_ERROR, { { 0 } } };
+
+/** Finds state of handle, unattached handles share the libusb one. */
+static struct sZenDev* dev_of(usb_dev_handle* hdev) {
+    int i;
+
+    for(i=0; i<ZEN_DEVS_MAX; i++)
+        if(devs[i].hdev == hdev && hdev != NULL)
+            return &devs[i];
+
+    return &unattached;
+}
+
+int zen_attach(usb_dev_handle* hdev, const struct sZenTransport* t) {
+    struct sZenDev* dev = dev_of(hdev);
+    int             i;
+
+    if(hdev == NULL)
+        return ZEN_ERROR;
+
+    for(i=0; i<ZEN_DEVS_MAX && dev == &unattached; i++)
+        if(devs[i].hdev == NULL)
+            dev = &devs[i];
+
+    if(dev == &unattached) {
+        zen_log("Too many open devices, %d at most\n", ZEN_DEVS_MAX);
+        return ZEN_ERROR;
+    }
+
+    memset(dev, 0, sizeof(struct sZenDev));
+    dev->hdev = hdev;
+    dev->transport = t ? t : &libusbTransport;
+    dev->chipId = ZEN_ERROR;
+
+    return ZEN_SUCC;
+}
+
+void zen_set_profile(usb_dev_handle* hdev, const struct sZenProfile* p) {
+    struct sZenDev* dev = dev_of(hdev);
+
+    if(dev != &unattached)
+        dev->profile = p;
+}
+
+const struct sZenProfile* zen_get_profile(usb_dev_handle* hdev) {
+    const struct sZenDev* dev = dev_of(hdev);
+
+    return dev->profile ? dev->profile : zen_profile_find(0, 0, ZEN_ERROR);
+}
+
+const struct sZenProfile* zen_profile_select(usb_dev_handle* hdev, int vid, int pid) {
+    struct sZenDev* dev = dev_of(hdev);
+
+    /* handle opened by caller with libusb */
+    if(dev == &unattached) {
+        if(zen_attach(hdev, NULL) != ZEN_SUCC)
+            return zen_get_profile(hdev);
+        dev = dev_of(hdev);
+    }
+
+    /* chip id is read with settings of ids, then it may narrow them */
+    dev->vid = vid;
+    dev->pid = pid;
+    dev->chipId = ZEN_ERROR;
+    dev->profile = zen_profile_find(vid, pid, ZEN_ERROR);
+    if((dev->chipId = read_chip_id(hdev)) != ZEN_ERROR)
+        dev->profile = zen_profile_find(vid, pid, dev->chipId);
+
+    return dev->profile;
+}
+
+void zen_profile_reselect(void) {
+    int i;
+
+    /* ids were read when devices were opened, no need to ask them again */
+    for(i=0; i<ZEN_DEVS_MAX; i++)
+        if(devs[i].hdev)
+            devs[i].profile = devs[i].vid ? zen_profile_find(devs[i].vid, devs[i].pid, devs[i].chipId) : NULL;
+}
+
+/** Describes result of failed transfer, transports return negative errno like libusb does. */
+static const char* transfer_error(int res) {
+    return res < 0 ? strerror(-res) : "short transfer";
+}
+
+u64 zen_time_us(void) {
+#ifdef WIN32
+    LARGE_INTEGER now, freq;
+
+    if(QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&now))
+        return (u64)(now.QuadPart / freq.QuadPart) * 1000000 + (u64)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+    return (u64)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    /* wall clock steps would move deadlines and skew round-trip times */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + (u64)ts.tv_nsec / 1000;
+#endif
+}
+
+void zen_get_stats(struct sZenStats* dst) {
+    memcpy(dst, &stats, sizeof(struct sZenStats));
+}
+
+void zen_reset_stats(void) {
+    memset(&stats, 0, sizeof(struct sZenStats));
+}
+
+void zen_set_adaptive_timeouts(int enable) {
+    int i;
+
+    adaptive = enable;
+    for(i=0; i<ZEN_DEVS_MAX; i++)
+        memset(devs[i].rtt, 0, sizeof(devs[i].rtt));
+    memset(unattached.rtt, 0, sizeof(unattached.rtt));
+}
+
+void zen_set_progress(zen_progress_cb cb, void* ctx) {
+    progressCb = cb;
+    progressCtx = ctx;
+}
+
+void zen_set_cancel(volatile sig_atomic_t* token) {
+    cancelToken = token;
+    cancelled = 0;
+}
+
+int zen_cancelled(void) {
+    return cancelled;
+}
+
+/** Checks cancellation token, called between complete commands only. */
+static int check_cancel(void) {
+    if(cancelToken == NULL || *cancelToken == 0)
+        return ZEN_SUCC;
+
+    if(!cancelled)
+        zen_log("Reading cancelled\n");
+    cancelled = 1;
+
+    return ZEN_ERROR;
+}
+
+/** Checks if profile of device marks command as one it fails or hangs on. */
+static int is_bad_command(usb_dev_handle* hdev, const struct sCBW* cbw) {
+    const struct sZenProfile*   profile = zen_get_profile(hdev);
+    u8                          op = cbw->command[0];
+    u16                         code;
+    int                         i;
+
+    code = ZEN_BAD_CMD(op, op == CMD_SCSI_SIGMATEL_READ || op == CMD_SCSI_SIGMATEL_WRITE ? cbw->command[1] : 0);
+    for(i=0; i<profile->badCount; i++)
+        if(profile->bad[i] == code)
+            return 1;
+
+    return 0;
+}
+
+int zen_command_begin(struct sZenCommand* cmd, usb_dev_handle* hdev, const struct sCBW* cbw, size_t len) {
+    const struct sZenProfile*   profile = zen_get_profile(hdev);
+    struct sRtt*                r;
+    u64                         timeout;
+
+    /* device would stall or hang, it's cheaper not to ask */
+    if(is_bad_command(hdev, cbw)) {
+        zen_log("Command 0x%02X 0x%02X not supported by %s\n", cbw->command[0], cbw->command[1], profile->name);
+        return ZEN_ERROR;
+    }
+
+    cmd->hdev = hdev;
+    if(cbw->command[0] == CMD_SCSI_SIGMATEL_READ || cbw->command[0] == CMD_SCSI_SIGMATEL_WRITE)
+        cmd->key = 256 + cbw->command[1];
+    else
+        cmd->key = cbw->command[0];
+    cmd->units = 1 + (u32)(len / ZEN_RTT_UNIT);
+    cmd->timeout = profile->timeout;
+
+    r = &dev_of(hdev)->rtt[cmd->key];
+    if(adaptive && r->samples >= ZEN_RTT_WARMUP) {
+        timeout = ((u64)r->srtt + 4 * (u64)r->rttvar) * cmd->units / 1000;
+        if(timeout < (u64)profile->timeoutMin)
+            timeout = profile->timeoutMin;
+        if(timeout < (u64)profile->timeout)
+            cmd->timeout = (int)timeout;
+    }
+    cmd->start = zen_time_us();
+    ZEN_PROBE5(cbw_submit, cbw->tag, cbw->command[0], cbw->command[1], cbw->transferLength, cbw->direction);
+
+    return cmd->timeout;
+}
+
+/** RFC 6298 style estimator update, only for commands that completed. */
+static void rtt_update(const struct sZenCommand* cmd, u64 lat, int res) {
+    struct sRtt*    r = &dev_of(cmd->hdev)->rtt[cmd->key];
+    u32             sample, diff, max;
+
+    if(res != ZEN_SUCC) {
+        /* phase timed out, give the next one more time */
+        if(lat >= (u64)cmd->timeout * 1000 && r->samples > 0) {
+            max = (u32)zen_get_profile(cmd->hdev)->timeout * 1000;
+            r->rttvar *= 2;
+            if(r->rttvar > max)
+                r->rttvar = max;
+        }
+        return;
+    }
+
+    sample = (u32)(lat / cmd->units);
+    if(r->samples == 0) {
+        r->srtt = sample;
+        r->rttvar = sample / 2;
+    } else {
+        diff = r->srtt > sample ? r->srtt - sample : sample - r->srtt;
+        r->rttvar = (3 * r->rttvar + diff) / 4;
+        r->srtt = (7 * r->srtt + sample) / 8;
+    }
+    r->samples++;
+}
+
+int zen_command_end(const struct sZenCommand* cmd, size_t in, size_t out, int res) {
+    u64 lat = zen_time_us() - cmd->start;
+    int i;
+
+    rtt_update(cmd, lat, res);
+
+    stats.commands++;
+    stats.bytesIn += in;
+    stats.bytesOut += out;
+    if(res != ZEN_SUCC)
+        stats.errors++;
+    stats.latencySum += lat;
+    for(i=0; i<ZEN_LAT_BUCKETS && lat > latBounds[i]; i++);
+    stats.latency[i]++;
+
+    return res;
+}
+
+/** Opens device, detaches kernel driver, sets configuration and claims interface. */
+static usb_dev_handle* open_dev(struct usb_device *dev) {
+    usb_dev_handle* hdev = usb_open(dev);
+
+    if(hdev == NULL) {
+        zen_log("usb_open: %s\n", usb_strerror());    
+        return NULL;
+    }
+
+#if defined(LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP) && (LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP == 1) && defined(NP_DRIVER_DEATTACH)
+    if (usb_detach_kernel_driver_np(hdev, dev->config->interface->altsetting->bInterfaceNumber) < 0) 
+        zen_log("usb_detach_kernel_driver_np: %s\nContinuing anyway...\n", usb_strerror());
+#endif
+    if(usb_set_configuration(hdev,dev->config->bConfigurationValue) < 0) {
+        zen_log("usb_set_configuration: %s\n", usb_strerror());
+        deinit_zen(hdev);
+        return NULL;
+    } 
+    
+    if(usb_claim_interface(hdev, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
+        zen_log("usb_claim_interface: %s\n", usb_strerror());
+        deinit_zen(hdev);
+        return NULL;
+    }
+
+    if(zen_attach(hdev, NULL) != ZEN_SUCC) {
+        deinit_zen(hdev);
+        return NULL;
+    }
+
+    return hdev;
+}
+
+int init_zen_list(int vid, int pid, usb_dev_handle** list, int max) {
     struct usb_bus *busses;
     struct usb_bus *bus;
+    int            count = 0;
 
     if(vid == 0)
         vid = ZEN_VENDOR;
@@ -23,102 +355,202 @@ usb_dev_handle* init_zen(int vid, int pid) {
     usb_find_devices();
     busses = usb_get_busses();
     
-    for (bus = busses; bus; bus = bus->next) {
-           struct usb_device *dev;
-        for (dev = bus->devices; dev; dev = dev->next) {
+    for (bus = busses; bus && count < max; bus = bus->next) {
+        struct usb_device *dev;
+        for (dev = bus->devices; dev && count < max; dev = dev->next) {
             if(dev->descriptor.idVendor == vid && dev->descriptor.idProduct == pid) {       
-                usb_dev_handle* hdev = usb_open(dev);
-                if(hdev) { 
-#if defined(LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP) && (LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP == 1) && defined(NP_DRIVER_DEATTACH)
-                    if (usb_detach_kernel_driver_np(hdev, dev->config->interface->altsetting->bInterfaceNumber) < 0) 
-                        zen_log("usb_detach_kernel_driver_np: %s\nContinuing anyway...\n", usb_strerror());
-#endif
-                    if(usb_set_configuration(hdev,dev->config->bConfigurationValue) < 0) {
-                        zen_log("usb_set_configuration: %s\n", usb_strerror());
-                        deinit_zen(hdev);
-                    } else if(usb_claim_interface(hdev, dev->config->interface->altsetting->bInterfaceNumber) < 0) {
-                        zen_log("usb_claim_interface: %s\n", usb_strerror());
-                        deinit_zen(hdev);
-                    } else
-                        return hdev;
+                usb_dev_handle* hdev = open_dev(dev);
+                if(hdev) {
+                    zen_profile_select(hdev, vid, pid);
+                    list[count++] = hdev;
                 }
-                else
-                    zen_log("usb_open: %s\n", usb_strerror());    
             }
         }
     }
+
+    return count;
+}
+
+usb_dev_handle* init_zen(int vid, int pid) {
+    usb_dev_handle* hdev;
+
+    if(init_zen_list(vid, pid, &hdev, 1) == 1)
+        return hdev;
+
     return NULL;
 }
 
-int send_packet(usb_dev_handle* hdev, struct sCBW* cbw, void* data, size_t dataSize) {
-    struct sCSW csw;
+int zen_clear_halt(usb_dev_handle* hdev, int ep) {
+    const struct sZenTransport* transport = dev_of(hdev)->transport;
+
+    if(transport->clearHalt == NULL || transport->clearHalt(hdev, ep) < 0) {
+        zen_log("Clearing halt of endpoint 0x%02X failed\n", ep);
+        return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
+
+void zen_reset_recovery(usb_dev_handle* hdev) {
+    const struct sZenTransport* transport = dev_of(hdev)->transport;
+    int                         reset, halts;
+
+    if((reset = transport->reset == NULL ? ZEN_ERROR : transport->reset(hdev)) < 0)
+        zen_log("Bulk-Only reset failed\n");
+
+    halts = zen_clear_halt(hdev, zen_get_profile(hdev)->endpIn) == ZEN_SUCC;
+    halts += zen_clear_halt(hdev, zen_get_profile(hdev)->endpOut) == ZEN_SUCC;
+    ZEN_PROBE2(reset_recovery, reset, halts);
+}
+
+int zen_usbfs_fd(usb_dev_handle* hdev) {
+    const struct sZenTransport* transport = dev_of(hdev)->transport;
+
+    return hdev && transport->fd ? transport->fd(hdev) : ZEN_ERROR;
+}
+
+int zen_is_csw(const void* data, int len, const struct sCBW* cbw) {
+    const struct sCSW* csw = (const struct sCSW*)data;
+
+    return len == sizeof(struct sCSW) && csw->signature == CSW_SIG && csw->tag == cbw->tag;
+}
 
+/**
+ * Runs one Bulk-Only command: CBW, data phase in cbw->direction, CSW.
+ * Device ends short data phase with short or zero-length packet and host goes on with CSW,
+ * it may also skip data phase and send CSW right away, so 13B data phase is checked to be
+ * CSW of this command. Waiting for a CSW that was already consumed as data used to end with
+ * -110 (timeout) after the whole timeout. Stalled data phase is cleared and CSW still read,
+ * stalled CSW is read once more, anything else out of sync starts reset recovery.
+ * done is set to bytes transferred in data phase, without padding beyond dataResidue.
+ */
+static int bot_command(usb_dev_handle* hdev, struct sCBW* cbw, void* data, size_t dataSize, size_t* done, const char* name) {
+    const struct sZenTransport* transport;
+    struct sCSW                 csw;
+    struct sZenCommand          cmd;
+    size_t                      valid;
+    int                         timeout, res, in, gotCsw = 0, endpIn, endpOut;
+
+    *done = 0;
     if(hdev==NULL) 
         return ZEN_ERROR;
+    transport = dev_of(hdev)->transport;
+
+    endpIn = zen_get_profile(hdev)->endpIn;
+    endpOut = zen_get_profile(hdev)->endpOut;
 
-    if(usb_bulk_write(hdev, ZEN_ENDP_OUT, (char*)cbw, sizeof(struct sCBW), ZEN_TIMEOUT) < 0) {
-        zen_log("send_packet, usb_bulk_write: %s\n", usb_strerror());
+    in = cbw->direction == CBW_DIR_IN;
+    if(data == NULL)
+        dataSize = 0;
+
+    if((timeout = zen_command_begin(&cmd, hdev, cbw, dataSize)) == ZEN_ERROR)
         return ZEN_ERROR;
+
+    if((res = transport->bulkWrite(hdev, endpOut, (char*)cbw, sizeof(struct sCBW), timeout)) != sizeof(struct sCBW)) {
+        zen_log("%s, CBW: %d %s\n", name, res, transfer_error(res));
+        ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_CBW, res);
+        /* device doesn't know if command started, only reset brings it back to CBW */
+        zen_reset_recovery(hdev);
+        return zen_command_end(&cmd, 0, 0, ZEN_ERROR);
     }
 
-    if(data && usb_bulk_write(hdev, ZEN_ENDP_OUT, data, dataSize, ZEN_TIMEOUT) < 0) {
-        zen_log("send_packet, usb_bulk_write2: %s\n", usb_strerror());
-        /**
-         * Sometimes strange things happen on linux here,
-         * bult_read returns -110 (timeout) but everything is ok,
-         * usb_strerror return "No error",
-         * if so comment the line below
-         **/
-        return ZEN_ERROR;
+    if(dataSize) {
+        if(in)
+            res = transport->bulkRead(hdev, endpIn, data, dataSize, timeout);
+        else
+            res = transport->bulkWrite(hdev, endpOut, data, dataSize, timeout);
+
+        if(res == -EPIPE) {
+            /* device ended data phase with stall, CSW tells what happened */
+            if(zen_clear_halt(hdev, in ? endpIn : endpOut) != ZEN_SUCC) {
+                ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_DATA, res);
+                zen_reset_recovery(hdev);
+                return zen_command_end(&cmd, 0, 0, ZEN_ERROR);
+            }
+            res = 0;
+        } else if(res < 0) {
+            zen_log("%s, data: %d %s\n", name, res, transfer_error(res));
+            ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_DATA, res);
+            zen_reset_recovery(hdev);
+            return zen_command_end(&cmd, 0, 0, ZEN_ERROR);
+        } else if(in && (size_t)res < dataSize && zen_is_csw(data, res, cbw)) {
+            memcpy(&csw, data, sizeof(struct sCSW));
+            gotCsw = 1;
+            res = 0;
+        }
+
+        *done = (size_t)res;
+        ZEN_PROBE4(data_done, cbw->tag, cbw->command[0], dataSize, res);
     }
 
-    if(usb_bulk_read(hdev, ZEN_ENDP_IN, (char*)&csw, sizeof(struct sCSW), ZEN_TIMEOUT) < 0) {
-        zen_log("send_packet, usb_bulk_read: %s\n", usb_strerror());
-        return ZEN_ERROR;
+    if(!gotCsw) {
+        res = transport->bulkRead(hdev, endpIn, (char*)&csw, sizeof(struct sCSW), timeout);
+        if(res == -EPIPE && zen_clear_halt(hdev, endpIn) == ZEN_SUCC) {
+            res = transport->bulkRead(hdev, endpIn, (char*)&csw, sizeof(struct sCSW), timeout);
+            ZEN_PROBE3(csw_retry, cbw->tag, cbw->command[0], res);
+        }
+
+        if(res != sizeof(struct sCSW)) {
+            zen_log("%s, CSW: %d %s\n", name, res, transfer_error(res));
+            ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_CSW, res);
+            zen_reset_recovery(hdev);
+            return zen_command_end(&cmd, in ? *done : 0, in ? 0 : *done, ZEN_ERROR);
+        }
+    }
+    ZEN_PROBE5(csw_done, csw.tag, cbw->command[0], *done, csw.dataResidue, csw.status);
+
+    if(csw.signature != CSW_SIG || csw.tag != cbw->tag || csw.status > CSW_CMD_FAILED || csw.dataResidue > cbw->transferLength) {
+        zen_log("%s, CSW check failed -> sig=0x%X, tag_eq=%d, status=0x%X, dataResidue=%d\n", \
+            name, csw.signature, csw.tag == cbw->tag, csw.status, csw.dataResidue);
+        ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_CHECK, csw.status);
+        zen_reset_recovery(hdev);
+        return zen_command_end(&cmd, in ? *done : 0, in ? 0 : *done, ZEN_ERROR);
     }
 
-    if(csw.signature != CSW_SIG || csw.tag != cbw->tag || csw.status != CSW_OK || csw.dataResidue > cbw->transferLength) {
-        zen_log("send_packet, CSW check failed -> sig=0x%X, tag_eq=%d, status=0x%X, dataResidue=%d\n", \
-            csw.signature, csw.tag == cbw->tag, csw.status, csw.dataResidue);
-        return ZEN_ERROR;
+    /* residue is what device didn't process, bytes beyond it are padding */
+    valid = cbw->transferLength - csw.dataResidue;
+    if(*done > valid)
+        *done = valid;
+
+    if(csw.status != CSW_OK) {
+        zen_log("%s, command 0x%02X failed, %luB of %luB transferred\n", name, cbw->command[0], \
+            (unsigned long)*done, (unsigned long)dataSize);
+        ZEN_PROBE4(transfer_error, cbw->tag, cbw->command[0], ZEN_PHASE_CHECK, csw.status);
+        return zen_command_end(&cmd, in ? *done : 0, in ? 0 : *done, ZEN_ERROR);
     }
 
-    return ZEN_SUCC;
+    return zen_command_end(&cmd, in ? *done : 0, in ? 0 : *done, ZEN_SUCC);
 }
 
-int read_packet(usb_dev_handle* hdev, struct sCBW* cbw, void* ret, size_t retSize) {
-     struct sCSW csw;
+int send_packet(usb_dev_handle* hdev, struct sCBW* cbw, void* data, size_t dataSize) {
+    size_t done;
 
-    if(hdev==NULL) 
+    if(bot_command(hdev, cbw, data, dataSize, &done, "send_packet") != ZEN_SUCC)
         return ZEN_ERROR;
 
-    if(usb_bulk_write(hdev, ZEN_ENDP_OUT, (char*)cbw, sizeof(struct sCBW), ZEN_TIMEOUT) < 0) {
-        zen_log("read_packet, usb_bulk_write: %s\n", usb_strerror());
+    if(data && done != dataSize) {
+        zen_log("send_packet, device took %luB of %luB\n", (unsigned long)done, (unsigned long)dataSize);
         return ZEN_ERROR;
     }
 
-    if(usb_bulk_read(hdev, ZEN_ENDP_IN, ret, retSize, ZEN_TIMEOUT) < 0) {
-         zen_log("read_packet, usb_bulk_read: %s\n", usb_strerror());
-        /**
-         * Sometimes strange things happen on linux here,
-         * bulk_read returns -110 (timeout) but everything is ok,
-         * usb_strerror return "No error",
-         * if so comment the line below
-         **/
-        return ZEN_ERROR;
-    }
+    return ZEN_SUCC;
+}
 
-    if(usb_bulk_read(hdev, ZEN_ENDP_IN, (char*)&csw, sizeof(struct sCSW), ZEN_TIMEOUT) < 0) {
-        zen_log("read_packet, usb_bulk_read2: %s\n", usb_strerror());
-        return ZEN_ERROR;    
-    }
+int read_packet_len(usb_dev_handle* hdev, struct sCBW* cbw, void* ret, size_t retSize, size_t* actual) {
+    return bot_command(hdev, cbw, ret, retSize, actual, "read_packet");
+}
 
-    if(csw.signature != CSW_SIG || csw.tag != cbw->tag || csw.status != CSW_OK || csw.dataResidue > cbw->transferLength) {
-        zen_log("read_packet, CSW check failed -> sig=0x%X, tag_eq=%d, status=0x%X, dataResidue=%d\n", \
-            csw.signature, csw.tag == cbw->tag, csw.status, csw.dataResidue);
+int read_packet(usb_dev_handle* hdev, struct sCBW* cbw, void* ret, size_t retSize) {
+    size_t done;
+
+    if(bot_command(hdev, cbw, ret, retSize, &done, "read_packet") != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(done != retSize) {
+        zen_log("read_packet, short data phase %luB of %luB\n", (unsigned long)done, (unsigned long)retSize);
         return ZEN_ERROR;
     }
-    
+
     return ZEN_SUCC;
 }
 
@@ -140,8 +572,39 @@ int device_ready(usb_dev_handle* hdev) {
     return send_packet(hdev,&cbw,NULL,0);
 }
 
+int zen_wait_ready(usb_dev_handle* hdev, int maxMs) {
+    u64 deadline = zen_time_us() + (u64)maxMs * 1000;
+    u64 now;
+    int delay = ZEN_READY_POLL_MIN;
+    int attempt = 0;
+
+    if(hdev == NULL)
+        return ZEN_ERROR;
+
+    while(device_ready(hdev) != ZEN_SUCC) {
+        now = zen_time_us();
+        if(now >= deadline)
+            return ZEN_ERROR;
+
+        if((u64)delay * 1000 > deadline - now)
+            delay = (int)((deadline - now) / 1000) + 1;
+        ZEN_PROBE2(ready_retry, ++attempt, delay);
+#ifdef WIN32
+        Sleep(delay);
+#else
+        usleep(delay * 1000);
+#endif
+        delay *= 2;
+        if(delay > ZEN_READY_POLL_MAX)
+            delay = ZEN_READY_POLL_MAX;
+    }
+
+    return ZEN_SUCC;
+}
+
 int read_firmware_ver(usb_dev_handle* hdev, struct sFirmwVer* verPtr) {
     struct sDevInfo devInfo;
+    size_t          len;
     struct sCBW     cbw = { 
         CBW_SIG,    /* CBW Signature */
         rand(),     /* Tag */
@@ -155,7 +618,9 @@ int read_firmware_ver(usb_dev_handle* hdev, struct sFirmwVer* verPtr) {
     if(hdev==NULL) 
         return ZEN_ERROR;
  
-    if(read_packet(hdev,&cbw,&devInfo,sizeof(struct sDevInfo)) == ZEN_SUCC) {
+    /* standard INQUIRY data is 36B, revision is its last field */
+    memset(&devInfo, 0, sizeof(struct sDevInfo));
+    if(read_packet_len(hdev,&cbw,&devInfo,sizeof(struct sDevInfo),&len) == ZEN_SUCC && len >= 36) {
         verPtr->major = devInfo.productRevisionLevel[0];
         verPtr->minor[0] = devInfo.productRevisionLevel[0];
         verPtr->minor[1] = devInfo.productRevisionLevel[1];
@@ -172,8 +637,7 @@ int read_firmware_ver(usb_dev_handle* hdev, struct sFirmwVer* verPtr) {
     return ZEN_ERROR;
 }
 
-int read_batt_level(usb_dev_handle* hdev) {
-    struct sBattResp resp;
+int read_batt_info(usb_dev_handle* hdev, struct sBattResp* resp) {
     struct sCBW cbw = {    
         CBW_SIG,     /* CBW Signature */
         rand(),      /* Tag */
@@ -189,8 +653,14 @@ int read_batt_level(usb_dev_handle* hdev) {
 
      if(hdev==NULL) 
         return ZEN_ERROR;
-    
-    if(read_packet(hdev,&cbw,&resp,sizeof(struct sBattResp)) == ZEN_SUCC) {    
+
+    return read_packet(hdev,&cbw,resp,sizeof(struct sBattResp));
+}
+
+int read_batt_level(usb_dev_handle* hdev) {
+    struct sBattResp resp;
+
+    if(read_batt_info(hdev,&resp) == ZEN_SUCC) {    
         switch(resp.full) {
             case ZEN_BATT_NOT_FULL: zen_log("Battery level (CHARGING): %d%%\n", resp.level); break;
             case ZEN_BATT_FULL: zen_log("Battery level (FULL): %d%%\n", resp.level); break;
@@ -204,7 +674,37 @@ int read_batt_level(usb_dev_handle* hdev) {
     return ZEN_ERROR;
 }
 
-int read_capacity(usb_dev_handle *hdev) {
+/** READ CAPACITY(16), used when last block doesn't fit in 32 bits. */
+static int read_capacity_16(usb_dev_handle *hdev, u64* blocks, u32* blockSize) {
+    struct sCap16Resp   capacity;
+    struct sCBW         cbw = { 
+        CBW_SIG,             /* CBW Signature  */
+         rand(),             /* Tag */
+        sizeof(struct sCap16Resp),  /* Transfer length */
+        CBW_DIR_IN,          /* Direction */
+        0x00,                /* Reserved */
+        0x10,                /* Length of command */
+        {CMD_SCSI_SERVICE_ACTION_IN, SAI_READ_CAPACITY_16, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, sizeof(struct sCap16Resp), 0x00, 0x00} /* Command */
+        };
+    u64                 last = 0;
+    int                 i;
+
+    if(read_packet(hdev,&cbw,(char*)&capacity,sizeof(struct sCap16Resp)) != ZEN_SUCC) {
+        zen_log("Reading capacity error, maybe this is not a SCSI device?\n");
+        return ZEN_ERROR;
+    }
+
+    for(i=0; i<8; i++)
+        last = (last << 8) | capacity.lastBlock[i];
+    *blocks = last + 1;
+    *blockSize = ((u32)capacity.blockSize[0] << 24) | ((u32)capacity.blockSize[1] << 16) |
+        ((u32)capacity.blockSize[2] << 8) | capacity.blockSize[3];
+
+    return ZEN_SUCC;
+}
+
+int read_capacity_blocks(usb_dev_handle *hdev, u64* blocks, u32* blockSize) {
     struct sCapResp capacity;
     struct sCBW     cbw = { 
         CBW_SIG,             /* CBW Signature  */
@@ -220,15 +720,111 @@ int read_capacity(usb_dev_handle *hdev) {
         return ZEN_ERROR;
     
     if(read_packet(hdev,&cbw,(char*)&capacity,sizeof(struct sCapResp)) == ZEN_SUCC) {
-        if(capacity.sectors == 0xFFFFFFFF) {
-            zen_log("Reading capacity error, maybe this is not a SCSI device?\n");
+        /* SBC: last block doesn't fit in 32 bits, READ CAPACITY(16) tells it */
+        if(capacity.sectors == 0xFFFFFFFF)
+            return read_capacity_16(hdev, blocks, blockSize);
+
+        /* READ CAPACITY returns LBA of the last block */
+        *blocks = (u64)DWSWAP(capacity.sectors) + 1;
+        *blockSize = DWSWAP(capacity.sectorSize);
+        return ZEN_SUCC;
+    }
+
+    return ZEN_ERROR;    
+}
+
+int read_capacity(usb_dev_handle *hdev) {
+    u64 blocks;
+    u32 blockSize;
+
+    if(read_capacity_blocks(hdev, &blocks, &blockSize) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    return (int)((blocks * blockSize) >> 20);
+}
+
+int read_blocks(usb_dev_handle *hdev, FILE* fd, u64 lba, u64 count, u32 blockSize) {
+    struct sZenSink sink;
+    u8*             bin; /* read buffer */
+    int             res;
+
+    if(hdev==NULL || blockSize==0) 
+        return ZEN_ERROR;
+
+    bin = (u8*)malloc(blockSize * ZEN_IMAGE_BLOCKS);
+    if(bin==NULL)
+        return ZEN_ERROR;
+
+    zen_sink_file(&sink, fd);
+    res = read_blocks_buf(hdev, &sink, lba, count, blockSize, bin, blockSize * ZEN_IMAGE_BLOCKS);
+    free(bin);
+
+    return res;
+}
+
+int read_blocks_buf(usb_dev_handle *hdev, struct sZenSink* sink, u64 lba, u64 count, u32 blockSize, u8* buff, size_t buffSize) {
+    struct sCBW cbw = {    
+        CBW_SIG,    /* CBW Signature */
+        rand(),     /* Tag */
+        0,          /* Transfer length - unknown yet */
+        CBW_DIR_IN, /* Direction */
+        0x00,       /* Reserved */
+        0x0a,       /* Length of command */
+        {CMD_SCSI_READ_10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00} /* Command */
+    };
+    u32         n, i, max;
+
+    if(hdev==NULL || blockSize==0 || buffSize < blockSize) 
+        return ZEN_ERROR;
+
+    max = buffSize / blockSize < ZEN_IMAGE_BLOCKS ? (u32)(buffSize / blockSize) : ZEN_IMAGE_BLOCKS;
+    while(count > 0) {
+        n = count < max ? (u32)count : max;
+
+        memset(cbw.command, 0, sizeof(cbw.command));
+        cbw.tag = rand();
+        cbw.transferLength = n * blockSize;
+        if(lba + n <= 0xFFFFFFFF) {
+            cbw.lengthOfCommand = 0x0a;
+            cbw.command[0] = CMD_SCSI_READ_10;
+            for(i=0; i<4; i++)
+                cbw.command[5-i] = (u8)(lba >> (i*8));
+            cbw.command[7] = (n >> 8) & 0xFF;
+            cbw.command[8] = n & 0xFF;
+        } else {
+            cbw.lengthOfCommand = 0x10;
+            cbw.command[0] = CMD_SCSI_READ_16;
+            for(i=0; i<8; i++)
+                cbw.command[9-i] = (u8)(lba >> (i*8));
+            for(i=0; i<4; i++)
+                cbw.command[13-i] = (u8)(n >> (i*8));
+        }
+
+        if(read_packet(hdev,&cbw,buff,n * blockSize) != ZEN_SUCC) {
+            zen_log("Reading blocks %llu-%llu failed\n", lba, lba + n - 1);
             return ZEN_ERROR;
         }
-        
-        return (DWSWAP(capacity.sectors) * DWSWAP(capacity.sectorSize)) >> 20;
+
+        if(sink->write(sink, buff, n * blockSize) != ZEN_SUCC)
+            return ZEN_ERROR;
+
+        lba += n;
+        count -= n;
     }
 
-    return ZEN_ERROR;    
+    return ZEN_SUCC;
+}
+
+int read_image(usb_dev_handle *hdev, FILE* fd) {
+    u64 blocks;
+    u32 blockSize;
+
+    if(read_capacity_blocks(hdev, &blocks, &blockSize) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    zen_log("Imaging %llu blocks of %uB\n", blocks, blockSize);
+
+    return read_blocks(hdev, fd, 0, blocks, blockSize);
 }
 
 void hexdump(u8* buff, int len) {
@@ -239,7 +835,87 @@ void hexdump(u8* buff, int len) {
 }
 
 int read_sector(usb_dev_handle* hdev, FILE* fd, u8 bank, u32 sectorSize, u32 from, u32 to) {
-    u8*        bin; /* read buffer */
+    struct sZenSink sink;
+
+    zen_sink_file(&sink, fd);
+
+    return read_sector_sink(hdev, &sink, bank, sectorSize, from, to);
+}
+
+int read_sector_sink(usb_dev_handle* hdev, struct sZenSink* sink, u8 bank, u32 sectorSize, u32 from, u32 to) {
+    u8*     bin; /* read buffer */
+    int     res;
+
+    if(hdev==NULL || sectorSize == 0)
+        return ZEN_ERROR;
+
+    bin = (u8*)malloc(sectorSize * ZEN_READ_MAX_SECTORS);
+
+    if(bin==NULL)
+        return ZEN_ERROR;
+
+    res = read_sector_sink_buf(hdev, sink, bank, sectorSize, from, to, bin, sectorSize * ZEN_READ_MAX_SECTORS);
+    free(bin);
+
+    return res;
+}
+
+/** Sectors per read command of device profile. */
+static u32 read_max_sectors(usb_dev_handle* hdev) {
+    u32 n = zen_get_profile(hdev)->readSectors;
+
+    return n > 0 && n < ZEN_READ_MAX_SECTORS ? n : ZEN_READ_MAX_SECTORS;
+}
+
+int read_sector_sink_buf(usb_dev_handle* hdev, struct sZenSink* sink, u8 bank, u32 sectorSize, u32 from, u32 to,
+    u8* buff, size_t buffSize) {
+    u32                 i, n, max;
+    u64                 start, chunkStart, now;
+    struct sZenProgress p;
+
+    if(hdev==NULL || sectorSize == 0 || buffSize < sectorSize)
+        return ZEN_ERROR;
+
+    max = read_max_sectors(hdev);
+    if(buffSize / sectorSize < max)
+        max = (u32)(buffSize / sectorSize);
+
+    memset(&p, 0, sizeof(struct sZenProgress));
+    p.bank = bank;
+    p.sectorsTotal = to > from ? to - from : 0;
+    p.eta = -1;
+
+    cancelled = 0;
+    start = zen_time_us();
+    ZEN_PROBE4(bank_start, bank, sectorSize, from, p.sectorsTotal);
+    for(i=from; i<to; i+=n) {
+        n = to - i < max ? to - i : max;
+
+        chunkStart = zen_time_us();
+        if(check_cancel() != ZEN_SUCC
+            || read_sector_buf(hdev, buff, bank, sectorSize, i, n) != ZEN_SUCC
+            || sink->write(sink, buff, n * sectorSize) != ZEN_SUCC) {
+            ZEN_PROBE3(bank_end, bank, (u64)(i - from) * sectorSize, ZEN_ERROR);
+            return ZEN_ERROR;
+        }
+
+        if(progressCb) {
+            now = zen_time_us();
+            p.sectorsDone += n;
+            p.bytesDone += (u64)n * sectorSize;
+            /* bytes per us are MB/s */
+            p.rate = now > chunkStart ? (double)n * sectorSize / (now - chunkStart) : 0;
+            p.avgRate = now > start ? (double)p.bytesDone / (now - start) : 0;
+            p.eta = p.avgRate > 0 ? (double)(p.sectorsTotal - p.sectorsDone) * sectorSize / p.avgRate / 1000000 : -1;
+            progressCb(progressCtx, &p);
+        }
+    }
+    ZEN_PROBE3(bank_end, bank, (u64)p.sectorsTotal * sectorSize, ZEN_SUCC);
+
+    return ZEN_SUCC;
+}
+
+int read_sector_buf(usb_dev_handle* hdev, u8* buff, u8 bank, u32 sectorSize, u32 from, u32 count) {
     struct     sCBW cbw = {    
         CBW_SIG,    /* CBW Signature */
         rand(),     /* Tag */
@@ -252,43 +928,52 @@ int read_sector(usb_dev_handle* hdev, FILE* fd, u8 bank, u32 sectorSize, u32 fro
             CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR, 
             0x04, /* bank */
             0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* start sector */
-            0x00, 0x00, 0x00, 0x08, /* sector count */
+            0x00, 0x00, 0x00, 0x00, /* sector count */
             0x00 
         } 
-
     };
-    u32    i, bufferSize;
+    u32    n, max;
 
-     if(hdev==NULL) 
-        return ZEN_ERROR;
-
-    bufferSize = sectorSize * 8;
-    bin = (u8*)malloc(bufferSize);
-
-    if(bin==NULL)
+    if(hdev==NULL) 
         return ZEN_ERROR;
 
-    cbw.transferLength = bufferSize;
-    for(i=from; i<to; i+= 8) {
-        cbw.command[2] = bank;
-
-        cbw.command[10] = i & 0xFF;
-        cbw.command[9] = (i & 0xFF00) >> 8;
-        cbw.command[8] = (i & 0xFF0000) >> 16;
-        cbw.command[7] = (i & 0xFF000000) >> 24;
-
-        /* in fact start sector is 64-bit but fuck it */
-
-        if(read_packet(hdev,&cbw,bin,bufferSize) != ZEN_SUCC)
+    max = read_max_sectors(hdev);
+    cbw.command[2] = bank;
+    while(count > 0) {
+        n = count < max ? count : max;
+
+        cbw.tag = rand();
+        cbw.transferLength = n * sectorSize;
+        cbw.command[10] = from & 0xFF;
+        cbw.command[9] = (from & 0xFF00) >> 8;
+        cbw.command[8] = (from & 0xFF0000) >> 16;
+        cbw.command[7] = (from & 0xFF000000) >> 24;
+        cbw.command[14] = n & 0xFF;
+        cbw.command[13] = (n & 0xFF00) >> 8;
+
+        if(read_packet(hdev,&cbw,buff,n * sectorSize) != ZEN_SUCC)
             return ZEN_ERROR;
-        fwrite(bin, 1, bufferSize, fd);
-    }
 
-    free(bin);
+        buff += n * sectorSize;
+        from += n;
+        count -= n;
+    }
 
     return ZEN_SUCC;
 }
 
+const char* bank_tag_name(u8 tag) {
+    switch(tag) {
+        case SIGMATEL_BANK_TAG_STMPSYS: return "stmpsys.sb";
+        case SIGMATEL_BANK_TAG_USBMSC: return "usbmsc.sb";
+        case SIGMATEL_BANK_TAG_RESOURCE_BIN: return "resource.bin";
+        case SIGMATEL_BANK_TAG_DATA: return "data.bin";
+        case SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM: return "resource-ram.bin";
+        case SIGMATEL_BANK_TAG_BOOTMANAGER: return "bootmanager.sb";
+    }
+    return NULL;
+}
+
 int read_bank_size(usb_dev_handle* hdev, u8 bank, struct sBankSize* result) {
     u32     sectorsCount[2]={0,0}; /* it's 64-bit but we won't for sure read more than 4GB */
     struct sCBW    cbw = {    
@@ -326,8 +1011,14 @@ int read_bank_size(usb_dev_handle* hdev, u8 bank, struct sBankSize* result) {
     if(read_packet(hdev,&cbw,(char*)&sectorsCount,8) != ZEN_SUCC)
         return ZEN_ERROR;
 
-    /* something is not ok here, in SDK sectorsCount is 64-bit but here only 24-bits are valid */
-    result->sectorsCount    = DWSWAP(sectorsCount[1] & 0xFFFFFF00);
+    /* something is not ok here, in SDK sectorsCount is 64-bit but on Zen Stone only 24-bits are valid */
+    if(zen_get_profile(hdev)->quirks & ZEN_QUIRK_SECTORS_24BIT)
+        result->sectorsCount = DWSWAP(sectorsCount[1] & 0xFFFFFF00);
+    else if(sectorsCount[0] != 0) {
+        zen_log("Memory bank %u has more than 4G sectors\n", bank);
+        return ZEN_ERROR;
+    } else
+        result->sectorsCount = DWSWAP(sectorsCount[1]);
 
     if(read_packet(hdev,&cbw2,(char*)&sectorSize,4) != ZEN_SUCC)
         return ZEN_ERROR;
@@ -338,7 +1029,18 @@ int read_bank_size(usb_dev_handle* hdev, u8 bank, struct sBankSize* result) {
 }
 
 int read_bank(usb_dev_handle* hdev, u8 bank, FILE* f) {
-    int                 res;
+    struct sZenSink sink;
+
+    zen_sink_file(&sink, f);
+
+    return read_bank_sink(hdev, bank, &sink);
+}
+
+int read_bank_sink(usb_dev_handle* hdev, u8 bank, struct sZenSink* sink) {
+    return read_bank_sink_buf(hdev, bank, sink, NULL, 0);
+}
+
+int read_bank_sink_buf(usb_dev_handle* hdev, u8 bank, struct sZenSink* sink, u8* buff, size_t buffSize) {
     struct sBankSize    bankSize;
 
     if(read_bank_size(hdev, bank, &bankSize) == ZEN_ERROR)
@@ -351,14 +1053,207 @@ int read_bank(usb_dev_handle* hdev, u8 bank, FILE* f) {
 
     if((bankSize.sectorsCount * bankSize.sectorSize) > (50<<20)) { /* > 50 MB */
         zen_log("WARNING: You have chosen memory bank bigger than 50MB\n");
-        zen_log("You can stop the reading process by Ctrl+C\n");
+        if(cancelToken)
+            zen_log("Reading can be cancelled between chunks\n");
     }
 
-    res = read_sector(hdev, f, bank, bankSize.sectorSize, 0, bankSize.sectorsCount);
+    if(buff == NULL)
+        return read_sector_sink(hdev, sink, bank, bankSize.sectorSize, 0, bankSize.sectorsCount);
+
+    return read_sector_sink_buf(hdev, sink, bank, bankSize.sectorSize, 0, bankSize.sectorsCount, buff, buffSize);
+}
+
+/* Reflected crc32 table of polynomial 0xEDB88320, constant so threads may share it */
+static const u32 crcTable[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+u32 zen_crc32(u32 crc, const u8* buff, size_t len) {
+    size_t      i;
+
+    crc = ~crc;
+    for(i=0; i<len; i++)
+        crc = crcTable[(crc ^ buff[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+int write_sector(usb_dev_handle* hdev, FILE* fd, u8 bank, u32 sectorSize, u32 from, u32 to, u32 flags) {
+    u8*        bout; /* write buffer */
+    u8*        bin;  /* read-back buffer */
+    struct     sCBW cbw = {    
+        CBW_SIG,     /* CBW Signature */
+        rand(),      /* Tag */
+        0,           /* Transfer length - unknown yet */
+        CBW_DIR_OUT, /* Direction */
+        0x00,        /* Reserved */
+        0x10,        /* Length of command */
+        {    
+            CMD_SCSI_SIGMATEL_WRITE, /* Command */
+            CMD_SIGMATEL_WRITE_LOGICAL_DRIVE_SECTOR, 
+            0x04, /* bank */
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* start sector */
+            0x00, 0x00, 0x00, 0x00, /* sector count */
+            0x00 
+        } 
+    };
+    struct     sCBW rcbw;
+    u32        i, count, bufferSize, readSize;
+    int        res = ZEN_SUCC;
+
+    if(hdev==NULL || sectorSize==0) 
+        return ZEN_ERROR;
+
+    zen_cache_forget(hdev);
+
+    bufferSize = sectorSize * ZEN_WRITE_SECTORS;
+    bout = (u8*)malloc(bufferSize);
+    bin = (u8*)malloc(bufferSize);
+
+    if(bout==NULL || bin==NULL) {
+        free(bout);
+        free(bin);
+        return ZEN_ERROR;
+    }
+
+    cbw.command[2] = bank;
+    for(i=from; i<to && res==ZEN_SUCC; i+=count) {
+        count = to - i < ZEN_WRITE_SECTORS ? to - i : ZEN_WRITE_SECTORS;
+
+        readSize = (u32)fread(bout, 1, count * sectorSize, fd);
+        /* only the end of file is padded, broken read must not reach flash */
+        if(readSize < count * sectorSize && ferror(fd)) {
+            zen_log("Reading data for sectors %u-%u of bank %u failed\n", i, i + count - 1, bank);
+            res = ZEN_ERROR;
+            break;
+        }
+        if(readSize < count * sectorSize)
+            memset(bout + readSize, 0xFF, count * sectorSize - readSize);
+
+        cbw.tag = rand();
+        cbw.transferLength = count * sectorSize;
+        cbw.command[10] = i & 0xFF;
+        cbw.command[9] = (i & 0xFF00) >> 8;
+        cbw.command[8] = (i & 0xFF0000) >> 16;
+        cbw.command[7] = (i & 0xFF000000) >> 24;
+        cbw.command[14] = count & 0xFF;
+        cbw.command[13] = (count & 0xFF00) >> 8;
+
+        if(send_packet(hdev,&cbw,bout,count * sectorSize) != ZEN_SUCC) {
+            zen_log("Writing sectors %u-%u of bank %u failed\n", i, i + count - 1, bank);
+            res = ZEN_ERROR;
+            break;
+        }
+
+        if(!(flags & ZEN_WRITE_VERIFY))
+            continue;
+
+        /* read the same range back, only the direction and opcode differ */
+        memcpy(&rcbw, &cbw, sizeof(struct sCBW));
+        rcbw.tag = rand();
+        rcbw.direction = CBW_DIR_IN;
+        rcbw.command[0] = CMD_SCSI_SIGMATEL_READ;
+        rcbw.command[1] = CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR;
+
+        if(read_packet(hdev,&rcbw,bin,count * sectorSize) != ZEN_SUCC) {
+            zen_log("Reading back sectors %u-%u of bank %u failed\n", i, i + count - 1, bank);
+            res = ZEN_ERROR;
+        } else if(memcmp(bout, bin, count * sectorSize) != 0) {
+            zen_log("Verification of sectors %u-%u of bank %u failed\n", i, i + count - 1, bank);
+            res = ZEN_ERROR;
+        }
+    }
+
+    free(bout);
+    free(bin);
 
     return res;
 }
 
+int write_bank(usb_dev_handle* hdev, u8 bank, FILE* f, u32 confirm) {
+    struct sAllocTable  table;
+    struct sBankSize    bankSize;
+    long                fileSize;
+    int                 i;
+
+    if(confirm != ZEN_WRITE_CONFIRM) {
+        zen_log("Writing bank %u not confirmed\n", bank);
+        return ZEN_ERROR;
+    }
+
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    for(i=0; i<table.rowsCount && table.row[i].bankNo != bank; i++);
+    if(i == table.rowsCount) {
+        zen_log("Memory bank %u not found in allocation table\n", bank);
+        return ZEN_ERROR;
+    }
+    if(table.row[i].type == SIGMATEL_BANK_TYPE_DATA) {
+        zen_log("Memory bank %u is a data bank, refusing to write it\n", bank);
+        return ZEN_ERROR;
+    }
+
+    if(read_bank_size(hdev, bank, &bankSize) == ZEN_ERROR)
+        return ZEN_ERROR;
+
+    if(fseek(f, 0, SEEK_END) != 0 || (fileSize = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        zen_log("Can't determine file size\n");
+        return ZEN_ERROR;
+    }
+
+    if(fileSize == 0 || (u64)fileSize > (u64)bankSize.sectorsCount * bankSize.sectorSize) {
+        zen_log("File size (%ldB) doesn't fit memory bank %u (%lluB)\n", fileSize, bank, 
+            (u64)bankSize.sectorsCount * bankSize.sectorSize);
+        return ZEN_ERROR;
+    }
+
+    return write_sector(hdev, f, bank, bankSize.sectorSize, 0, 
+        (u32)((fileSize + bankSize.sectorSize - 1) / bankSize.sectorSize), ZEN_WRITE_VERIFY);
+}
+
 int read_chip_id(usb_dev_handle *hdev) {
     u16            id;
     struct sCBW    cbw = {    
@@ -408,8 +1303,9 @@ int read_debug_info(usb_dev_handle *hdev, FILE* fd) {
     return 0;
 }
 
-int read_firmware(usb_dev_handle *hdev) {
+int read_alloc_table(usb_dev_handle *hdev, struct sAllocTable* table) {
     int    i;
+    size_t len;
     struct sCBW    cbw = {    
         CBW_SIG,    /* CBW Signature */ 
         rand(),     /* Tag */
@@ -423,21 +1319,143 @@ int read_firmware(usb_dev_handle *hdev) {
             0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
         } 
     };
-    struct sAllocTable    table;
 
     if(hdev==NULL) 
         return ZEN_ERROR;
 
-    if(read_packet(hdev,&cbw,(char*)&table,sizeof(struct sAllocTable)) != ZEN_SUCC)
+    /* device may send only rows it has */
+    if(read_packet_len(hdev,&cbw,(char*)table,sizeof(struct sAllocTable),&len) != ZEN_SUCC || len < 2)
         return ZEN_ERROR;
 
-    table.rowsCount = WSWAP(table.rowsCount);
+    table->rowsCount = WSWAP(table->rowsCount);
+
+    if(table->rowsCount > 10) {
+        zen_log("More than 10 partitions (%u), contact developer\n", table->rowsCount);
+        return ZEN_ERROR;
+    }
+
+    if(len < 2 + table->rowsCount * sizeof(struct sAllocTableRow)) {
+        zen_log("Allocation table of %u partitions cut at %luB\n", table->rowsCount, (unsigned long)len);
+        return ZEN_ERROR;
+    }
+
+    for(i=0; i<table->rowsCount; i++)
+        table->row[i].size = QSWAP(table->row[i].size);
+
+    return ZEN_SUCC;
+}
+
+/** Sends CMD_SCSI_SIGMATEL_READ subcommand with 2 argument bytes, reads big endian value of len bytes. */
+static int read_vendor_value(usb_dev_handle* hdev, u8 cmd, u8 arg1, u8 arg2, u64* value, u32 len) {
+    u8          buff[8];
+    u32         i;
+    struct sCBW cbw = {    
+        CBW_SIG,    /* CBW Signature */
+        rand(),     /* Tag */
+        0,          /* Transfer length */
+        CBW_DIR_IN, /* Direction */
+        0x00,       /* Reserved */
+        0x10,       /* Length of command */
+        {    
+            CMD_SCSI_SIGMATEL_READ, /* Command */
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+        } 
+    };
+
+    cbw.transferLength = len;
+    cbw.command[1] = cmd;
+    cbw.command[2] = arg1;
+    cbw.command[3] = arg2;
+
+    if(read_packet(hdev,&cbw,buff,len) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    for(*value=0, i=0; i<len; i++)
+        *value = (*value << 8) | buff[i];
+
+    return ZEN_SUCC;
+}
+
+int read_device_layout(usb_dev_handle *hdev, struct sZenLayout* layout) {
+    struct sAllocTable  table;
+    struct sBankSize    bankSize;
+    struct sZenDrive*   d;
+    u64                 value;
+    int                 i;
+
+    if(hdev==NULL) 
+        return ZEN_ERROR;
+
+    memset(layout, 0, sizeof(struct sZenLayout));
+    layout->mediaType = 0xFF;
+
+    /* media queries aren't needed for dumps, older firmwares may refuse them */
+    if(read_vendor_value(hdev, CMD_SIGMATEL_GET_LOGICAL_MEDIA_NUM, 0, 0, &value, 1) == ZEN_SUCC)
+        layout->mediaCount = (u8)value;
+    else
+        zen_log("Media count unknown, continuing\n");
+    if(read_vendor_value(hdev, CMD_SIGMATEL_GET_LOGICAL_MEDIA_INFO, CMD2_SIGMATEL_MEDIA_DRIVES, 0, &value, 2) == ZEN_SUCC)
+        layout->mediaDrives = (u16)value;
+    if(read_vendor_value(hdev, CMD_SIGMATEL_GET_LOGICAL_MEDIA_INFO, CMD2_SIGMATEL_MEDIA_SIZE, 0, &value, 8) == ZEN_SUCC)
+        layout->mediaSize = value;
+    if(read_vendor_value(hdev, CMD_SIGMATEL_GET_LOGICAL_MEDIA_INFO, CMD2_SIGMATEL_MEDIA_TYPE, 0, &value, 1) == ZEN_SUCC)
+        layout->mediaType = (u8)value;
+
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    layout->drivesCount = table.rowsCount;
+    for(i=0; i<table.rowsCount; i++) {
+        d = &layout->drive[i];
+        d->bankNo = table.row[i].bankNo;
+        d->type = table.row[i].type;
+        d->tag = table.row[i].tag;
+        d->size = table.row[i].size;
+
+        /* same geometry as reads use, bank refusing it doesn't hide the others */
+        if(read_bank_size(hdev, d->bankNo, &bankSize) == ZEN_ERROR) {
+            zen_log("Geometry of bank %u unknown, continuing\n", d->bankNo);
+            continue;
+        }
+        d->sectorSize = bankSize.sectorSize;
+        d->sectorsCount = bankSize.sectorsCount;
+    }
+
+    return ZEN_SUCC;
+}
+
+int read_firmware(usb_dev_handle *hdev) {
+    return read_firmware_dir(hdev, ".");
+}
+
+/** Sink factory of read_firmware_dir(), ctx is the directory. */
+static int dir_sink(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink) {
+    char path[1024];
 
-    if(table.rowsCount > 10) {
-        zen_log("More than 10 partitions (%u), contact developer\n", table.rowsCount);
+    snprintf(path, sizeof(path), "%s/%s", (const char*)ctx, name);
+    if(zen_sink_path(sink, path) != ZEN_SUCC) {
+        zen_log("File creating error, check privileges\n");
         return ZEN_ERROR;
     }
 
+    return ZEN_SUCC;
+}
+
+int read_firmware_dir(usb_dev_handle *hdev, const char* dir) {
+    return read_firmware_sink(hdev, dir_sink, (void*)dir);
+}
+
+int read_firmware_sink(usb_dev_handle *hdev, zen_sink_factory factory, void* ctx) {
+    return read_firmware_sink_buf(hdev, factory, ctx, NULL, 0);
+}
+
+int read_firmware_sink_buf(usb_dev_handle *hdev, zen_sink_factory factory, void* ctx, u8* buff, size_t buffSize) {
+    int    i, res;
+    struct sAllocTable    table;
+
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
     for(i=0; i<table.rowsCount; i++) {
         char* type;
 
@@ -446,117 +1464,50 @@ int read_firmware(usb_dev_handle *hdev) {
             case SIGMATEL_BANK_TYPE_SYSTEM: type = "SYSTEM"; break;
             default: type = "UNKNOWN";
         }
-        table.row[i].size = QSWAP(table.row[i].size);
 
         zen_log("Bank %u [%s] %lluB\n", table.row[i].bankNo, type, table.row[i].size);
     }
 
     for(i=0; i<table.rowsCount; i++) {
-        switch(table.row[i].tag) {
-            case SIGMATEL_BANK_TAG_STMPSYS: {
-                FILE* f = fopen("stmpsys.sb", "wb");
-
-                zen_log("Reading system\n");
-                
-                if(f == NULL) {
-                    zen_log("File creating error, check privileges");
-                    return ZEN_ERROR;
-                }
-
-                if(read_bank(hdev, table.row[i].bankNo, f) != ZEN_SUCC) {
-                    fclose(f);
-                    return ZEN_ERROR;
-                }
+        struct sZenSink sink;
+        const char*     name;
+        char            filename[13];
 
-                fclose(f);
-
-                break;
-            }
-            case SIGMATEL_BANK_TAG_USBMSC: {
-                FILE* f = fopen("usbmsc.sb", "wb");
-
-                zen_log("Reading USB Mass Storage driver\n");
-                
-                if(f == NULL) {
-                    zen_log("File creating error, check privileges");
-                    return ZEN_ERROR;
-                }
-
-                if(read_bank(hdev, table.row[i].bankNo, f) != ZEN_SUCC) {
-                    fclose(f);
-                    return ZEN_ERROR;
-                }
-
-                fclose(f);
-                break;
-            }
-            case SIGMATEL_BANK_TAG_RESOURCE_BIN: {
-                FILE* f = fopen("resource.bin", "wb");
-
-                zen_log("Reading resources\n");
-                
-                if(f == NULL) {
-                    zen_log("File creating error, check privileges");
-                    return ZEN_ERROR;
-                }
-
-                if(read_bank(hdev, table.row[i].bankNo, f) != ZEN_SUCC) {
-                    fclose(f);
-                    return ZEN_ERROR;
-                }
-
-                fclose(f);
-
-                break;
-            }
-            case SIGMATEL_BANK_TAG_DATA: {
+        switch(table.row[i].tag) {
+            case SIGMATEL_BANK_TAG_STMPSYS: zen_log("Reading system\n"); break;
+            case SIGMATEL_BANK_TAG_USBMSC: zen_log("Reading USB Mass Storage driver\n"); break;
+            case SIGMATEL_BANK_TAG_RESOURCE_BIN: zen_log("Reading resources\n"); break;
+            case SIGMATEL_BANK_TAG_BOOTMANAGER: zen_log("Reading bootmanager\n"); break;
+            case SIGMATEL_BANK_TAG_DATA:
                 zen_log("Data bank, skipping\n");
-                break;
-            }
-            case SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM: {
+                continue;
+            case SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM:
                 zen_log("Resource RAM bank, skipping\n");
-                break;
-            }
-            case SIGMATEL_BANK_TAG_BOOTMANAGER: {
-                FILE* f = fopen("bootmanager.sb", "wb");
-
-                zen_log("Reading bootmanager\n");
-                
-                if(f == NULL) {
-                    zen_log("File creating error, check privileges");
-                    return ZEN_ERROR;
-                }
-
-                if(read_bank(hdev, table.row[i].bankNo, f) != ZEN_SUCC) {
-                    fclose(f);
-                    return ZEN_ERROR;
-                }
+                continue;
+            default:
+                zen_log("Unkown tag 0x%X, saving anyway as bank%u.bin\n", table.row[i].tag, table.row[i].bankNo);
+        }
 
-                fclose(f);
-                break;
-            }
-            default: {
-                FILE*   f;
-                char    filename[13];
+        if((name = bank_tag_name(table.row[i].tag)) == NULL) {
+            snprintf(filename, 13, "bank%u.bin", table.row[i].bankNo);
+            name = filename;
+        }
 
-                zen_log("Unkown tag 0x%X, saving anyway as bank%u.bin\n", table.row[i].tag, table.row[i].bankNo);
+        if(check_cancel() != ZEN_SUCC)
+            return ZEN_ERROR;
 
-                snprintf(filename, 13, "bank%u.bin", table.row[i].bankNo);
-                f = fopen(filename, "wb");
-                
-                if(f == NULL) {
-                    zen_log("File creating error, check privileges");
-                    return ZEN_ERROR;
-                }
+        memset(&sink, 0, sizeof(struct sZenSink));
+        if(factory(ctx, &table.row[i], name, &sink) != ZEN_SUCC)
+            return ZEN_ERROR;
 
-                if(read_bank(hdev, table.row[i].bankNo, f) != ZEN_SUCC) {
-                    fclose(f);
-                    return ZEN_ERROR;
-                }
+        /* factory doesn't want this bank */
+        if(sink.write == NULL)
+            continue;
 
-                fclose(f);
-            }
-        }
+        /* only banks being read are sized */
+        res = read_bank_sink_buf(hdev, table.row[i].bankNo, &sink, buff, buffSize);
+        if(zen_sink_close(&sink, res == ZEN_SUCC) != ZEN_SUCC || res != ZEN_SUCC)
+            return ZEN_ERROR;
     }
 
     return ZEN_SUCC;
@@ -622,6 +1573,20 @@ int write_vol_limit_pass(usb_dev_handle *hdev, u8 limit, const char* pass) {
 }
 
 void deinit_zen(usb_dev_handle* hdev) {
+    struct sZenDev*             dev = dev_of(hdev);
+    const struct sZenTransport* transport = dev->transport;
+
+    zen_cache_forget(hdev);
+
+    /* handle may be reused by next open */
+    if(dev != &unattached)
+        memset(dev, 0, sizeof(struct sZenDev));
+
+    if(hdev && transport->close) {
+        transport->close(hdev);
+        return;
+    }
+
     if(hdev) {
         usb_release_interface(hdev, 0);
 
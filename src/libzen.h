@@ -13,8 +13,10 @@
 #include <usb.h>
 #include <memory.h>
 #include <string.h>
+#include <signal.h>
 
 #ifdef WIN32
+# include <windows.h>
 # define snprintf sprintf_s
 # if (_MSC_VER > 1300)
 #  pragma comment(lib, "libusb.lib")
@@ -28,10 +30,15 @@
 
 #define zen_log printf
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef unsigned char           u8;
 typedef unsigned short          u16;
 typedef unsigned int            u32;
 typedef unsigned long long int  u64;
+typedef long long int           s64;
 
 /* USB device ids */
 #define ZEN_VENDOR      0x041E
@@ -39,14 +46,22 @@ typedef unsigned long long int  u64;
 /* Zen Stone uses Sigmatel chip */
 #define ZEN_CHIP_ID     0x3500 /* SMTP3550 */
 #define ZEN_PROTO_VER   0x0200
-/* Timeout in ms for all operations from libusb */
+/* Timeout in ms for all operations from libusb, upper bound for adaptive timeouts, default of profiles */
 #define ZEN_TIMEOUT     3000
+/* Adaptive timeouts: lower bound in ms (default of profiles), samples needed before ZEN_TIMEOUT isn't used,
+ * transfer size that gets one round-trip time */
+#define ZEN_TIMEOUT_MIN     250
+#define ZEN_RTT_WARMUP      4
+#define ZEN_RTT_UNIT        65536
+/* Backoff between ready polls in zen_wait_ready(), ms */
+#define ZEN_READY_POLL_MIN  50
+#define ZEN_READY_POLL_MAX  1000
 /* Values returned */
 #define ZEN_SUCC        0
 #define ZEN_ERROR       -1
 /* Maximal battery level */
 #define ZEN_MAX_BATT    100
-/* Endpoints */
+/* Endpoints, default of profiles */
 #define ZEN_ENDP_IN     0x81
 #define    ZEN_ENDP_OUT 0x02
 
@@ -93,6 +108,10 @@ struct sCBW {
 #define CMD_SCSI_TEST_UNIT_READY    0x00
 #define CMD_SCSI_INQUIRY            0x12
 #define CMD_SCSI_CAPACITY           0x25
+#define CMD_SCSI_READ_10            0x28
+#define CMD_SCSI_READ_16            0x88
+#define CMD_SCSI_SERVICE_ACTION_IN  0x9E /* READ CAPACITY(16) is its service action */
+#define SAI_READ_CAPACITY_16        0x10
 #define CMD_SCSI_SIGMATEL_READ      0xC0 /* Zen Stone is using Sigmatel STMP3550 */
 #define CMD_SCSI_SIGMATEL_WRITE     0xC1
 
@@ -116,10 +135,28 @@ struct sCBW {
 #define CMD_ZEN_VOL_LIMIT_READ              0x81
 #define CMD_ZEN_VOL_LIMIT_WRITE             0x82
 
+/* Sectors per command when writing, bigger transfers are faster but every one is read back */
+#define ZEN_WRITE_SECTORS   32
+/* Has to be passed to write_bank(), it's easy to brick the player with it */
+#define ZEN_WRITE_CONFIRM   0x5A454E57 /* "ZENW" */
+/* Flags for write_sector() */
+#define ZEN_WRITE_VERIFY    0x01
+
+/* Maximal sectors per CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR in read_sector_buf(), profiles may use less */
+#define ZEN_READ_MAX_SECTORS 128
+
+/* Blocks per SCSI READ when imaging data partition, 128KB with 512B blocks */
+#define ZEN_IMAGE_BLOCKS    256
+
 /* For CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR */
 #define CMD2_SIGMATEL_SECTOR_SIZE   0x00 /* not sure */
 #define CMD2_SIGMATEL_BANK_SIZE     0x04
 
+/* For CMD_SIGMATEL_GET_LOGICAL_MEDIA_INFO, values are big endian */
+#define CMD2_SIGMATEL_MEDIA_DRIVES  0x00 /* u16 */
+#define CMD2_SIGMATEL_MEDIA_SIZE    0x01 /* u64 in bytes */
+#define CMD2_SIGMATEL_MEDIA_TYPE    0x06 /* u8 physical media type */
+
 /* Request confirmation struct - Command Status Wrapper. */
 struct sCSW {
     /** CSW Signature (0x55 0x53 0x42 0x53). */
@@ -138,6 +175,9 @@ struct sCSW {
 #define CSW_CMD_FAILED  0x01
 #define CSW_PHASE_ERR   0x02
 
+/* Bulk-Only Mass Storage Reset, class request to interface */
+#define BOT_RESET       0xFF
+
 /** Firmare version container, all values are chars not ints! */
 struct sFirmwVer {
     u8  major;
@@ -176,6 +216,13 @@ struct sCapResp {
     u32 sectorSize;
 };
 
+/** Response from usb in case of capacity check of big disk, big endian. */
+struct sCap16Resp {
+    u8  lastBlock[8];
+    u8  blockSize[4];
+    u8  reserved[20];
+};
+
 /** Response from usb in case of volume limit check. */
 struct sVolLimitRead {
     u8  reserved;
@@ -214,6 +261,29 @@ struct sAllocTable {
     struct sAllocTableRow row[10]; /* max 10 -> SDK for SMTP36xx says so.. */
 };
 
+/** Logical drive (memory bank) of device layout. */
+struct sZenDrive {
+    u8  bankNo;
+    u8  type;
+    u8  tag;
+    u32 sectorSize;
+    u32 sectorsCount;
+    /** Size from allocation table in bytes. */
+    u64 size;
+};
+
+/** Logical media and drives, see read_device_layout(). */
+struct sZenLayout {
+    u8  mediaCount;
+    /** Media info doesn't take media number, device answers for its default (system) media. */
+    u16 mediaDrives;
+    u64 mediaSize;
+    /** Physical media type, 0xFF if unknown. */
+    u8  mediaType;
+    u16 drivesCount;
+    struct sZenDrive drive[10];
+};
+
 /** Internal, for reading. */
 struct sBankSize {
     u32 sectorsCount;
@@ -222,6 +292,281 @@ struct sBankSize {
 
 #pragma pack(pop)
 
+/* Sector cache works on chunks of bank content, 8 sectors of 2048B */
+#define ZEN_CACHE_CHUNK     16384
+/* Maximal readahead window in chunks, doubled on every sequential read */
+#define ZEN_READAHEAD_MAX   32
+
+/* Upper bounds (in us) of transport latency histogram buckets, the last bucket is +Inf */
+#define ZEN_LAT_BUCKETS     8
+#define ZEN_LAT_BOUNDS      { 250, 500, 1000, 2500, 5000, 10000, 100000, 1000000 }
+
+/** Transport counters, updated by read_packet() and send_packet(). */
+struct sZenStats {
+    /** Number of CBWs sent. */
+    u64 commands;
+    /** Bytes received in data phases. */
+    u64 bytesIn;
+    /** Bytes sent in data phases. */
+    u64 bytesOut;
+    /** Commands that failed at any phase. */
+    u64 errors;
+    /** Sum of all command latencies in us. */
+    u64 latencySum;
+    /** Number of commands per latency bucket (not cumulative), see ZEN_LAT_BOUNDS. */
+    u64 latency[ZEN_LAT_BUCKETS + 1];
+};
+
+/** Sector cache counters. */
+struct sZenCacheStats {
+    /** Chunks served from cache. */
+    u64 hits;
+    /** Chunks which had to be read from device. */
+    u64 misses;
+    /** Read commands issued by cache, one fetch covers many chunks. */
+    u64 fetches;
+    /** Chunks read ahead of request. */
+    u64 readahead;
+    /** Number of chunks cache can hold, 0 if disabled. */
+    u32 capacity;
+};
+
+/* Device profiles, see zen_profile_select() */
+#define ZEN_PROFILE_NAME_LEN    32
+#define ZEN_PROFILE_BAD_MAX     8
+/* Profiles that can be loaded from file with zen_profile_load() */
+#define ZEN_PROFILES_MAX        16
+/* Only 24 bits of bank sectors count are valid (Zen Stone) */
+#define ZEN_QUIRK_SECTORS_24BIT 0x01
+/* Known-bad command of profile: opcode << 8 | Sigmatel subcommand (0 for other opcodes) */
+#define ZEN_BAD_CMD(op, sub)    (((op) << 8) | (sub))
+
+/** Tuning and quirks of player model, ids and chip id select it. */
+struct sZenProfile {
+    char    name[ZEN_PROFILE_NAME_LEN];
+    /** Ids, 0 matches any. */
+    u16     vid;
+    u16     pid;
+    /** Chip id, ZEN_ERROR matches any. */
+    int     chipId;
+    /** Sectors per read command, up to ZEN_READ_MAX_SECTORS. */
+    u32     readSectors;
+    /** Timeout in ms, upper bound for adaptive timeouts, and their lower bound. */
+    int     timeout;
+    int     timeoutMin;
+    u8      endpIn;
+    u8      endpOut;
+    /** ZEN_QUIRK_* flags. */
+    u32     quirks;
+    /** Commands device fails or hangs on, they are refused without sending, see ZEN_BAD_CMD(). */
+    u16     bad[ZEN_PROFILE_BAD_MAX];
+    int     badCount;
+};
+
+/* Handles open at the same time, see zen_attach() */
+#define ZEN_DEVS_MAX            64
+
+/** Bulk transport used by read_packet() and send_packet() for one handle, libusb by default, see zen_attach(). */
+struct sZenTransport {
+    /** Same semantics as usb_bulk_write(). */
+    int  (*bulkWrite)(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout);
+    /** Same semantics as usb_bulk_read(). */
+    int  (*bulkRead)(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout);
+    /** Called by deinit_zen() instead of releasing libusb handle, may be NULL. */
+    void (*close)(usb_dev_handle* hdev);
+    /** Same semantics as usb_clear_halt(), NULL if stalls can't be cleared. */
+    int  (*clearHalt)(usb_dev_handle* hdev, int ep);
+    /** Sends BOT_RESET, NULL if device can't be reset. */
+    int  (*reset)(usb_dev_handle* hdev);
+    /** Returns usbfs descriptor for URBs of libzen-async.hpp, NULL if transport has none. */
+    int  (*fd)(usb_dev_handle* hdev);
+};
+
+/** Command in progress, see zen_command_begin(). */
+struct sZenCommand {
+    usb_dev_handle* hdev;
+    /** Estimator of opcode or subcommand, transfer size in ZEN_RTT_UNITs. */
+    int             key;
+    u32             units;
+    /** Timeout in ms of every transfer phase. */
+    int             timeout;
+    u64             start;
+};
+
+/** Destination of streamed bank content, see zen_sink_*() for ready ones. */
+struct sZenSink {
+    /** Consumes next part of data, returns ZEN_ERROR to stop reading. */
+    int  (*write)(struct sZenSink* sink, const u8* data, size_t len);
+    /** Called once after last write, ok is 0 if reading failed, may be NULL. */
+    int  (*close)(struct sZenSink* sink, int ok);
+    /** Callback sink function and its user data. */
+    int  (*cb)(void* ctx, const u8* data, size_t len);
+    void*               ctx;
+    /* state of built-in sinks */
+    FILE*               f;
+    int                 fd;
+    /** Memory sink: buffer, bytes written, buffer size, 1 if buffer is malloc'd and grows. */
+    u8*                 data;
+    size_t              size;
+    size_t              capacity;
+    int                 grow;
+    /** Tee sink targets. */
+    struct sZenSink*    first;
+    struct sZenSink*    second;
+};
+
+/** State of running sector read, see zen_set_progress(). */
+struct sZenProgress {
+    u8      bank;
+    u32     sectorsDone;
+    u32     sectorsTotal;
+    u64     bytesDone;
+    /** MB/s of last chunk and since start of the read. */
+    double  rate;
+    double  avgRate;
+    /** Seconds left at average rate, -1 if unknown yet. */
+    double  eta;
+};
+
+/** Called after every chunk of sector reads. */
+typedef void (*zen_progress_cb)(void* ctx, const struct sZenProgress* progress);
+
+/**
+ * Creates sink for bank of read_firmware_sink(), name is bank_tag_name() or bank[no].bin.
+ * Returns ZEN_ERROR to stop reading, leaving sink->write NULL skips the bank.
+ */
+typedef int (*zen_sink_factory)(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink);
+
+/**
+ * @brief
+ * Registers handle opened outside of libusb with its bulk transport, init_zen_fast(), init_zen_sg()
+ * and sim_open() call it. Every handle has its own transport, deinit_zen() forgets it.
+ * State of a command lives on stack and state of device (transport, round-trip estimators)
+ * in its handle, so commands of one device don't disturb other devices, but table of
+ * handles, counters and settings aren't locked: libzen must be called from one thread,
+ * which may drive many devices (as libzen-async.hpp does)
+ * @param hdev handle, for other transports it's private struct of transport, libusb is never called with it
+ * @param transport pointer to transport, must be valid until deinit_zen(), NULL for libusb
+ * @return ZEN_SUCC, ZEN_ERROR if ZEN_DEVS_MAX handles are open
+**/
+int zen_attach(usb_dev_handle* hdev, const struct sZenTransport* transport);
+
+/**
+ * @brief
+ * Starts Bulk-Only command sent by other code than read_packet() and send_packet(), e.g.
+ * libzen-async.hpp: refuses commands device profile marks bad and picks timeout
+ * @param cmd command state, passed to zen_command_end()
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param cbw command block
+ * @param len data phase length
+ * @return timeout in ms of every transfer phase, ZEN_ERROR if command must not be sent
+**/
+int zen_command_begin(struct sZenCommand* cmd, usb_dev_handle* hdev, const struct sCBW* cbw, size_t len);
+
+/**
+ * @brief
+ * Ends command started with zen_command_begin(), updates transport counters and round-trip estimator
+ * @param cmd command state
+ * @param in bytes received in data phase
+ * @param out bytes sent in data phase
+ * @param res ZEN_SUCC if command completed
+ * @return res
+**/
+int zen_command_end(const struct sZenCommand* cmd, size_t in, size_t out, int res);
+
+/**
+ * @brief
+ * Clears halt of endpoint after stall
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param ep endpoint
+ * @return ZEN_SUCC, ZEN_ERROR if transport can't clear it
+**/
+int zen_clear_halt(usb_dev_handle* hdev, int ep);
+
+/**
+ * @brief
+ * Reset recovery of Bulk-Only spec: mass storage reset, then halts of both endpoints are cleared,
+ * brings device that is out of sync (transfer failed or was discarded) back to waiting for CBW
+ * @param hdev pointer to ZenStone created with initZen()
+**/
+void zen_reset_recovery(usb_dev_handle* hdev);
+
+/**
+ * @brief
+ * Checks if short data phase is in fact CSW of cbw, sent by device that skipped data phase
+ * @param data received data
+ * @param len bytes received
+ * @param cbw command block
+ * @return 1 if it is CSW, 0 otherwise
+**/
+int zen_is_csw(const void* data, int len, const struct sCBW* cbw);
+
+/**
+ * @brief
+ * Returns usbfs descriptor of handle for asynchronous URBs (linux only)
+ * @param hdev pointer to ZenStone created with initZen()
+ * @return descriptor, ZEN_ERROR if transport has none (SG_IO, simulated device)
+**/
+int zen_usbfs_fd(usb_dev_handle* hdev);
+
+/**
+ * @brief
+ * Finds best profile for device: one with most exactly matching ids and chip id, fields that
+ * match any count less. Matching profile loaded with zen_profile_load() beats all built-in ones
+ * @param vid vendor id
+ * @param pid product id
+ * @param chipId chip id, ZEN_ERROR if unknown
+ * @return profile, never NULL, generic profile matches everything
+**/
+const struct sZenProfile* zen_profile_find(int vid, int pid, int chipId);
+
+/**
+ * @brief
+ * Picks profile of opened device by ids, then reads chip id and picks again, init_zen_list(),
+ * init_zen(), init_zen_fast() and init_zen_sg() call it for every device they open, other tools
+ * may call it after opening device with libusb on their own, handle is attached with libusb transport then
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param vid vendor id
+ * @param pid product id
+ * @return profile of device now
+**/
+const struct sZenProfile* zen_profile_select(usb_dev_handle* hdev, int vid, int pid);
+
+/**
+ * @brief
+ * Picks profiles of all open devices again with ids and chip id remembered by zen_profile_select(),
+ * without talking to devices, zen_profile_load() calls it
+**/
+void zen_profile_reselect(void);
+
+/**
+ * @brief
+ * Loads profiles overriding built-in ones, one per line:
+ *   name: vid=041E pid=4154 chip=3500 sectors=128 timeout=3000 timeout_min=250 in=81 out=02 quirks=24bit bad=C081,C082
+ * All values are hexadecimal except sectors and timeouts, missing keys take values of generic profile,
+ * vid, pid and chip may be "any". Lines starting with # are skipped. Replaces previously loaded profiles,
+ * open devices get profiles picked again from new ones
+ * @param path profile file
+ * @return number of profiles loaded, ZEN_ERROR if file can't be read or is broken
+**/
+int zen_profile_load(const char* path);
+
+/**
+ * @brief
+ * Sets profile used by commands of device, until zen_profile_select() or zen_profile_load()
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param profile profile, must be valid until replaced, NULL for best match of unknown ids
+**/
+void zen_set_profile(usb_dev_handle* hdev, const struct sZenProfile* profile);
+
+/**
+ * @brief
+ * Returns profile used by commands of device
+ * @param hdev pointer to ZenStone created with initZen()
+ * @return profile, never NULL, handles without selected profile get best match of unknown ids
+**/
+const struct sZenProfile* zen_get_profile(usb_dev_handle* hdev);
+
 /**
  * @brief 
  * Finds device on bus, creates interface and sets configuration
@@ -232,6 +577,18 @@ struct sBankSize {
 **/
 usb_dev_handle* init_zen(int vid, int pid);
 
+/**
+ * @brief 
+ * Opens all matching devices, like init_zen() does for the first one
+ * 
+ * @param vid Vendor id, set to 0 to use default Creatice VID
+ * @param pid Product id, set to 0 to use default Zen Stone PID
+ * @param list array where handles will be saved
+ * @param max size of list
+ * @return number of opened devices
+**/
+int init_zen_list(int vid, int pid, usb_dev_handle** list, int max);
+
 /**
  * @brief 
  * Checks the firmware version
@@ -251,6 +608,16 @@ int read_firmware_ver(usb_dev_handle* hdev, struct sFirmwVer* verPtr);
 **/
 int read_batt_level(usb_dev_handle* hdev);
 
+/**
+ * @brief 
+ * Reads raw battery response (level and charge state), logs nothing
+ * 
+ * @param hdev pointer to ZenStone created with initZen() 
+ * @param resp pointer to struct where response will be saved
+ * @return ZEN_SUCC if succesfully read battery state
+**/
+int read_batt_info(usb_dev_handle* hdev, struct sBattResp* resp);
+
 /**
  * @brief 
  * Gets Zen Stone flash disk capacity in megabytes
@@ -260,6 +627,52 @@ int read_batt_level(usb_dev_handle* hdev);
 **/
 int read_capacity(usb_dev_handle *hdev);
 
+/**
+ * @brief 
+ * Gets number of blocks and block size of flash disk with SCSI READ CAPACITY
+ * 
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param blocks pointer where number of blocks will be saved
+ * @param blockSize pointer where block size will be saved
+ * @return ZEN_SUCC if succeded
+**/
+int read_capacity_blocks(usb_dev_handle *hdev, u64* blocks, u32* blockSize);
+
+/**
+ * @brief
+ * Reads blocks of flash disk with SCSI READ(10), or READ(16) if LBA doesn't fit 32 bits
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param fd file to which content will be saved
+ * @param lba first block
+ * @param count number of blocks to read
+ * @param blockSize block size from read_capacity_blocks()
+ * @return ZEN_SUCC if successfully read data
+**/
+int read_blocks(usb_dev_handle *hdev, FILE* fd, u64 lba, u64 count, u32 blockSize);
+
+/**
+ * @brief
+ * Streams blocks of flash disk to sink through caller's buffer, doesn't allocate memory
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param sink destination, isn't closed
+ * @param lba first block
+ * @param count number of blocks to read
+ * @param blockSize block size from read_capacity_blocks()
+ * @param buff buffer, blockSize * ZEN_IMAGE_BLOCKS bytes read with full speed, smaller in more commands
+ * @param buffSize size of buff, at least one block
+ * @return ZEN_SUCC if successfully read and consumed all data
+**/
+int read_blocks_buf(usb_dev_handle *hdev, struct sZenSink* sink, u64 lba, u64 count, u32 blockSize, u8* buff, size_t buffSize);
+
+/**
+ * @brief
+ * Images whole flash disk (data partition) without usb_storage driver
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param fd file to which image will be saved
+ * @return ZEN_SUCC if successfully read data
+**/
+int read_image(usb_dev_handle *hdev, FILE* fd);
+
 /**
  * @brief
  * Reads the volume limit in %
@@ -293,10 +706,22 @@ void deinit_zen(usb_dev_handle* hdev);
  * @param cbw pointer to sCBW struct with request params
  * @param ret pointer to struct where data will be saved
  * @param retSize size of struct where data will be saved
- * @return ZEN_SUCC if successfully read data into ret struct
+ * @return ZEN_SUCC if successfully read data into ret struct, short data phase is an error
 **/
 int read_packet(usb_dev_handle* hdev, struct sCBW* cbw, void* ret, size_t retSize);
 
+/**
+ * @brief
+ * Same as read_packet() but device may send less than retSize
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param cbw pointer to sCBW struct with request params
+ * @param ret pointer to buffer where data will be saved
+ * @param retSize size of buffer
+ * @param actual number of bytes device sent, bytes after it in ret are undefined
+ * @return ZEN_SUCC if command succeded
+**/
+int read_packet_len(usb_dev_handle* hdev, struct sCBW* cbw, void* ret, size_t retSize, size_t* actual);
+
 /**
  * @brief
  * Sends a cbr, then makes a bulk write with struct from data parametr
@@ -339,6 +764,200 @@ int read_bank(usb_dev_handle* hdev, u8 bank, FILE* f);
 **/
 int read_sector(usb_dev_handle *hdev, FILE* fd, u8 bank, u32 sectorSize, u32 from, u32 to);
 
+/**
+ * @brief
+ * Reads chosen fragment of memory bank into memory
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param buff buffer for data, at least count * sectorSize bytes
+ * @param bank bank id
+ * @param sectorSize sector size of bank
+ * @param from first sector number
+ * @param count number of sectors, up to readSectors of device profile are read with one command
+ * @return ZEN_SUCC if successfully read data
+**/
+int read_sector_buf(usb_dev_handle *hdev, u8* buff, u8 bank, u32 sectorSize, u32 from, u32 count);
+
+/**
+ * @brief
+ * Streams chosen fragment of memory bank to sink, readSectors of device profile at a time,
+ * sink isn't closed
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param sink destination
+ * @param bank bank id
+ * @param from first sector number
+ * @param to last sector number (content won't be read)
+ * @return ZEN_SUCC if successfully read and consumed all data
+**/
+int read_sector_sink(usb_dev_handle *hdev, struct sZenSink* sink, u8 bank, u32 sectorSize, u32 from, u32 to);
+
+/**
+ * @brief
+ * Streams whole memory bank to sink, sink isn't closed
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param bank bank id
+ * @param sink destination
+ * @return ZEN_SUCC if successfully read and consumed all data
+**/
+int read_bank_sink(usb_dev_handle* hdev, u8 bank, struct sZenSink* sink);
+
+/**
+ * @brief
+ * Same as read_sector_sink() but reads through caller's buffer, doesn't allocate memory.
+ * Buffer of sectorSize * ZEN_READ_MAX_SECTORS bytes is read with full speed, smaller one
+ * in more commands; it may be aligned as the sink needs (O_DIRECT files etc.)
+ * @param buff buffer
+ * @param buffSize size of buff, at least one sector
+ * @return ZEN_SUCC if successfully read and consumed all data
+**/
+int read_sector_sink_buf(usb_dev_handle* hdev, struct sZenSink* sink, u8 bank, u32 sectorSize, u32 from, u32 to,
+    u8* buff, size_t buffSize);
+
+/**
+ * @brief
+ * Same as read_bank_sink() but reads through caller's buffer, see read_sector_sink_buf()
+ * @param buff buffer, NULL to allocate it for this call
+ * @param buffSize size of buff
+ * @return ZEN_SUCC if successfully read and consumed all data
+**/
+int read_bank_sink_buf(usb_dev_handle* hdev, u8 bank, struct sZenSink* sink, u8* buff, size_t buffSize);
+
+/**
+ * @brief
+ * Sink calling cb(ctx, data, len) for every part of data
+**/
+void zen_sink_callback(struct sZenSink* sink, int (*cb)(void* ctx, const u8* data, size_t len), void* ctx);
+
+/**
+ * @brief
+ * Sink writing to open file, file isn't closed
+**/
+void zen_sink_file(struct sZenSink* sink, FILE* f);
+
+/**
+ * @brief
+ * Sink writing to file it creates, file is closed with the sink
+ * @return ZEN_SUCC if file was created
+**/
+int zen_sink_path(struct sZenSink* sink, const char* path);
+
+/**
+ * @brief
+ * Sink writing to file descriptor (pipe, socket...), descriptor isn't closed
+**/
+void zen_sink_fd(struct sZenSink* sink, int fd);
+
+/**
+ * @brief
+ * Sink writing to memory, sink->size holds number of bytes written
+ * @param buff buffer, NULL to use buffer malloc'd by sink (caller frees sink->data)
+ * @param capacity buffer size, writing more fails; initial size if buff is NULL
+**/
+void zen_sink_mem(struct sZenSink* sink, u8* buff, size_t capacity);
+
+/**
+ * @brief
+ * Sink passing data to first and then to second sink, closing closes both
+**/
+void zen_sink_tee(struct sZenSink* sink, struct sZenSink* first, struct sZenSink* second);
+
+/**
+ * @brief
+ * Closes sink, safe to call on sinks without close
+ * @param ok 0 if stream is incomplete
+ * @return ZEN_SUCC if sink flushed all data
+**/
+int zen_sink_close(struct sZenSink* sink, int ok);
+
+/**
+ * @brief
+ * Reads any byte range of memory bank, goes through sector cache if it is enabled
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param bank bank id
+ * @param offset offset in bytes from the beginning of bank
+ * @param len number of bytes to read
+ * @param buff buffer for data, at least len bytes
+ * @return number of bytes read (less than len at the end of bank) or ZEN_ERROR
+**/
+s64 zen_read_bank_range(usb_dev_handle *hdev, u8 bank, u64 offset, u32 len, u8* buff);
+
+/**
+ * @brief
+ * Enables sector cache used by zen_read_bank_range(), entries are kept per device,
+ * deinit_zen() and every write drop those of the device
+ * @param budget memory for cached data in bytes, 0 disables cache, at least
+ * ZEN_READAHEAD_MAX * 2 chunks (1MB) otherwise
+ * @return ZEN_SUCC if memory was allocated, ZEN_ERROR if budget is too small or memory is missing
+**/
+int zen_cache_enable(u32 budget);
+
+/**
+ * @brief
+ * Drops cached data and remembered bank sizes of all devices, cache stays enabled
+**/
+void zen_cache_flush(void);
+
+/**
+ * @brief
+ * Drops cached data and remembered bank sizes of one device
+ * @param hdev pointer to ZenStone created with initZen()
+**/
+void zen_cache_forget(usb_dev_handle* hdev);
+
+/**
+ * @brief
+ * Copies sector cache counters
+ * @param stats pointer to struct where counters will be saved
+**/
+void zen_cache_stats(struct sZenCacheStats* stats);
+
+/**
+ * @brief
+ * Returns file name used for bank with given tag, like stmpsys.sb
+ * @param tag bank tag from allocation table
+ * @return file name or NULL for unknown tags
+**/
+const char* bank_tag_name(u8 tag);
+
+/**
+ * @brief
+ * Writes chosen fragment of memory bank, counterpart of read_sector()
+ * 
+ * Missing bytes at the end of file are filled with 0xFF, read error of file stops writing.
+ * With ZEN_WRITE_VERIFY every chunk is read back and compared byte by byte.
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param fd file from which content will be taken
+ * @param bank bank id
+ * @param sectorSize sector size of bank
+ * @param from first sector number
+ * @param to last sector number (won't be written)
+ * @param flags ZEN_WRITE_VERIFY or 0
+ * @return ZEN_SUCC if successfully written (and verified)
+**/
+int write_sector(usb_dev_handle *hdev, FILE* fd, u8 bank, u32 sectorSize, u32 from, u32 to, u32 flags);
+
+/**
+ * @brief
+ * Writes whole memory bank from file and verifies it, file can't be bigger than bank
+ *
+ * Data banks are refused, use the mass storage driver for them.
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param bank bank id
+ * @param f file with bank content
+ * @param confirm must be ZEN_WRITE_CONFIRM
+ * @return ZEN_SUCC if successfully written and verified
+**/
+int write_bank(usb_dev_handle* hdev, u8 bank, FILE* f, u32 confirm);
+
+/**
+ * @brief
+ * Updates CRC-32 (IEEE 802.3) with buffer content
+ * @param crc previous value, 0 for first call
+ * @param buff data
+ * @param len data length
+ * @return updated CRC
+**/
+u32 zen_crc32(u32 crc, const u8* buff, size_t len);
+
 /**
  * @brief
  * Checks if you can read/write from/to device
@@ -363,6 +982,28 @@ int read_chip_id(usb_dev_handle *hdev);
 **/
 int read_protocol_ver(usb_dev_handle *hdev);
 
+/**
+ * @brief
+ * Reads allocation table, sizes and rows count are converted to host byte order
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param table pointer to struct where table will be saved
+ * @return ZEN_SUCC if succeded
+**/
+int read_alloc_table(usb_dev_handle *hdev, struct sAllocTable* table);
+
+/**
+ * @brief
+ * Reads logical media and every logical drive with type, tag, sector size, sectors count
+ * and size, for reporting. Sector size and count come from read_bank_size(), same as reads
+ * use them, 0 if bank refuses them, size from the allocation table. Media queries are
+ * optional, devices refusing them get mediaCount/mediaDrives/mediaSize 0 and mediaType 0xFF.
+ * Dumps don't need it, read_firmware_sink() sizes only banks it reads
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param layout result
+ * @return ZEN_SUCC if succeded
+**/
+int read_device_layout(usb_dev_handle *hdev, struct sZenLayout* layout);
+
 /**
  * @brief
  * Reads the whole firmware to files, probably will work only on Zen Stone
@@ -384,8 +1025,105 @@ int read_protocol_ver(usb_dev_handle *hdev);
 */
 int read_firmware(usb_dev_handle *hdev);
 
+/**
+ * @brief
+ * Reads the whole firmware to files in chosen directory, see read_firmware()
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param dir existing directory
+ * @return ZEN_SUCC if succeded
+**/
+int read_firmware_dir(usb_dev_handle *hdev, const char* dir);
+
+/**
+ * @brief
+ * Streams every firmware bank to sink made by factory, data and resource RAM banks are skipped
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param factory called before every bank
+ * @param ctx passed to factory
+ * @return ZEN_SUCC if succeded
+**/
+int read_firmware_sink(usb_dev_handle *hdev, zen_sink_factory factory, void* ctx);
+
+/**
+ * @brief
+ * Same as read_firmware_sink() but every bank is read through caller's buffer,
+ * see read_sector_sink_buf()
+ * @param buff buffer, NULL to allocate one per bank
+ * @param buffSize size of buff
+ * @return ZEN_SUCC if succeded
+**/
+int read_firmware_sink_buf(usb_dev_handle *hdev, zen_sink_factory factory, void* ctx, u8* buff, size_t buffSize);
+
+/**
+ * @brief
+ * Copies transport counters collected since start or last zen_reset_stats()
+ * @param stats pointer to struct where counters will be saved
+**/
+void zen_get_stats(struct sZenStats* stats);
+
+/**
+ * @brief
+ * Zeroes transport counters
+**/
+void zen_reset_stats(void);
+
+/**
+ * @brief
+ * Switches adaptive timeouts (on by default). Each opcode (subcommand for vendor commands)
+ * of each open device keeps smoothed round-trip time per ZEN_RTT_UNIT bytes, timeout of every transfer phase is
+ * srtt + 4 * rttvar scaled by transfer size and clamped to timeoutMin..timeout of device profile.
+ * Transfer that hit its timeout doubles the variance so slow device isn't cut off forever
+ * @param enable 0 to always use timeout of device profile, estimators are reset in both cases
+**/
+void zen_set_adaptive_timeouts(int enable);
+
+/**
+ * @brief
+ * Installs progress callback of read_sector*()/read_bank*()/read_firmware*()
+ * @param cb called after every chunk (readSectors of device profile), NULL to disable
+ * @param ctx passed to cb
+**/
+void zen_set_progress(zen_progress_cb cb, void* ctx);
+
+/**
+ * @brief
+ * Installs cancellation token. Sector reads check it between chunks and fail when it's
+ * non-zero, so device is left after complete command and can be closed with deinit_zen().
+ * Token may be set from signal handler
+ * @param token token, NULL to disable
+**/
+void zen_set_cancel(volatile sig_atomic_t* token);
+
+/**
+ * @brief
+ * Tells if last failure was caused by cancellation token
+ * @return 1 if read was cancelled
+**/
+int zen_cancelled(void);
+
+/**
+ * @brief
+ * Polls TEST UNIT READY until device is ready, waiting ZEN_READY_POLL_MIN..ZEN_READY_POLL_MAX
+ * ms between polls, doubling every time
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param maxMs give up after that many ms
+ * @return ZEN_SUCC if device is ready
+**/
+int zen_wait_ready(usb_dev_handle* hdev, int maxMs);
+
+/**
+ * @brief
+ * Monotonic clock used for latencies, round-trip times and deadlines, not affected by wall clock changes
+ * @return time in microseconds since unspecified start
+**/
+u64 zen_time_us(void);
+
 /** Internal, debug. */
 void hexdump(u8* buff, int len);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
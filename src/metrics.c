@@ -0,0 +1,178 @@
+/*
+ * Name        : metrics.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : OpenMetrics exporter for libzen
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+
+#ifndef WIN32
+# include <unistd.h>
+#endif
+
+void metrics_init(struct sZenMetrics* m, int vid, int pid) {
+    memset(m, 0, sizeof(struct sZenMetrics));
+    m->vid = vid;
+    m->pid = pid;
+    m->volLimit = ZEN_ERROR;
+}
+
+int metrics_poll(usb_dev_handle* hdev, struct sZenMetrics* m) {
+    int limit;
+
+    m->up = 0;
+    if(hdev == NULL) {
+        /* device is gone, static values may belong to other device next time */
+        m->haveStatic = 0;
+        m->haveBatt = 0;
+        m->volLimit = ZEN_ERROR;
+        return ZEN_ERROR;
+    }
+
+    if(!m->haveStatic) {
+        if((m->chipId = read_chip_id(hdev)) == ZEN_ERROR)
+            return ZEN_ERROR;
+        if((m->protoVer = read_protocol_ver(hdev)) == ZEN_ERROR)
+            return ZEN_ERROR;
+        if((m->capacity = read_capacity(hdev)) == ZEN_ERROR)
+            return ZEN_ERROR;
+        m->haveStatic = 1;
+    }
+
+    if(read_batt_info(hdev, &m->batt) != ZEN_SUCC) {
+        m->haveBatt = 0;
+        return ZEN_ERROR;
+    }
+    m->haveBatt = 1;
+
+    if((limit = read_vol_limit(hdev)) == ZEN_ERROR)
+        return ZEN_ERROR;
+    m->volLimit = limit;
+
+    m->up = 1;
+    m->polls++;
+
+    return ZEN_SUCC;
+}
+
+static void write_header(FILE* f, const char* name, const char* type, const char* unit, const char* help) {
+    fprintf(f, "# TYPE %s %s\n", name, type);
+    if(unit)
+        fprintf(f, "# UNIT %s %s\n", name, unit);
+    fprintf(f, "# HELP %s %s\n", name, help);
+}
+
+/** Formats bound given in us as canonical seconds, always with fraction: 1.0, 0.25, 0.00025. */
+static void format_bound(char* out, size_t size, u32 us) {
+    int len;
+
+    len = snprintf(out, size, "%u.%.6u", us / 1000000, us % 1000000);
+    /* trailing zeros go, one digit after the dot stays */
+    while(len > 2 && (size_t)len < size && out[len - 1] == '0' && out[len - 2] != '.')
+        out[--len] = '\0';
+}
+
+int metrics_write(const char* path, const struct sZenMetrics* m) {
+    static const u32    bounds[ZEN_LAT_BUCKETS] = ZEN_LAT_BOUNDS;
+    struct sZenStats    st;
+    char                tmp[1024];
+    char                labels[64];
+    char                le[16];
+    FILE*               f;
+    u64                 cumulative;
+    int                 i;
+
+    if(strlen(path) + 5 > sizeof(tmp)) {
+        zen_log("Metrics path too long\n");
+        return ZEN_ERROR;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    snprintf(labels, sizeof(labels), "vid=\"0x%.4X\",pid=\"0x%.4X\"", m->vid, m->pid);
+
+    f = fopen(tmp, "w");
+    if(f == NULL) {
+        zen_log("Creating %s failed, check privileges\n", tmp);
+        return ZEN_ERROR;
+    }
+
+    write_header(f, "zen_up", "gauge", NULL, "1 if the device answered during last poll");
+    fprintf(f, "zen_up{%s} %d\n", labels, m->up);
+
+    if(m->haveStatic) {
+        write_header(f, "zen_device", "info", NULL, "Chip id and protocol version");
+        fprintf(f, "zen_device_info{%s,chip_id=\"0x%.4X\",protocol=\"0x%.4X\"} 1\n", labels, m->chipId, m->protoVer);
+        write_header(f, "zen_capacity_bytes", "gauge", "bytes", "Flash disk capacity");
+        fprintf(f, "zen_capacity_bytes{%s} %llu\n", labels, (u64)m->capacity << 20);
+    }
+
+    if(m->haveBatt) {
+        write_header(f, "zen_battery_level_percent", "gauge", "percent", "Battery level");
+        fprintf(f, "zen_battery_level_percent{%s} %u\n", labels, m->batt.level);
+        write_header(f, "zen_battery_charge_state", "stateset", NULL, "Battery charge state");
+        fprintf(f, "zen_battery_charge_state{%s,zen_battery_charge_state=\"charging\"} %d\n", labels, m->batt.full == ZEN_BATT_NOT_FULL);
+        fprintf(f, "zen_battery_charge_state{%s,zen_battery_charge_state=\"full\"} %d\n", labels, m->batt.full == ZEN_BATT_FULL);
+        fprintf(f, "zen_battery_charge_state{%s,zen_battery_charge_state=\"unknown\"} %d\n", labels, 
+            m->batt.full != ZEN_BATT_NOT_FULL && m->batt.full != ZEN_BATT_FULL);
+    }
+
+    if(m->volLimit != ZEN_ERROR) {
+        write_header(f, "zen_volume_limit_percent", "gauge", "percent", "Volume level limit");
+        fprintf(f, "zen_volume_limit_percent{%s} %d\n", labels, m->volLimit);
+    }
+
+    zen_get_stats(&st);
+
+    write_header(f, "zen_transport_commands", "counter", NULL, "Commands sent to the device");
+    fprintf(f, "zen_transport_commands_total{%s} %llu\n", labels, st.commands);
+    write_header(f, "zen_transport_errors", "counter", NULL, "Commands which failed");
+    fprintf(f, "zen_transport_errors_total{%s} %llu\n", labels, st.errors);
+    write_header(f, "zen_transport_bytes", "counter", "bytes", "Bytes transferred in data phases");
+    fprintf(f, "zen_transport_bytes_total{%s,direction=\"in\"} %llu\n", labels, st.bytesIn);
+    fprintf(f, "zen_transport_bytes_total{%s,direction=\"out\"} %llu\n", labels, st.bytesOut);
+
+    write_header(f, "zen_transport_latency_seconds", "histogram", "seconds", "Command round trip time");
+    cumulative = 0;
+    for(i=0; i<ZEN_LAT_BUCKETS; i++) {
+        cumulative += st.latency[i];
+        format_bound(le, sizeof(le), bounds[i]);
+        fprintf(f, "zen_transport_latency_seconds_bucket{%s,le=\"%s\"} %llu\n", labels, le, cumulative);
+    }
+    cumulative += st.latency[ZEN_LAT_BUCKETS];
+    fprintf(f, "zen_transport_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n", labels, cumulative);
+    fprintf(f, "zen_transport_latency_seconds_count{%s} %llu\n", labels, cumulative);
+    fprintf(f, "zen_transport_latency_seconds_sum{%s} %g\n", labels, st.latencySum / 1e6);
+
+    fputs("# EOF\n", f);
+
+    /* file has to be on disk before rename replaces the old one */
+    if(fflush(f) != 0 || ferror(f)
+#ifndef WIN32
+        || fsync(fileno(f)) != 0
+#endif
+        ) {
+        zen_log("Writing %s failed\n", tmp);
+        fclose(f);
+        remove(tmp);
+        return ZEN_ERROR;
+    }
+    if(fclose(f) != 0) {
+        zen_log("Writing %s failed\n", tmp);
+        remove(tmp);
+        return ZEN_ERROR;
+    }
+
+#ifdef WIN32
+    remove(path); /* rename doesn't overwrite on windows */
+#endif
+    if(rename(tmp, path) != 0) {
+        zen_log("Renaming %s to %s failed\n", tmp, path);
+        remove(tmp);
+        return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
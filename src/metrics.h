@@ -0,0 +1,64 @@
+/*
+ * Name        : metrics.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : OpenMetrics exporter for libzen
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "libzen.h"
+
+/** Last known device state, static fields are read only once per session. */
+struct sZenMetrics {
+    int     vid;
+    int     pid;
+    /** 1 if device answered during last poll. */
+    int     up;
+    /** 1 if chip id, protocol version and capacity were already read. */
+    int     haveStatic;
+    int     chipId;
+    int     protoVer;
+    /** Capacity in megabytes. */
+    int     capacity;
+    /** 1 if batt contains valid data. */
+    int     haveBatt;
+    struct sBattResp batt;
+    /** Volume limit in %, ZEN_ERROR if unknown. */
+    int     volLimit;
+    /** Number of successful polls. */
+    u64     polls;
+};
+
+/**
+ * @brief
+ * Clears metrics state, must be called before first metrics_poll()
+ * @param m pointer to metrics state
+ * @param vid vendor id used as a label
+ * @param pid product id used as a label
+**/
+void metrics_init(struct sZenMetrics* m, int vid, int pid);
+
+/**
+ * @brief
+ * Updates metrics, static values are queried only when they are not known yet,
+ * so a regular poll costs 2 commands (battery and volume limit)
+ * @param hdev pointer to ZenStone created with initZen(), NULL if device is gone
+ * @param m pointer to metrics state
+ * @return ZEN_SUCC if all queries succeeded
+**/
+int metrics_poll(usb_dev_handle* hdev, struct sZenMetrics* m);
+
+/**
+ * @brief
+ * Writes metrics in OpenMetrics text format, file is replaced atomically
+ * (written to path.tmp and then renamed)
+ * @param path destination file
+ * @param m pointer to metrics state
+ * @return ZEN_SUCC if file was written
+**/
+int metrics_write(const char* path, const struct sZenMetrics* m);
+
+#endif
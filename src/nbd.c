@@ -0,0 +1,600 @@
+/*
+ * Name        : nbd.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Read-only NBD server exposing memory banks of Zen Stone on Unix socket
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libzen.h"
+#include "simdev.h"
+
+#define CACHE_DEFAULT_MB    16
+
+/* Fixed newstyle handshake of NBD protocol, all numbers are big endian */
+#define NBD_MAGIC           0x4E42444D41474943ULL /* "NBDMAGIC" */
+#define NBD_OPT_MAGIC       0x49484156454F5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC       0x0003E889045565A9ULL
+#define NBD_REQUEST_MAGIC   0x25609513
+#define NBD_REPLY_MAGIC     0x67446698
+
+/* Handshake flags */
+#define NBD_FLAG_FIXED_NEWSTYLE 0x0001
+#define NBD_FLAG_NO_ZEROES      0x0002
+/* Transmission flags */
+#define NBD_FLAG_HAS_FLAGS      0x0001
+#define NBD_FLAG_READ_ONLY      0x0002
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_LIST        3
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+
+#define NBD_REP_ACK         1
+#define NBD_REP_SERVER      2
+#define NBD_REP_INFO        3
+#define NBD_REP_ERR_UNSUP   0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+
+#define NBD_INFO_EXPORT     0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_CMD_READ        0
+#define NBD_CMD_WRITE       1
+#define NBD_CMD_DISC        2
+
+/* Errors of replies, values are fixed by protocol */
+#define NBD_EPERM           1
+#define NBD_EIO             5
+#define NBD_ENOMEM          12
+#define NBD_EINVAL          22
+
+/* Longest option accepted, export names are short */
+#define NBD_OPT_MAX         1024
+/* Requests already waiting in socket are served together, at most that many */
+#define NBD_BATCH           32
+/* Largest read request and largest merged device read */
+#define NBD_REQ_MAX         (32 << 20)
+#define NBD_MERGE_MAX       (8 << 20)
+
+struct sExport {
+    char    name[24];
+    u8      bankNo;
+    u32     sectorSize;
+    u64     size;
+};
+
+struct sNbdRequest {
+    u16     type;
+    u64     handle;
+    u64     offset;
+    u32     len;
+    /** NBD error of reply, 0 if request succeded. */
+    u32     error;
+    /** Offset of read data in batch buffer. */
+    size_t  pos;
+};
+
+static usb_dev_handle*          hdev;
+static struct sExport           exports[10];
+static int                      exportsCount;
+static volatile sig_atomic_t    stop;
+/* Requests served and device reads they took after merging */
+static u64                      requests;
+static u64                      reads;
+
+static void onStop(int sig) {
+    stop = 1;
+}
+
+static void put16(u8* p, u16 v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put32(u8* p, u32 v) {
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xFFFF);
+}
+
+static void put64(u8* p, u64 v) {
+    put32(p, (u32)(v >> 32));
+    put32(p + 4, (u32)v);
+}
+
+static u16 get16(const u8* p) {
+    return (u16)((p[0] << 8) | p[1]);
+}
+
+static u32 get32(const u8* p) {
+    return ((u32)get16(p) << 16) | get16(p + 2);
+}
+
+static u64 get64(const u8* p) {
+    return ((u64)get32(p) << 32) | get32(p + 4);
+}
+
+static int read_full(int fd, void* buff, size_t len) {
+    ssize_t res;
+
+    while(len > 0) {
+        res = recv(fd, buff, len, 0);
+        if(res < 0 && errno == EINTR && !stop)
+            continue;
+        if(res <= 0)
+            return ZEN_ERROR;
+        buff = (u8*)buff + res;
+        len -= res;
+    }
+
+    return ZEN_SUCC;
+}
+
+static int write_full(int fd, const void* buff, size_t len) {
+    ssize_t res;
+
+    while(len > 0) {
+        res = send(fd, buff, len, MSG_NOSIGNAL);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            return ZEN_ERROR;
+        buff = (const u8*)buff + res;
+        len -= res;
+    }
+
+    return ZEN_SUCC;
+}
+
+static int load_exports(void) {
+    struct sAllocTable  table;
+    struct sBankSize    bankSize;
+    const char*         name;
+    int                 i, j;
+
+    if(read_alloc_table(hdev, &table) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    for(i=0; i<table.rowsCount; i++) {
+        struct sExport* e = &exports[exportsCount];
+
+        if(read_bank_size(hdev, table.row[i].bankNo, &bankSize) == ZEN_ERROR)
+            return ZEN_ERROR;
+        if(bankSize.sectorsCount == 0)
+            continue;
+        if(bankSize.sectorSize == 0 || ZEN_CACHE_CHUNK % bankSize.sectorSize != 0) {
+            zen_log("Bank %u has unsupported sector size %u, skipping\n", table.row[i].bankNo, bankSize.sectorSize);
+            continue;
+        }
+
+        if((name = bank_tag_name(table.row[i].tag)) != NULL)
+            snprintf(e->name, sizeof(e->name), "%s", name);
+        else
+            snprintf(e->name, sizeof(e->name), "bank%u.bin", table.row[i].bankNo);
+        /* resource.bin is stored in two banks */
+        for(j=0; j<exportsCount; j++)
+            if(strcmp(exports[j].name, e->name) == 0)
+                snprintf(e->name, sizeof(e->name), "bank%u.bin", table.row[i].bankNo);
+
+        e->bankNo = table.row[i].bankNo;
+        e->sectorSize = bankSize.sectorSize;
+        e->size = (u64)bankSize.sectorsCount * bankSize.sectorSize;
+        exportsCount++;
+    }
+
+    return ZEN_SUCC;
+}
+
+/** Finds export by name or bank number, empty name is the default export. */
+static struct sExport* find_export(const char* name, struct sExport* def) {
+    char*   end;
+    long    bankNo;
+    int     i;
+
+    if(name[0] == '\0')
+        return def;
+
+    bankNo = strtol(name, &end, 10);
+    for(i=0; i<exportsCount; i++)
+        if(strcmp(name, exports[i].name) == 0 || (*end == '\0' && bankNo == exports[i].bankNo))
+            return &exports[i];
+
+    return NULL;
+}
+
+static int send_reply(int fd, u32 option, u32 type, const u8* data, u32 len) {
+    u8 hdr[20];
+
+    put64(hdr, NBD_REP_MAGIC);
+    put32(hdr + 8, option);
+    put32(hdr + 12, type);
+    put32(hdr + 16, len);
+
+    if(write_full(fd, hdr, sizeof(hdr)) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    return len ? write_full(fd, data, len) : ZEN_SUCC;
+}
+
+/** Sends size, flags and block sizes of export, reply of NBD_OPT_INFO and NBD_OPT_GO. */
+static int send_info(int fd, u32 option, const struct sExport* e) {
+    u8 info[14];
+
+    put16(info, NBD_INFO_EXPORT);
+    put64(info + 2, e->size);
+    put16(info + 10, NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY);
+    if(send_reply(fd, option, NBD_REP_INFO, info, 12) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    /* reads of whole cache chunks are cheapest */
+    put16(info, NBD_INFO_BLOCK_SIZE);
+    put32(info + 2, 1);
+    put32(info + 6, ZEN_CACHE_CHUNK);
+    put32(info + 10, NBD_REQ_MAX);
+    if(send_reply(fd, option, NBD_REP_INFO, info, 14) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    return send_reply(fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+/** Handshake and option haggling, returns export client chose, NULL if it gave up. */
+static struct sExport* negotiate(int fd, struct sExport* def) {
+    struct sExport* e;
+    u8              buff[NBD_OPT_MAX + 1], zeroes[124];
+    u32             option, len, nameLen, clientFlags;
+    int             i;
+
+    put64(buff, NBD_MAGIC);
+    put64(buff + 8, NBD_OPT_MAGIC);
+    put16(buff + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if(write_full(fd, buff, 18) != ZEN_SUCC || read_full(fd, buff, 4) != ZEN_SUCC)
+        return NULL;
+    clientFlags = get32(buff);
+
+    for(;;) {
+        if(read_full(fd, buff, 16) != ZEN_SUCC || get64(buff) != NBD_OPT_MAGIC)
+            return NULL;
+        option = get32(buff + 8);
+        len = get32(buff + 12);
+        if(len > NBD_OPT_MAX || read_full(fd, buff, len) != ZEN_SUCC)
+            return NULL;
+        buff[len] = '\0';
+
+        switch(option) {
+            case NBD_OPT_EXPORT_NAME:
+                /* old way, errors can't be reported */
+                if((e = find_export((char*)buff, def)) == NULL)
+                    return NULL;
+                put64(buff, e->size);
+                put16(buff + 8, NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY);
+                memset(zeroes, 0, sizeof(zeroes));
+                if(write_full(fd, buff, 10) != ZEN_SUCC
+                    || (!(clientFlags & NBD_FLAG_NO_ZEROES) && write_full(fd, zeroes, sizeof(zeroes)) != ZEN_SUCC))
+                    return NULL;
+                return e;
+            case NBD_OPT_ABORT:
+                send_reply(fd, option, NBD_REP_ACK, NULL, 0);
+                return NULL;
+            case NBD_OPT_LIST:
+                for(i=0; i<exportsCount; i++) {
+                    nameLen = (u32)strlen(exports[i].name);
+                    put32(buff, nameLen);
+                    memcpy(buff + 4, exports[i].name, nameLen);
+                    if(send_reply(fd, option, NBD_REP_SERVER, buff, 4 + nameLen) != ZEN_SUCC)
+                        return NULL;
+                }
+                if(send_reply(fd, option, NBD_REP_ACK, NULL, 0) != ZEN_SUCC)
+                    return NULL;
+                break;
+            case NBD_OPT_INFO:
+            case NBD_OPT_GO:
+                /* name length, name, number of info requests and requests, all infos are sent anyway */
+                if(len < 6 || (nameLen = get32(buff)) > len - 6) {
+                    if(send_reply(fd, option, NBD_REP_ERR_INVALID, NULL, 0) != ZEN_SUCC)
+                        return NULL;
+                    break;
+                }
+                memmove(buff, buff + 4, nameLen);
+                buff[nameLen] = '\0';
+                if((e = find_export((char*)buff, def)) == NULL) {
+                    if(send_reply(fd, option, NBD_REP_ERR_UNKNOWN, NULL, 0) != ZEN_SUCC)
+                        return NULL;
+                    break;
+                }
+                if(send_info(fd, option, e) != ZEN_SUCC)
+                    return NULL;
+                if(option == NBD_OPT_GO)
+                    return e;
+                break;
+            default:
+                if(send_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0) != ZEN_SUCC)
+                    return NULL;
+        }
+    }
+}
+
+/** Reads request header, payload of writes is read and thrown away. */
+static int read_request(int fd, const struct sExport* e, struct sNbdRequest* req) {
+    u8  hdr[28], junk[4096];
+    u32 left, n;
+
+    if(read_full(fd, hdr, sizeof(hdr)) != ZEN_SUCC || get32(hdr) != NBD_REQUEST_MAGIC)
+        return ZEN_ERROR;
+
+    req->type = get16(hdr + 6);
+    req->handle = get64(hdr + 8);
+    req->offset = get64(hdr + 16);
+    req->len = get32(hdr + 24);
+    req->error = 0;
+
+    if(req->type == NBD_CMD_WRITE) {
+        req->error = NBD_EPERM;
+        for(left=req->len; left>0; left-=n) {
+            n = left < sizeof(junk) ? left : sizeof(junk);
+            if(read_full(fd, junk, n) != ZEN_SUCC)
+                return ZEN_ERROR;
+        }
+    } else if(req->type == NBD_CMD_READ) {
+        if(req->len > NBD_REQ_MAX || req->offset > e->size || req->len > e->size - req->offset)
+            req->error = NBD_EINVAL;
+    } else if(req->type != NBD_CMD_DISC)
+        req->error = NBD_EINVAL;
+
+    return ZEN_SUCC;
+}
+
+/**
+ * Serves reads of batch with as few device reads as possible, requests are sorted by offset
+ * and overlapping or adjacent ones are read at once, sector cache adds readahead.
+ */
+static void read_batch(const struct sExport* e, struct sNbdRequest* reqs, int count, u8** buff, size_t* buffSize) {
+    struct sNbdRequest* r;
+    int                 order[NBD_BATCH];
+    int                 i, j, k, n;
+    s64                 res;
+    size_t              total, pos;
+    u64                 start, end;
+    u8*                 p;
+
+    for(i=0, n=0, total=0; i<count; i++) {
+        if(reqs[i].type != NBD_CMD_READ || reqs[i].error)
+            continue;
+        /* insertion sort, batch is small */
+        for(j=n; j>0 && reqs[order[j - 1]].offset > reqs[i].offset; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        n++;
+        total += reqs[i].len;
+    }
+
+    /* merged reads never take more than requests themselves */
+    if(total > *buffSize) {
+        if((p = (u8*)realloc(*buff, total)) == NULL) {
+            for(i=0; i<n; i++)
+                reqs[order[i]].error = NBD_ENOMEM;
+            return;
+        }
+        *buff = p;
+        *buffSize = total;
+    }
+
+    for(i=0, pos=0; i<n; i=j) {
+        start = reqs[order[i]].offset;
+        end = start + reqs[order[i]].len;
+        for(j=i+1; j<n; j++) {
+            r = &reqs[order[j]];
+            if(r->offset > end || (r->offset + r->len > end && r->offset + r->len - start > NBD_MERGE_MAX))
+                break;
+            if(r->offset + r->len > end)
+                end = r->offset + r->len;
+        }
+
+        res = end > start ? zen_read_bank_range(hdev, e->bankNo, start, (u32)(end - start), *buff + pos) : 0;
+        reads++;
+        for(k=i; k<j; k++) {
+            r = &reqs[order[k]];
+            if(res != (s64)(end - start))
+                r->error = NBD_EIO;
+            r->pos = pos + (size_t)(r->offset - start);
+        }
+        pos += (size_t)(end - start);
+    }
+}
+
+/** Transmission phase, requests already waiting in socket are read and served together. */
+static void serve(int fd, const struct sExport* e) {
+    struct sNbdRequest  reqs[NBD_BATCH];
+    struct pollfd       pfd;
+    u8                  hdr[16];
+    u8*                 buff = NULL;
+    size_t              buffSize = 0;
+    int                 count, disc, i;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for(disc=0; !disc && !stop;) {
+        count = 0;
+        do {
+            if(read_request(fd, e, &reqs[count]) != ZEN_SUCC)
+                goto cleanup;
+            if(reqs[count].type == NBD_CMD_DISC) {
+                disc = 1;
+                break;
+            }
+            count++;
+        } while(count < NBD_BATCH && poll(&pfd, 1, 0) > 0);
+
+        read_batch(e, reqs, count, &buff, &buffSize);
+        requests += count;
+
+        for(i=0; i<count; i++) {
+            put32(hdr, NBD_REPLY_MAGIC);
+            put32(hdr + 4, reqs[i].error);
+            put64(hdr + 8, reqs[i].handle);
+            if(write_full(fd, hdr, sizeof(hdr)) != ZEN_SUCC)
+                goto cleanup;
+            if(reqs[i].type == NBD_CMD_READ && reqs[i].error == 0 && write_full(fd, buff + reqs[i].pos, reqs[i].len) != ZEN_SUCC)
+                goto cleanup;
+        }
+    }
+
+cleanup:
+    free(buff);
+}
+
+static int listen_unix(const char* path) {
+    struct sockaddr_un  addr;
+    struct stat         st;
+    int                 fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        zen_log("Socket path %s is too long\n", path);
+        return ZEN_ERROR;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* socket left by previous run, anything else there isn't ours to remove */
+    if(lstat(path, &st) == 0) {
+        if(!S_ISSOCK(st.st_mode)) {
+            zen_log("%s exists and is not a socket\n", path);
+            return ZEN_ERROR;
+        }
+        if(unlink(path) != 0) {
+            zen_log("Removing old socket %s failed: %s\n", path, strerror(errno));
+            return ZEN_ERROR;
+        }
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        zen_log("Listening on %s failed: %s\n", path, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return ZEN_ERROR;
+    }
+
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    struct sZenCacheStats   st;
+    struct sExport*         def = NULL;
+    struct sExport*         e;
+    struct sigaction        sa;
+    const char*             path = NULL;
+    int                     argpos, vid, pid, simulate, cacheMb, bank, fd, cfd, i;
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    simulate = 0;
+    cacheMb = CACHE_DEFAULT_MB;
+    bank = 0;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-cache") == 0 && argpos + 1 < argc)
+            cacheMb = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-bank") == 0 && argpos + 1 < argc)
+            bank = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            simulate = 1;
+        else if(argv[argpos][0] != '-' && path == NULL)
+            path = argv[argpos];
+        else
+            break;
+    }
+
+    if(path == NULL || argpos < argc) {
+        printf("Usage: %s <options> socket\n", argv[0]);
+        puts("Serves memory banks read-only over NBD on Unix socket, e.g.");
+        printf("  %s -bank 6 /tmp/zen.sock & nbd-client -unix /tmp/zen.sock /dev/nbd0 -N \"\"\n", argv[0]);
+        puts("Export \"\" is the bank chosen with -bank, others are named like files of -r or by bank number.");
+        puts("Option:");
+        puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
+        puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        puts("-bank 6 => default export is bank 6 (default 0, data)");
+        printf("-cache 16 => uses 16MB for sector cache (default %d)\n", CACHE_DEFAULT_MB);
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+        return ZEN_ERROR;
+    }
+
+    if(zen_cache_enable((u32)cacheMb << 20) != ZEN_SUCC) {
+        puts("Not enough memory for cache");
+        return ZEN_ERROR;
+    }
+
+    hdev = simulate ? sim_open() : init_zen(vid, pid);
+    if(!hdev) {
+        puts("Zen Stone not found or error occured.");
+        return ZEN_ERROR;
+    }
+
+    if(device_ready(hdev) != ZEN_SUCC || load_exports() != ZEN_SUCC) {
+        puts("Device detected, but reading allocation table failed, try running the program again.");
+        deinit_zen(hdev);
+        return ZEN_ERROR;
+    }
+
+    for(i=0; i<exportsCount; i++)
+        if(exports[i].bankNo == bank)
+            def = &exports[i];
+    if(def == NULL) {
+        printf("Bank %d can't be served\n", bank);
+        deinit_zen(hdev);
+        return ZEN_ERROR;
+    }
+
+    if((fd = listen_unix(path)) == ZEN_ERROR) {
+        deinit_zen(hdev);
+        return ZEN_ERROR;
+    }
+
+    /* no SA_RESTART, accept() and recv() have to return on Ctrl+C */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Serving %s (bank %u, %lluB) on %s\n", def->name, def->bankNo, def->size, path);
+    fflush(stdout);
+
+    /* libzen is not thread safe, one client at a time */
+    while(!stop) {
+        if((cfd = accept(fd, NULL, NULL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            zen_log("accept: %s\n", strerror(errno));
+            break;
+        }
+
+        requests = reads = 0;
+        if((e = negotiate(cfd, def)) != NULL) {
+            serve(cfd, e);
+            zen_cache_stats(&st);
+            zen_log("%s: %llu requests in %llu reads, cache: %llu hits, %llu misses, %llu device reads, %llu chunks read ahead\n",
+                e->name, requests, reads, st.hits, st.misses, st.fetches, st.readahead);
+        }
+        close(cfd);
+    }
+
+    close(fd);
+    unlink(path);
+    deinit_zen(hdev);
+
+    return ZEN_SUCC;
+}
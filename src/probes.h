@@ -0,0 +1,57 @@
+/*
+ * Name        : probes.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : USDT static tracepoints of libzen
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Probes of provider "libzen", with systemtap <sys/sdt.h> (package systemtap-sdt-dev)
+ * every probe is a single nop in the code and a note in the binary, e.g.
+ *   bpftrace -e 'usdt:./zen_console:libzen:cbw_submit { @t[arg0] = nsecs; }
+ *       usdt:./zen_console:libzen:csw_done /@t[arg0]/ { @us[arg1] = hist((nsecs - @t[arg0]) / 1000); delete(@t[arg0]); }'
+ * Arguments are values already at hand, probes don't read clocks or call functions.
+ * Without the header, or with -DZEN_NO_PROBES, probes compile to nothing.
+ *
+ *   cbw_submit(tag, opcode, subcommand, length, direction)
+ *   data_done(tag, opcode, bytes, result)
+ *   csw_done(tag, opcode, bytes, residue, status)   latency is csw_done - cbw_submit of the tag
+ *   transfer_error(tag, opcode, phase, result)      phase 0 CBW, 1 data, 2 CSW, 3 CSW check
+ *   csw_retry(tag, opcode, result)                  CSW read again after its stall was cleared
+ *   reset_recovery(reset result, halts cleared)     Bulk-Only reset and clearing both endpoints
+ *   ready_retry(attempt, delay ms)
+ *   bank_start(bank, sector size, first sector, sectors)
+ *   bank_end(bank, bytes, result)
+ */
+
+#if defined(__has_include) && !defined(ZEN_NO_PROBES)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define ZEN_PROBES 1
+# endif
+#endif
+
+#ifdef ZEN_PROBES
+# define ZEN_PROBE2(name, a, b)             DTRACE_PROBE2(libzen, name, a, b)
+# define ZEN_PROBE3(name, a, b, c)          DTRACE_PROBE3(libzen, name, a, b, c)
+# define ZEN_PROBE4(name, a, b, c, d)       DTRACE_PROBE4(libzen, name, a, b, c, d)
+# define ZEN_PROBE5(name, a, b, c, d, e)    DTRACE_PROBE5(libzen, name, a, b, c, d, e)
+#else
+/* arguments stay referenced (and dead) so variables kept for probes don't warn */
+# define ZEN_PROBE2(name, a, b)             do { if(0) { (void)(a); (void)(b); } } while(0)
+# define ZEN_PROBE3(name, a, b, c)          do { if(0) { (void)(a); (void)(b); (void)(c); } } while(0)
+# define ZEN_PROBE4(name, a, b, c, d)       do { if(0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while(0)
+# define ZEN_PROBE5(name, a, b, c, d, e)    do { if(0) { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } } while(0)
+#endif
+
+/* Transfer phases of transfer_error */
+#define ZEN_PHASE_CBW       0
+#define ZEN_PHASE_DATA      1
+#define ZEN_PHASE_CSW       2
+#define ZEN_PHASE_CHECK     3
+
+#endif
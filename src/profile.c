@@ -0,0 +1,207 @@
+/*
+ * Name        : profile.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Tuning and quirks of player models selected by ids and chip id
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libzen.h"
+
+/* Order doesn't matter, zen_profile_find() scores all of them, generic one has to be last */
+static const struct sZenProfile builtin[] = {
+    /* tested */
+    { "Zen Stone", ZEN_VENDOR, ZEN_PRODUCT, ZEN_CHIP_ID, ZEN_READ_MAX_SECTORS, ZEN_TIMEOUT, ZEN_TIMEOUT_MIN,
+        ZEN_ENDP_IN, ZEN_ENDP_OUT, ZEN_QUIRK_SECTORS_24BIT, { 0 }, 0 },
+    /* other Sigmatel players don't know Creative commands, reads are kept small until somebody tests them */
+    { "Sigmatel", 0x066F, 0, ZEN_ERROR, 8, 5000, 500, ZEN_ENDP_IN, ZEN_ENDP_OUT, ZEN_QUIRK_SECTORS_24BIT,
+        { ZEN_BAD_CMD(CMD_SCSI_SIGMATEL_READ, CMD_ZEN_BATT_LEVEL),
+          ZEN_BAD_CMD(CMD_SCSI_SIGMATEL_READ, CMD_ZEN_VOL_LIMIT_READ),
+          ZEN_BAD_CMD(CMD_SCSI_SIGMATEL_WRITE, CMD_ZEN_VOL_LIMIT_WRITE) }, 3 },
+    /* anything else given with -vid/-pid, settings used before profiles existed */
+    { "generic", 0, 0, ZEN_ERROR, ZEN_READ_MAX_SECTORS, ZEN_TIMEOUT, ZEN_TIMEOUT_MIN,
+        ZEN_ENDP_IN, ZEN_ENDP_OUT, ZEN_QUIRK_SECTORS_24BIT, { 0 }, 0 }
+};
+
+#define BUILTIN_COUNT   (int)(sizeof(builtin) / sizeof(builtin[0]))
+#define GENERIC         (&builtin[BUILTIN_COUNT - 1])
+
+static struct sZenProfile   loaded[ZEN_PROFILES_MAX];
+static int                  loadedCount;
+
+/** Exact ids and chip id score, any scores 0, mismatch disqualifies. */
+static int score(const struct sZenProfile* p, int vid, int pid, int chipId) {
+    int s = 0;
+
+    if(p->vid) {
+        if(p->vid != vid)
+            return ZEN_ERROR;
+        s += 4;
+    }
+    if(p->pid) {
+        if(p->pid != pid)
+            return ZEN_ERROR;
+        s += 2;
+    }
+    if(p->chipId != ZEN_ERROR) {
+        if(p->chipId != chipId)
+            return ZEN_ERROR;
+        s += 1;
+    }
+
+    return s;
+}
+
+const struct sZenProfile* zen_profile_find(int vid, int pid, int chipId) {
+    const struct sZenProfile*   best = GENERIC;
+    int                         bestScore = ZEN_ERROR, s, i;
+
+    /* any matching loaded profile overrides built-in ones */
+    for(i=0; i<loadedCount + BUILTIN_COUNT; i++) {
+        const struct sZenProfile* p = i < loadedCount ? &loaded[i] : &builtin[i - loadedCount];
+
+        if((s = score(p, vid, pid, chipId)) != ZEN_ERROR && i < loadedCount)
+            s += 8;
+        if(s > bestScore) {
+            best = p;
+            bestScore = s;
+        }
+    }
+
+    return best;
+}
+
+/** Parses hexadecimal value or "any", returns ZEN_ERROR if broken. */
+static int parse_id(const char* val, int any, int* out) {
+    char* end;
+
+    if(strcmp(val, "any") == 0) {
+        *out = any;
+        return ZEN_SUCC;
+    }
+
+    *out = (int)strtol(val, &end, 16);
+    return *end == '\0' && end != val ? ZEN_SUCC : ZEN_ERROR;
+}
+
+/** Parses one "key=value" of profile line. */
+static int parse_field(struct sZenProfile* p, char* field) {
+    char*   val;
+    char*   end;
+    int     v;
+
+    if((val = strchr(field, '=')) == NULL)
+        return ZEN_ERROR;
+    *val++ = '\0';
+
+    if(strcmp(field, "vid") == 0 || strcmp(field, "pid") == 0) {
+        if(parse_id(val, 0, &v) != ZEN_SUCC || v < 0 || v > 0xFFFF)
+            return ZEN_ERROR;
+        if(field[0] == 'v')
+            p->vid = (u16)v;
+        else
+            p->pid = (u16)v;
+    } else if(strcmp(field, "chip") == 0) {
+        if(parse_id(val, ZEN_ERROR, &p->chipId) != ZEN_SUCC)
+            return ZEN_ERROR;
+    } else if(strcmp(field, "sectors") == 0) {
+        v = (int)strtol(val, &end, 10);
+        if(*end != '\0' || v <= 0 || v > ZEN_READ_MAX_SECTORS)
+            return ZEN_ERROR;
+        p->readSectors = (u32)v;
+    } else if(strcmp(field, "timeout") == 0 || strcmp(field, "timeout_min") == 0) {
+        v = (int)strtol(val, &end, 10);
+        if(*end != '\0' || v <= 0)
+            return ZEN_ERROR;
+        if(field[7] == '\0')
+            p->timeout = v;
+        else
+            p->timeoutMin = v;
+    } else if(strcmp(field, "in") == 0 || strcmp(field, "out") == 0) {
+        if(parse_id(val, 0, &v) != ZEN_SUCC || v <= 0 || v > 0xFF)
+            return ZEN_ERROR;
+        if(field[0] == 'i')
+            p->endpIn = (u8)v;
+        else
+            p->endpOut = (u8)v;
+    } else if(strcmp(field, "quirks") == 0) {
+        p->quirks = 0;
+        for(val=strtok(val, ","); val; val=strtok(NULL, ",")) {
+            if(strcmp(val, "24bit") == 0)
+                p->quirks |= ZEN_QUIRK_SECTORS_24BIT;
+            else if(strcmp(val, "none") != 0)
+                return ZEN_ERROR;
+        }
+    } else if(strcmp(field, "bad") == 0) {
+        p->badCount = 0;
+        for(val=strtok(val, ","); val; val=strtok(NULL, ",")) {
+            if(p->badCount == ZEN_PROFILE_BAD_MAX || parse_id(val, ZEN_ERROR, &v) != ZEN_SUCC || v < 0 || v > 0xFFFF)
+                return ZEN_ERROR;
+            p->bad[p->badCount++] = (u16)v;
+        }
+    } else
+        return ZEN_ERROR;
+
+    return ZEN_SUCC;
+}
+
+int zen_profile_load(const char* path) {
+    struct sZenProfile  p;
+    FILE*               f;
+    char                line[512];
+    char*               colon;
+    char*               field;
+    char*               next;
+    int                 lineNo = 0;
+
+    if((f = fopen(path, "r")) == NULL) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    loadedCount = 0;
+    while(fgets(line, sizeof(line), f)) {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '#' || line[strspn(line, " \t")] == '\0')
+            continue;
+
+        if((colon = strchr(line, ':')) == NULL || colon == line || loadedCount == ZEN_PROFILES_MAX)
+            goto broken;
+
+        p = *GENERIC;
+        *colon = '\0';
+        snprintf(p.name, sizeof(p.name), "%.31s", line);
+
+        /* fields are split by hand, parse_field() uses strtok for lists */
+        for(field=colon + 1; *field; field=next) {
+            field += strspn(field, " \t");
+            if(*field == '\0')
+                break;
+            next = field + strcspn(field, " \t");
+            if(*next)
+                *next++ = '\0';
+            if(parse_field(&p, field) != ZEN_SUCC)
+                goto broken;
+        }
+
+        if(p.timeoutMin > p.timeout)
+            goto broken;
+        loaded[loadedCount++] = p;
+    }
+
+    fclose(f);
+    /* profiles of open devices may point to overwritten ones */
+    zen_profile_reselect();
+    return loadedCount;
+
+broken:
+    zen_log("Profile %s is broken at line %d\n", path, lineNo);
+    fclose(f);
+    loadedCount = 0;
+    zen_profile_reselect();
+    return ZEN_ERROR;
+}
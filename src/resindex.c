@@ -0,0 +1,317 @@
+/*
+ * Name        : resindex.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : On-disk index of resource.bin for lazy extraction of single resources
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "resindex.h"
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+#define RES_COUNT_SIZE  4
+
+void res_table_init(struct sResTable* table) {
+    memset(table, 0, sizeof(struct sResTable));
+}
+
+static u32 get_le(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+int res_table_feed(struct sResTable* table, const u8* data, size_t len) {
+    u32 need, n, i;
+
+    while(len > 0 && !table->done) {
+        need = table->pos == 0 ? RES_COUNT_SIZE : sizeof(struct sResEntry);
+        n = need - table->have;
+        if(n > len)
+            n = (u32)len;
+
+        memcpy(table->buff + table->have, data, n);
+        table->have += n;
+        data += n;
+        len -= n;
+        if(table->have < need)
+            break;
+        table->have = 0;
+
+        if(table->pos == 0) {
+            table->count = get_le(table->buff);
+            table->pos = RES_COUNT_SIZE;
+            if(table->count == 0 || table->count > RES_MAX_ENTRIES) {
+                zen_log("Resource table has %u entries, not a resource.bin?\n", table->count);
+                table->done = 1;
+            } else if((table->entries = (struct sResEntry*)malloc(table->count * sizeof(struct sResEntry))) == NULL)
+                table->done = 1;
+            continue;
+        }
+
+        i = (u32)((table->pos - RES_COUNT_SIZE) / sizeof(struct sResEntry));
+        table->entries[i].offset = get_le(table->buff);
+        table->entries[i].size = get_le(table->buff + 4);
+        table->pos += sizeof(struct sResEntry);
+        if(i + 1 == table->count)
+            table->done = 1;
+    }
+
+    return !table->done;
+}
+
+int res_table_finish(struct sResTable* table, u64 sourceSize) {
+    u64 tableEnd = RES_COUNT_SIZE + (u64)table->count * sizeof(struct sResEntry);
+    u32 i;
+
+    if(table->entries == NULL || table->pos != tableEnd) {
+        zen_log("Resource table is incomplete\n");
+        return ZEN_ERROR;
+    }
+
+    for(i=0; i<table->count; i++) {
+        if(table->entries[i].offset < tableEnd
+            || (u64)table->entries[i].offset + table->entries[i].size > sourceSize) {
+            zen_log("Resource %u (offset %u, size %u) lies outside of file\n", i,
+                table->entries[i].offset, table->entries[i].size);
+            return ZEN_ERROR;
+        }
+    }
+
+    return ZEN_SUCC;
+}
+
+void res_table_free(struct sResTable* table) {
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/** Maps whole file read-only, on windows it's simply read to memory. */
+static int map_file(const char* path, void** data, size_t* size) {
+#ifndef WIN32
+    struct stat st;
+    int         fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return ZEN_ERROR;
+
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return ZEN_ERROR;
+    }
+
+    *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(*data == MAP_FAILED) {
+        *data = NULL;
+        return ZEN_ERROR;
+    }
+    *size = st.st_size;
+#else
+    struct stat st;
+    FILE*       f;
+
+    if(stat(path, &st) < 0 || st.st_size == 0 || (f = fopen(path, "rb")) == NULL)
+        return ZEN_ERROR;
+
+    if((*data = malloc(st.st_size)) == NULL) {
+        fclose(f);
+        return ZEN_ERROR;
+    }
+
+    if(fread(*data, 1, st.st_size, f) != (size_t)st.st_size) {
+        fclose(f);
+        free(*data);
+        *data = NULL;
+        return ZEN_ERROR;
+    }
+    fclose(f);
+    *size = st.st_size;
+#endif
+
+    return ZEN_SUCC;
+}
+
+static void unmap_file(void* data, size_t size) {
+    if(data == NULL)
+        return;
+#ifndef WIN32
+    munmap(data, size);
+#else
+    free(data);
+#endif
+}
+
+static void idx_path(const char* binPath, const char* idxPath, char* out, size_t len) {
+    if(idxPath)
+        snprintf(out, len, "%s", idxPath);
+    else
+        snprintf(out, len, "%s.idx", binPath);
+}
+
+int res_index_write(const struct sResTable* table, const char* binPath, const char* idxPath) {
+    struct sResIdxHeader    header;
+    struct stat             st;
+    char                    path[1024], tmp[1040];
+    FILE*                   f;
+
+    if(stat(binPath, &st) < 0) {
+        zen_log("Opening %s failed\n", binPath);
+        return ZEN_ERROR;
+    }
+
+    memset(&header, 0, sizeof(struct sResIdxHeader));
+    memcpy(header.magic, RES_IDX_MAGIC, sizeof(header.magic));
+    header.version = RES_IDX_VERSION;
+    header.sourceSize = st.st_size;
+    header.sourceMtime = st.st_mtime;
+    header.count = table->count;
+
+    idx_path(binPath, idxPath, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if((f = fopen(tmp, "wb")) == NULL) {
+        zen_log("Creating %s failed, check privileges\n", tmp);
+        return ZEN_ERROR;
+    }
+
+    if(fwrite(&header, sizeof(struct sResIdxHeader), 1, f) != 1
+        || fwrite(table->entries, sizeof(struct sResEntry), table->count, f) != table->count
+        || fflush(f) != 0) {
+        zen_log("Writing %s failed\n", tmp);
+        fclose(f);
+        remove(tmp);
+        return ZEN_ERROR;
+    }
+#ifndef WIN32
+    fsync(fileno(f));
+#endif
+    fclose(f);
+
+#ifdef WIN32
+    remove(path); /* rename doesn't overwrite on windows */
+#endif
+    if(rename(tmp, path) != 0) {
+        zen_log("Renaming %s to %s failed\n", tmp, path);
+        remove(tmp);
+        return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
+
+int res_index_build(const char* binPath, const char* idxPath) {
+    struct sResTable    table;
+    void*               map;
+    size_t              size;
+    int                 res;
+
+    if(map_file(binPath, &map, &size) != ZEN_SUCC) {
+        zen_log("Opening %s failed\n", binPath);
+        return ZEN_ERROR;
+    }
+
+    /* only pages holding the table are touched */
+    res_table_init(&table);
+    res_table_feed(&table, (const u8*)map, size);
+    unmap_file(map, size);
+
+    res = res_table_finish(&table, size);
+    if(res == ZEN_SUCC)
+        res = res_index_write(&table, binPath, idxPath);
+    res_table_free(&table);
+
+    return res;
+}
+
+/** Checks that mapped index belongs to current resource.bin and all its resources lie inside of it. */
+static int index_valid(const struct sResIndex* idx, const struct stat* st) {
+    const struct sResIdxHeader* header = (const struct sResIdxHeader*)idx->idxMap;
+    const struct sResEntry*     entries = (const struct sResEntry*)(header + 1);
+    u64                         tableEnd;
+    u32                         i;
+
+    /* index written on host with other byte order has swapped version */
+    if(idx->idxSize < sizeof(struct sResIdxHeader)
+        || memcmp(header->magic, RES_IDX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != RES_IDX_VERSION
+        || header->sourceSize != (u64)st->st_size
+        || header->sourceMtime != (u64)st->st_mtime
+        || idx->idxSize != sizeof(struct sResIdxHeader) + (u64)header->count * sizeof(struct sResEntry))
+        return 0;
+
+    /* same checks as res_table_finish(), index may be damaged or written by hand */
+    tableEnd = RES_COUNT_SIZE + (u64)header->count * sizeof(struct sResEntry);
+    for(i=0; i<header->count; i++)
+        if(entries[i].offset < tableEnd || (u64)entries[i].offset + entries[i].size > header->sourceSize)
+            return 0;
+
+    return 1;
+}
+
+int res_index_open(struct sResIndex* idx, const char* binPath, const char* idxPath) {
+    struct stat st;
+    char        path[1024];
+
+    memset(idx, 0, sizeof(struct sResIndex));
+    snprintf(idx->binPath, sizeof(idx->binPath), "%s", binPath);
+    idx_path(binPath, idxPath, path, sizeof(path));
+
+    if(stat(binPath, &st) < 0) {
+        zen_log("Opening %s failed\n", binPath);
+        return ZEN_ERROR;
+    }
+
+    if(map_file(path, &idx->idxMap, &idx->idxSize) != ZEN_SUCC || !index_valid(idx, &st)) {
+        unmap_file(idx->idxMap, idx->idxSize);
+        idx->idxMap = NULL;
+
+        if(res_index_build(binPath, idxPath) != ZEN_SUCC)
+            return ZEN_ERROR;
+        if(map_file(path, &idx->idxMap, &idx->idxSize) != ZEN_SUCC || !index_valid(idx, &st)) {
+            zen_log("Index %s is broken\n", path);
+            res_index_close(idx);
+            return ZEN_ERROR;
+        }
+    }
+
+    idx->header = (const struct sResIdxHeader*)idx->idxMap;
+    idx->entries = (const struct sResEntry*)(idx->header + 1);
+
+    return ZEN_SUCC;
+}
+
+const u8* res_index_get(struct sResIndex* idx, u32 id, u32* size) {
+    if(idx->header == NULL || id >= idx->header->count)
+        return NULL;
+
+    if(idx->binMap == NULL) {
+        if(map_file(idx->binPath, &idx->binMap, &idx->binSize) != ZEN_SUCC)
+            return NULL;
+        /* file was replaced after index was opened */
+        if(idx->binSize != idx->header->sourceSize) {
+            unmap_file(idx->binMap, idx->binSize);
+            idx->binMap = NULL;
+            return NULL;
+        }
+    }
+
+    if((u64)idx->entries[id].offset + idx->entries[id].size > idx->binSize)
+        return NULL;
+
+    *size = idx->entries[id].size;
+    return (const u8*)idx->binMap + idx->entries[id].offset;
+}
+
+void res_index_close(struct sResIndex* idx) {
+    unmap_file(idx->idxMap, idx->idxSize);
+    unmap_file(idx->binMap, idx->binSize);
+    memset(idx, 0, sizeof(struct sResIndex));
+}
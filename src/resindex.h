@@ -0,0 +1,150 @@
+/*
+ * Name        : resindex.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : On-disk index of resource.bin for lazy extraction of single resources
+ */
+
+#ifndef RESINDEX_H
+#define RESINDEX_H
+
+#include "libzen.h"
+
+/*
+ * resource.bin starts with the resource table: u32 count followed by count
+ * entries of u32 offset and u32 size, little endian, offsets from start of
+ * file. Resource id is the position in the table. Only res_table_feed()
+ * knows this layout.
+ *
+ * Index file (resource.bin.idx by default) is sResIdxHeader followed by the
+ * table in host byte order, it's rebuilt whenever it doesn't match the
+ * resource.bin it was made from.
+ */
+
+#define RES_MAX_ENTRIES     65536
+#define RES_IDX_MAGIC       "ZRIX"
+#define RES_IDX_VERSION     1
+
+#pragma pack(push, 1)
+
+struct sResEntry {
+    u32 offset;
+    u32 size;
+};
+
+struct sResIdxHeader {
+    char    magic[4];
+    u32     version;
+    /** Size and modification time of indexed resource.bin. */
+    u64     sourceSize;
+    u64     sourceMtime;
+    u32     count;
+    u32     pad;
+};
+
+#pragma pack(pop)
+
+/** Resource table collected from resource.bin, data can come in chunks. */
+struct sResTable {
+    u32                 count;
+    struct sResEntry*   entries;
+
+    /* parser state, internal */
+    u64                 pos;
+    u32                 have;
+    u8                  buff[8];
+    int                 done;
+};
+
+/** Opened index, resource.bin is mapped on first res_index_get(). */
+struct sResIndex {
+    const struct sResIdxHeader* header;
+    const struct sResEntry*     entries;
+    void*                       idxMap;
+    size_t                      idxSize;
+    char                        binPath[1024];
+    void*                       binMap;
+    size_t                      binSize;
+};
+
+/**
+ * @brief
+ * Prepares table for res_table_feed()
+ * @param table table
+**/
+void res_table_init(struct sResTable* table);
+
+/**
+ * @brief
+ * Parses next part of resource.bin, only the table is copied
+ * @param table table
+ * @param data next bytes of file
+ * @param len number of bytes
+ * @return 1 if more data is needed, 0 if table is complete or invalid
+**/
+int res_table_feed(struct sResTable* table, const u8* data, size_t len);
+
+/**
+ * @brief
+ * Checks that table is complete and every resource lies within the file
+ * @param table table
+ * @param sourceSize size of whole resource.bin
+ * @return ZEN_SUCC if table is valid
+**/
+int res_table_finish(struct sResTable* table, u64 sourceSize);
+
+/**
+ * @brief
+ * Frees table entries
+ * @param table table
+**/
+void res_table_free(struct sResTable* table);
+
+/**
+ * @brief
+ * Writes index file for table made from binPath
+ * @param table valid table
+ * @param binPath indexed resource.bin
+ * @param idxPath index file name, NULL for binPath.idx
+ * @return ZEN_SUCC if index was written
+**/
+int res_index_write(const struct sResTable* table, const char* binPath, const char* idxPath);
+
+/**
+ * @brief
+ * Walks resource table of binPath once and writes index file
+ * @param binPath dumped resource.bin
+ * @param idxPath index file name, NULL for binPath.idx
+ * @return ZEN_SUCC if index was written
+**/
+int res_index_build(const char* binPath, const char* idxPath);
+
+/**
+ * @brief
+ * Opens index of binPath, builds it if it's missing or stale
+ * @param idx index
+ * @param binPath dumped resource.bin
+ * @param idxPath index file name, NULL for binPath.idx
+ * @return ZEN_SUCC if index is ready
+**/
+int res_index_open(struct sResIndex* idx, const char* binPath, const char* idxPath);
+
+/**
+ * @brief
+ * Returns resource content, only its pages of resource.bin are read
+ * @param idx index opened with res_index_open()
+ * @param id resource id
+ * @param size resource size
+ * @return pointer valid until res_index_close(), NULL if id is unknown or mapping failed
+**/
+const u8* res_index_get(struct sResIndex* idx, u32 id, u32* size);
+
+/**
+ * @brief
+ * Unmaps index and resource.bin
+ * @param idx index
+**/
+void res_index_close(struct sResIndex* idx);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Name        : resinfo.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Indexes resource.bin and extracts single resources
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libzen.h"
+#include "simdev.h"
+#include "resindex.h"
+
+#define MAX_EXTRACT 64
+
+/** Dumps bank to binPath, resource table is indexed while data is streamed. */
+static int dump_bank(usb_dev_handle* hdev, u8 bank, const char* binPath, const char* idxPath) {
+    struct sResTable    table;
+    struct sBankSize    size;
+    u8*                 buff;
+    u32                 sector, count;
+    FILE*               f;
+    int                 res;
+
+    if(read_bank_size(hdev, bank, &size) == ZEN_ERROR || size.sectorSize == 0)
+        return ZEN_ERROR;
+
+    if((f = fopen(binPath, "wb")) == NULL) {
+        zen_log("Creating %s failed, check privileges\n", binPath);
+        return ZEN_ERROR;
+    }
+
+    if((buff = (u8*)malloc(size.sectorSize * ZEN_READ_MAX_SECTORS)) == NULL) {
+        fclose(f);
+        return ZEN_ERROR;
+    }
+
+    res_table_init(&table);
+    res = ZEN_SUCC;
+    for(sector=0; sector<size.sectorsCount; sector+=count) {
+        count = size.sectorsCount - sector;
+        if(count > ZEN_READ_MAX_SECTORS)
+            count = ZEN_READ_MAX_SECTORS;
+
+        if(read_sector_buf(hdev, buff, bank, size.sectorSize, sector, count) != ZEN_SUCC
+            || fwrite(buff, size.sectorSize, count, f) != count) {
+            res = ZEN_ERROR;
+            break;
+        }
+        res_table_feed(&table, buff, (size_t)count * size.sectorSize);
+    }
+    free(buff);
+    if(fclose(f) != 0)
+        res = ZEN_ERROR;
+
+    if(res == ZEN_SUCC)
+        res = res_table_finish(&table, (u64)size.sectorsCount * size.sectorSize);
+    if(res == ZEN_SUCC)
+        res = res_index_write(&table, binPath, idxPath);
+    res_table_free(&table);
+
+    return res;
+}
+
+static int extract(struct sResIndex* idx, u32 id, const char* path) {
+    const u8*   data;
+    u32         size;
+    FILE*       f;
+
+    if((data = res_index_get(idx, id, &size)) == NULL) {
+        printf("Resource %u not found\n", id);
+        return ZEN_ERROR;
+    }
+
+    if((f = fopen(path, "wb")) == NULL) {
+        printf("Creating %s failed, check privileges\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(fwrite(data, 1, size, f) != size) {
+        printf("Writing %s failed\n", path);
+        fclose(f);
+        return ZEN_ERROR;
+    }
+    fclose(f);
+
+    printf("Resource %u (%u bytes) saved to %s\n", id, size, path);
+    return ZEN_SUCC;
+}
+
+int main(int argc, char* argv[]) {
+    struct sResIndex    idx;
+    usb_dev_handle*     hdev;
+    const char*         binPath;
+    const char*         idxPath;
+    const char*         extractPath[MAX_EXTRACT];
+    u32                 extractId[MAX_EXTRACT], i;
+    int                 argpos, vid, pid, bank, simulate, list, extractCount, res;
+
+    if(argc <= 1) {
+        printf("Usage: %s <options> resource.bin\n", argv[0]);
+        puts("Option:");
+        puts("-l => lists resources");
+        puts("-x 12 file => saves resource 12 to file, can be repeated");
+        puts("-idx file => index file name (default resource.bin.idx)");
+        puts("-bank 7 => dumps bank 7 from device to resource.bin first");
+        puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
+        puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+        return ZEN_ERROR;
+    }
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    bank = -1;
+    simulate = 0;
+    list = 0;
+    extractCount = 0;
+    binPath = NULL;
+    idxPath = NULL;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-l") == 0)
+            list = 1;
+        else if(strcmp(argv[argpos], "-x") == 0 && argpos + 2 < argc && extractCount < MAX_EXTRACT) {
+            extractId[extractCount] = (u32)strtoul(argv[++argpos], NULL, 0);
+            extractPath[extractCount++] = argv[++argpos];
+        } else if(strcmp(argv[argpos], "-idx") == 0 && argpos + 1 < argc)
+            idxPath = argv[++argpos];
+        else if(strcmp(argv[argpos], "-bank") == 0 && argpos + 1 < argc)
+            bank = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            simulate = 1;
+        else
+            binPath = argv[argpos];
+    }
+
+    if(binPath == NULL) {
+        puts("No resource.bin given");
+        return ZEN_ERROR;
+    }
+
+    if(bank >= 0) {
+        hdev = simulate ? sim_open() : init_zen(vid, pid);
+        if(!hdev) {
+            puts("Zen Stone not found or error occured.");
+            return ZEN_ERROR;
+        }
+
+        res = device_ready(hdev) == ZEN_SUCC ? dump_bank(hdev, (u8)bank, binPath, idxPath) : ZEN_ERROR;
+        deinit_zen(hdev);
+        if(res != ZEN_SUCC) {
+            printf("Dumping bank %d failed\n", bank);
+            return ZEN_ERROR;
+        }
+    }
+
+    if(res_index_open(&idx, binPath, idxPath) != ZEN_SUCC) {
+        printf("Indexing %s failed\n", binPath);
+        return ZEN_ERROR;
+    }
+
+    printf("%s: %u resources\n", binPath, idx.header->count);
+    if(list)
+        for(i=0; i<idx.header->count; i++)
+            printf("%u\toffset=%u\tsize=%u\n", i, idx.entries[i].offset, idx.entries[i].size);
+
+    res = ZEN_SUCC;
+    for(i=0; i<(u32)extractCount; i++)
+        if(extract(&idx, extractId[i], extractPath[i]) != ZEN_SUCC)
+            res = ZEN_ERROR;
+
+    res_index_close(&idx);
+    return res;
+}
@@ -0,0 +1,273 @@
+/*
+ * Name        : sbimage.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Streaming parser and section index for dumped .sb images
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sbimage.h"
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+/* Parser states */
+#define SB_ST_PREFIX    0
+#define SB_ST_HEADER    1
+#define SB_ST_COMMAND   2
+#define SB_ST_DONE      3
+
+#define SB_PREFIX_END   0x1A
+#define SB_SIG_OFFSET   20 /* offset of signature in SB1 header */
+
+void sb_index_init(struct sSbIndex* idx) {
+    memset(idx, 0, sizeof(struct sSbIndex));
+    idx->signatureOffset = ZEN_ERROR;
+    idx->state = SB_ST_PREFIX;
+}
+
+/** Copies version following the label, up to end of line. */
+static void parse_version(const char* prefix, const char* label, char* out) {
+    const char* p = strstr(prefix, label);
+    int         i;
+
+    if(p == NULL)
+        return;
+
+    p += strlen(label);
+    for(i=0; i<SB_VERSION_LEN-1 && p[i] && p[i] != '\r' && p[i] != '\n'; i++)
+        out[i] = p[i];
+    out[i] = '\0';
+}
+
+static void add_command(struct sSbIndex* idx, u32 cmd, u32 addr) {
+    struct sSbSection* sec;
+    u32                type = SB_CMD_TYPE(cmd);
+
+    if(idx->commandsCount == SB_MAX_COMMANDS) {
+        idx->truncated = 1;
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    idx->commands[idx->commandsCount].offset = (u32)idx->pos - sizeof(struct sSbCmdHeader);
+    idx->commands[idx->commandsCount].cmd = cmd;
+    idx->commands[idx->commandsCount].addr = addr;
+    idx->commandsCount++;
+
+    if(type != SB_CMD_LOAD && type != SB_CMD_FILL)
+        return;
+
+    /* merge commands writing contiguous memory */
+    sec = idx->sectionsCount ? &idx->sections[idx->sectionsCount - 1] : NULL;
+    if(sec && sec->firstCommand + sec->commandsCount == idx->commandsCount - 1 && sec->addr + sec->size == addr) {
+        sec->size += SB_CMD_BYTES(cmd);
+        sec->commandsCount++;
+        return;
+    }
+
+    if(idx->sectionsCount == SB_MAX_SECTIONS) {
+        idx->truncated = 1;
+        return;
+    }
+
+    sec = &idx->sections[idx->sectionsCount++];
+    sec->addr = addr;
+    sec->size = SB_CMD_BYTES(cmd);
+    sec->firstCommand = idx->commandsCount - 1;
+    sec->commandsCount = 1;
+}
+
+/** Called when buff contains full header. */
+static void parse_header(struct sSbIndex* idx) {
+    if(memcmp(idx->buff, "STMP", 4) == 0) {
+        /* unknown layout, only signature is indexed */
+        idx->signatureOffset = idx->imageOffset;
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    if(memcmp(idx->buff + SB_SIG_OFFSET, "STMP", 4) != 0) {
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    memcpy(&idx->header, idx->buff, sizeof(struct sSbHeader));
+    idx->signatureOffset = idx->imageOffset + SB_SIG_OFFSET;
+    idx->sb1 = 1;
+
+    if(idx->header.headerSize < sizeof(struct sSbHeader)) {
+        idx->truncated = 1;
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    idx->skip = idx->header.headerSize - sizeof(struct sSbHeader);
+    idx->state = SB_ST_COMMAND;
+}
+
+/** Called when buff contains command header. */
+static void parse_command(struct sSbIndex* idx) {
+    struct sSbCmdHeader hdr;
+    u32                 type;
+
+    memcpy(&hdr, idx->buff, sizeof(struct sSbCmdHeader));
+    type = SB_CMD_TYPE(hdr.cmd);
+
+    /* padding after last command */
+    if(hdr.cmd == 0 || hdr.cmd == 0xFFFFFFFF || type < SB_CMD_LOAD || type > SB_CMD_SDRAM) {
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    if(SB_CMD_WORDS(hdr.cmd) * 4 < sizeof(struct sSbCmdHeader)) {
+        idx->truncated = 1;
+        idx->state = SB_ST_DONE;
+        return;
+    }
+
+    add_command(idx, hdr.cmd, hdr.addr);
+    idx->skip = SB_CMD_WORDS(hdr.cmd) * 4 - sizeof(struct sSbCmdHeader);
+}
+
+/** Moves from prefix to header state, bytes collected after prefix belong to the image. */
+static void end_prefix(struct sSbIndex* idx, int prefixLen) {
+    u8  rest[SB_PREFIX_MAX];
+    u32 restLen;
+
+    if(prefixLen > 0) {
+        idx->buff[prefixLen - 1] = '\0';
+        parse_version((char*)idx->buff, "Product Version: ", idx->productVer);
+        parse_version((char*)idx->buff, "Component Version: ", idx->componentVer);
+    }
+
+    restLen = idx->have - prefixLen;
+    memcpy(rest, idx->buff + prefixLen, restLen);
+
+    idx->imageOffset = prefixLen;
+    idx->state = SB_ST_HEADER;
+    idx->have = 0;
+    idx->pos -= restLen;
+
+    sb_index_feed(idx, rest, restLen);
+}
+
+int sb_index_feed(struct sSbIndex* idx, const u8* data, size_t len) {
+    u32 need, n;
+
+    while(len > 0 && idx->state != SB_ST_DONE) {
+        if(idx->skip > 0) {
+            /* payload is skipped without touching it */
+            n = idx->skip < len ? (u32)idx->skip : (u32)len;
+            idx->skip -= n;
+            idx->pos += n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        if(idx->state == SB_ST_PREFIX) {
+            u8* end;
+
+            n = SB_PREFIX_MAX - idx->have < len ? SB_PREFIX_MAX - idx->have : (u32)len;
+            memcpy(idx->buff + idx->have, data, n);
+            end = (u8*)memchr(idx->buff + idx->have, SB_PREFIX_END, n);
+            idx->have += n;
+            idx->pos += n;
+            data += n;
+            len -= n;
+
+            if(end)
+                end_prefix(idx, (int)(end - idx->buff) + 1);
+            else if(idx->have == SB_PREFIX_MAX || (idx->have >= 7 && memcmp(idx->buff, "Product", 7) != 0))
+                end_prefix(idx, 0);
+            continue;
+        }
+
+        need = idx->state == SB_ST_HEADER ? sizeof(struct sSbHeader) : sizeof(struct sSbCmdHeader);
+        n = need - idx->have < len ? need - idx->have : (u32)len;
+        memcpy(idx->buff + idx->have, data, n);
+        idx->have += n;
+        idx->pos += n;
+        data += n;
+        len -= n;
+
+        if(idx->have < need)
+            continue;
+        idx->have = 0;
+
+        if(idx->state == SB_ST_HEADER)
+            parse_header(idx);
+        else
+            parse_command(idx);
+
+        if(idx->sb1 && idx->header.imageSize >= idx->header.headerSize 
+            && idx->pos + idx->skip >= (u64)idx->imageOffset + idx->header.imageSize)
+            idx->state = SB_ST_DONE;
+    }
+
+    return idx->state != SB_ST_DONE;
+}
+
+int sb_index_finish(struct sSbIndex* idx) {
+    if(idx->state == SB_ST_PREFIX)
+        end_prefix(idx, 0);
+
+    if(idx->state != SB_ST_DONE && (idx->state != SB_ST_COMMAND || idx->skip > 0 || idx->have > 0))
+        idx->truncated = 1;
+    idx->state = SB_ST_DONE;
+
+    return idx->productVer[0] || idx->signatureOffset != ZEN_ERROR ? ZEN_SUCC : ZEN_ERROR;
+}
+
+int sb_index_file(const char* path, struct sSbIndex* idx) {
+#ifndef WIN32
+    struct stat st;
+    void*       map;
+    int         fd;
+
+    sb_index_init(idx);
+
+    if((fd = open(path, O_RDONLY)) < 0) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return sb_index_finish(idx);
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        zen_log("Mapping %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    sb_index_feed(idx, (const u8*)map, st.st_size);
+    munmap(map, st.st_size);
+#else
+    u8      buff[4096];
+    size_t  n;
+    FILE*   f;
+
+    sb_index_init(idx);
+
+    if((f = fopen(path, "rb")) == NULL) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    while((n = fread(buff, 1, sizeof(buff), f)) > 0 && sb_index_feed(idx, buff, n));
+    fclose(f);
+#endif
+
+    return sb_index_finish(idx);
+}
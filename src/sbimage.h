@@ -0,0 +1,153 @@
+/*
+ * Name        : sbimage.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Streaming parser and section index for dumped .sb images
+ */
+
+#ifndef SBIMAGE_H
+#define SBIMAGE_H
+
+#include "libzen.h"
+
+/*
+ * Dumped .sb file is an ASCII prefix (see read_firmware()) terminated with 0x1A
+ * followed by the boot image. Images with "STMP" signature 20 bytes into the
+ * image use SB1 layout: fixed header, then a stream of boot commands, each one
+ * an 8-byte header and optional payload. For other layouts only the prefix and
+ * signature offset are indexed.
+ */
+
+#define SB_PREFIX_MAX       128
+#define SB_VERSION_LEN      16
+#define SB_MAX_COMMANDS     512
+#define SB_MAX_SECTIONS     64
+
+/* Boot command types */
+#define SB_CMD_LOAD         0x1
+#define SB_CMD_FILL         0x2
+#define SB_CMD_JUMP         0x3
+#define SB_CMD_CALL         0x4
+#define SB_CMD_MODE         0x5
+#define SB_CMD_SDRAM        0x6
+
+#pragma pack(push, 1)
+
+/** Version as stored in image, every field is BCD. */
+struct sSbVersion {
+    u16 major;
+    u16 pad0;
+    u16 minor;
+    u16 pad1;
+    u16 revision;
+    u16 pad2;
+};
+
+/** SB1 image header. */
+struct sSbHeader {
+    u32 romVersion;
+    u32 imageSize;
+    u32 headerSize;
+    u32 userdataOffset;
+    u32 pad;
+    u8  signature[4]; /* "STMP" */
+    struct sSbVersion productVer;
+    struct sSbVersion componentVer;
+    u32 driveTag;
+};
+
+/** SB1 boot command header. */
+struct sSbCmdHeader {
+    /** 31:21 size in words with header, 20 critical, 19:6 payload bytes, 5:4 data type, 3:0 command. */
+    u32 cmd;
+    u32 addr;
+};
+
+#pragma pack(pop)
+
+#define SB_CMD_WORDS(cmd)       ((cmd) >> 21)
+#define SB_CMD_CRITICAL(cmd)    (((cmd) >> 20) & 1)
+#define SB_CMD_BYTES(cmd)       (((cmd) >> 6) & 0x3FFF)
+#define SB_CMD_DATATYPE(cmd)    (((cmd) >> 4) & 0x3)
+#define SB_CMD_TYPE(cmd)        ((cmd) & 0xF)
+
+/** Indexed boot command. */
+struct sSbCommand {
+    /** Offset of command header in file. */
+    u32 offset;
+    u32 cmd;
+    u32 addr;
+};
+
+/** Run of LOAD/FILL commands writing contiguous memory. */
+struct sSbSection {
+    u32 addr;
+    u32 size;
+    u32 firstCommand;
+    u32 commandsCount;
+};
+
+/** Index of one image, fixed size so thousands of them don't need allocations. */
+struct sSbIndex {
+    /** From ASCII prefix, "" if missing. */
+    char                productVer[SB_VERSION_LEN];
+    char                componentVer[SB_VERSION_LEN];
+    /** Offset of image in file (after prefix). */
+    u32                 imageOffset;
+    /** Offset of "STMP" signature in file, ZEN_ERROR if not found. */
+    int                 signatureOffset;
+    /** 1 if header has SB1 layout and commands were walked. */
+    int                 sb1;
+    struct sSbHeader    header;
+    u32                 commandsCount;
+    struct sSbCommand   commands[SB_MAX_COMMANDS];
+    u32                 sectionsCount;
+    struct sSbSection   sections[SB_MAX_SECTIONS];
+    /** 1 if index is incomplete (file truncated, too many commands...). */
+    int                 truncated;
+
+    /* parser state, internal */
+    int                 state;
+    u64                 pos;
+    u64                 skip;
+    u32                 have;
+    u8                  buff[SB_PREFIX_MAX];
+};
+
+/**
+ * @brief
+ * Prepares index for sb_index_feed()
+ * @param idx index
+**/
+void sb_index_init(struct sSbIndex* idx);
+
+/**
+ * @brief
+ * Parses next part of image, data can come in chunks of any size (e.g. straight from device),
+ * only headers are copied
+ * @param idx index
+ * @param data next bytes of file
+ * @param len number of bytes
+ * @return 1 if more data is needed, 0 if index is complete
+**/
+int sb_index_feed(struct sSbIndex* idx, const u8* data, size_t len);
+
+/**
+ * @brief
+ * Finishes parsing, marks index as truncated if image ended too early
+ * @param idx index
+ * @return ZEN_SUCC if prefix or signature was found
+**/
+int sb_index_finish(struct sSbIndex* idx);
+
+/**
+ * @brief
+ * Indexes dumped .sb file, file is memory mapped so only touched pages are read
+ * @param path file name
+ * @param idx index
+ * @return ZEN_SUCC if prefix or signature was found
+**/
+int sb_index_file(const char* path, struct sSbIndex* idx);
+
+#endif
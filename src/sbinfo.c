@@ -0,0 +1,167 @@
+/*
+ * Name        : sbinfo.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Prints index of dumped .sb images or of system bank read from device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libzen.h"
+#include "simdev.h"
+#include "sbimage.h"
+
+static const char* cmdNames[] = {"?", "load", "fill", "jump", "call", "mode", "sdram"};
+
+static const char* layout_name(const struct sSbIndex* idx) {
+    if(idx->sb1)
+        return "sb1";
+    if(idx->signatureOffset != ZEN_ERROR)
+        return "unknown";
+    return "none";
+}
+
+/** One line per image, easy to grep and diff between firmware versions. */
+static void print_index(const char* name, const struct sSbIndex* idx, int verbose) {
+    u32 i;
+
+    printf("%s product=%s component=%s layout=%s", name,
+        idx->productVer[0] ? idx->productVer : "-", idx->componentVer[0] ? idx->componentVer : "-", layout_name(idx));
+    if(idx->sb1)
+        printf(" tag=0x%.2X size=%u commands=%u sections=%u", idx->header.driveTag,
+            idx->header.imageSize, idx->commandsCount, idx->sectionsCount);
+    printf("%s\n", idx->truncated ? " truncated" : "");
+
+    if(!verbose)
+        return;
+
+    for(i=0; i<idx->sectionsCount; i++)
+        printf("  section %u: addr=0x%.8X size=%u commands=%u..%u\n", i, idx->sections[i].addr,
+            idx->sections[i].size, idx->sections[i].firstCommand,
+            idx->sections[i].firstCommand + idx->sections[i].commandsCount - 1);
+
+    for(i=0; i<idx->commandsCount; i++) {
+        u32 cmd = idx->commands[i].cmd;
+        u32 type = SB_CMD_TYPE(cmd);
+
+        printf("  command %u: offset=%u %s addr=0x%.8X bytes=%u%s\n", i, idx->commands[i].offset,
+            type < sizeof(cmdNames) / sizeof(cmdNames[0]) ? cmdNames[type] : "?",
+            idx->commands[i].addr, SB_CMD_BYTES(cmd), SB_CMD_CRITICAL(cmd) ? " critical" : "");
+    }
+}
+
+/* First read takes prefix and header, next ones double while parser wants more */
+#define FIRST_SECTORS   2
+
+/** Streams bank to parser and stops as soon as the index is complete. */
+static int index_bank(usb_dev_handle* hdev, u8 bank, struct sSbIndex* idx) {
+    struct sBankSize    size;
+    u8*                 buff;
+    u64                 end;
+    u32                 sector, count, left;
+    int                 more;
+
+    if(read_bank_size(hdev, bank, &size) == ZEN_ERROR || size.sectorSize == 0)
+        return ZEN_ERROR;
+
+    if((buff = (u8*)malloc(size.sectorSize * ZEN_READ_MAX_SECTORS)) == NULL)
+        return ZEN_ERROR;
+
+    sb_index_init(idx);
+    more = 1;
+    for(sector=0, count=0; more && sector<size.sectorsCount; sector+=count) {
+        count = count == 0 ? FIRST_SECTORS : count * 2;
+        if(count > ZEN_READ_MAX_SECTORS)
+            count = ZEN_READ_MAX_SECTORS;
+
+        /* once header tells image size, nothing after the image is read */
+        left = size.sectorsCount - sector;
+        if(idx->sb1 && idx->header.imageSize >= idx->header.headerSize) {
+            end = ((u64)idx->imageOffset + idx->header.imageSize + size.sectorSize - 1) / size.sectorSize;
+            if(end > sector && end - sector < left)
+                left = (u32)(end - sector);
+        }
+        if(count > left)
+            count = left;
+
+        if(read_sector_buf(hdev, buff, bank, size.sectorSize, sector, count) != ZEN_SUCC) {
+            free(buff);
+            return ZEN_ERROR;
+        }
+        more = sb_index_feed(idx, buff, (size_t)count * size.sectorSize);
+    }
+    free(buff);
+
+    zen_log("Read %u of %u sectors\n", sector, size.sectorsCount);
+    return sb_index_finish(idx);
+}
+
+int main(int argc, char* argv[]) {
+    struct sSbIndex*    idx;
+    usb_dev_handle*     hdev;
+    char                name[32];
+    int                 argpos, vid, pid, bank, simulate, verbose, res;
+
+    if(argc <= 1) {
+        printf("Usage: %s <options> [file.sb ...]\n", argv[0]);
+        puts("Option:");
+        puts("-v => lists sections and boot commands");
+        puts("-bank 6 => indexes bank 6 read from device, reading only as much as needed");
+        puts("-vid 0x1234 => threats device with vendor id 0x1234 as Zen");
+        puts("-pid 0x1234 => threats device with product id 0x1234 as Zen");
+        puts("-sim => uses simulated Zen Stone instead of USB device");
+        return ZEN_ERROR;
+    }
+
+    /* index is big, keep it off the stack */
+    if((idx = (struct sSbIndex*)malloc(sizeof(struct sSbIndex))) == NULL)
+        return ZEN_ERROR;
+
+    vid = ZEN_VENDOR;
+    pid = ZEN_PRODUCT;
+    bank = -1;
+    simulate = 0;
+    verbose = 0;
+    res = ZEN_SUCC;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-v") == 0)
+            verbose = 1;
+        else if(strcmp(argv[argpos], "-bank") == 0 && argpos + 1 < argc)
+            bank = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-vid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &vid);
+        else if(strcmp(argv[argpos], "-pid") == 0 && argpos + 1 < argc)
+            sscanf(argv[++argpos], "%x", &pid);
+        else if(strcmp(argv[argpos], "-sim") == 0)
+            simulate = 1;
+        else if(sb_index_file(argv[argpos], idx) == ZEN_SUCC)
+            print_index(argv[argpos], idx, verbose);
+        else {
+            printf("%s not indexed\n", argv[argpos]);
+            res = ZEN_ERROR;
+        }
+    }
+
+    if(bank >= 0) {
+        hdev = simulate ? sim_open() : init_zen(vid, pid);
+        if(!hdev) {
+            puts("Zen Stone not found or error occured.");
+            free(idx);
+            return ZEN_ERROR;
+        }
+
+        snprintf(name, sizeof(name), "bank%d", bank);
+        if(device_ready(hdev) == ZEN_SUCC && index_bank(hdev, (u8)bank, idx) == ZEN_SUCC)
+            print_index(name, idx, verbose);
+        else {
+            printf("%s not indexed\n", name);
+            res = ZEN_ERROR;
+        }
+        deinit_zen(hdev);
+    }
+
+    free(idx);
+    return res;
+}
@@ -0,0 +1,271 @@
+/*
+ * Name        : sgopen.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Talks to Zen Stone through SG_IO of usb_storage, without detaching it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+#include "sgopen.h"
+
+#define SYSFS_SG        "/sys/class/scsi_generic"
+#define SG_DEV          "/dev/%s"
+
+/* SG_IO needs sg driver 3.x interface */
+#define SG_MIN_VERSION  30000
+#define SG_SENSE_LEN    32
+
+/*
+ * usb_storage does Bulk-Only Transport itself, it takes whole commands.
+ * The transport collects CBW, runs the command with SG_IO when data phase
+ * (or CSW of command without data) is requested, and answers CSW read
+ * with status made from SCSI status and residue of SG_IO.
+ */
+struct sSgState {
+    /** CBW written, command not run yet. */
+    int         pending;
+    /** Command was run, CSW waits to be read. */
+    int         status;
+    struct sCBW cbw;
+    struct sCSW csw;
+};
+
+/* Handle returned by init_zen_sg(), it isn't libusb handle and only libzen may get it */
+struct sSgDev {
+    int             fd;
+    struct sSgState st;
+};
+
+#define SG_DEV_OF(hdev) ((struct sSgDev*)(hdev))
+
+/** Reads hexadecimal sysfs attribute from dir, ZEN_ERROR if it isn't there. */
+static int read_hex_attr(const char* dir, const char* attr) {
+    char    path[PATH_MAX + 16];
+    FILE*   f;
+    int     val;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    if((f = fopen(path, "r")) == NULL)
+        return ZEN_ERROR;
+
+    if(fscanf(f, "%x", &val) != 1)
+        val = ZEN_ERROR;
+    fclose(f);
+
+    return val;
+}
+
+/** Checks if sg device sits under USB device with given ids. */
+static int match_sg(const char* name, int vid, int pid) {
+    char    link[128], dir[PATH_MAX];
+    char*   slash;
+
+    snprintf(link, sizeof(link), SYSFS_SG "/%s/device", name);
+    if(realpath(link, dir) == NULL)
+        return 0;
+
+    /* .../usb1/1-2/1-2:1.0/host6/target6:0:0/6:0:0:0, ids are in 1-2 */
+    while((slash = strrchr(dir, '/')) != NULL && slash != dir) {
+        *slash = '\0';
+        if(read_hex_attr(dir, "idVendor") != ZEN_ERROR)
+            return read_hex_attr(dir, "idVendor") == vid && read_hex_attr(dir, "idProduct") == pid;
+    }
+
+    return 0;
+}
+
+/** Finds /dev/sg* node of device by ids. */
+static int find_sg(int vid, int pid, char* out) {
+    struct dirent*  entry;
+    DIR*            dir;
+
+    if((dir = opendir(SYSFS_SG)) == NULL) {
+        zen_log("Opening %s failed, is sg module loaded?\n", SYSFS_SG);
+        return ZEN_ERROR;
+    }
+
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "sg", 2) != 0)
+            continue;
+
+        if(strlen(entry->d_name) + 5 < SG_PATH_LEN && match_sg(entry->d_name, vid, pid)) {
+            snprintf(out, SG_PATH_LEN, SG_DEV, entry->d_name);
+            closedir(dir);
+            return ZEN_SUCC;
+        }
+    }
+    closedir(dir);
+
+    zen_log("No SCSI generic device of 0x%.4X:0x%.4X\n", vid, pid);
+    return ZEN_ERROR;
+}
+
+/** Runs collected command, data is NULL for commands without data phase, returns bytes transferred. */
+static int sg_run(usb_dev_handle* hdev, char* data, int size, int timeout) {
+    struct sSgDev*      dev = SG_DEV_OF(hdev);
+    struct sSgState*    sg = &dev->st;
+    struct sg_io_hdr    io;
+    u8                  sense[SG_SENSE_LEN];
+    int                 done, err;
+
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.cmd_len = sg->cbw.lengthOfCommand;
+    io.cmdp = sg->cbw.command;
+    io.mx_sb_len = sizeof(sense);
+    io.sbp = sense;
+    io.timeout = timeout;
+    if(data == NULL)
+        io.dxfer_direction = SG_DXFER_NONE;
+    else {
+        io.dxfer_direction = sg->cbw.direction == CBW_DIR_IN ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+        io.dxfer_len = (u32)size < sg->cbw.transferLength ? (u32)size : sg->cbw.transferLength;
+        io.dxferp = data;
+    }
+
+    sg->pending = 0;
+    if(ioctl(dev->fd, SG_IO, &io) < 0) {
+        err = errno;
+        zen_log("SG_IO: command 0x%02X: %s\n", sg->cbw.command[0], strerror(err));
+        return -err;
+    }
+
+    done = io.dxfer_len - (io.resid > 0 ? io.resid : 0);
+    if(done < 0)
+        done = 0;
+
+    sg->csw.signature = CSW_SIG;
+    sg->csw.tag = sg->cbw.tag;
+    sg->csw.dataResidue = sg->cbw.transferLength - done;
+    sg->csw.status = CSW_OK;
+    if((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+        sg->csw.status = CSW_CMD_FAILED;
+        /* fixed format sense data, ASC and ASCQ follow additional length */
+        if(io.sb_len_wr > 13)
+            zen_log("SG_IO: command 0x%02X failed, status 0x%X, sense key 0x%X, asc 0x%02X, ascq 0x%02X\n",
+                sg->cbw.command[0], io.status, sense[2] & 0x0F, sense[12], sense[13]);
+        else if(io.sb_len_wr > 2)
+            zen_log("SG_IO: command 0x%02X failed, status 0x%X, sense key 0x%X\n",
+                sg->cbw.command[0], io.status, sense[2] & 0x0F);
+        else
+            zen_log("SG_IO: command 0x%02X failed, status 0x%X, host 0x%X, driver 0x%X\n",
+                sg->cbw.command[0], io.status, io.host_status, io.driver_status);
+    }
+    sg->status = 1;
+
+    return done;
+}
+
+static int sg_bulk_write(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout) {
+    struct sSgState* sg = &SG_DEV_OF(hdev)->st;
+
+    /* data phase of host -> device command */
+    if(sg->pending && sg->cbw.direction == CBW_DIR_OUT && sg->cbw.transferLength > 0)
+        return sg_run(hdev, bytes, size, timeout);
+
+    if(size != sizeof(struct sCBW))
+        return -EPIPE;
+
+    memcpy(&sg->cbw, bytes, sizeof(struct sCBW));
+    if(sg->cbw.lengthOfCommand == 0 || sg->cbw.lengthOfCommand > sizeof(sg->cbw.command))
+        return -EINVAL;
+
+    sg->pending = 1;
+    sg->status = 0;
+
+    return size;
+}
+
+static int sg_bulk_read(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout) {
+    struct sSgState*    sg = &SG_DEV_OF(hdev)->st;
+    int                 res;
+
+    /* data phase of device -> host command */
+    if(sg->pending && sg->cbw.direction == CBW_DIR_IN && sg->cbw.transferLength > 0)
+        return sg_run(hdev, bytes, size, timeout);
+
+    /* CSW of command without data phase */
+    if(sg->pending && (res = sg_run(hdev, NULL, 0, timeout)) < 0)
+        return res;
+
+    if(!sg->status || size < (int)sizeof(struct sCSW))
+        return -EPIPE;
+
+    memcpy(bytes, &sg->csw, sizeof(struct sCSW));
+    sg->status = 0;
+
+    return sizeof(struct sCSW);
+}
+
+static int sg_clear_halt(usb_dev_handle* hdev, int ep) {
+    /* usb_storage clears its own stalls */
+    return 0;
+}
+
+static int sg_reset(usb_dev_handle* hdev) {
+    struct sSgState* sg = &SG_DEV_OF(hdev)->st;
+
+    sg->pending = 0;
+    sg->status = 0;
+    return 0;
+}
+
+static void sg_close(usb_dev_handle* hdev) {
+    /* nothing was detached, nothing to reset */
+    close(SG_DEV_OF(hdev)->fd);
+    free(hdev);
+}
+
+static const struct sZenTransport sgTransport = { sg_bulk_write, sg_bulk_read, sg_close, sg_clear_halt, sg_reset };
+
+usb_dev_handle* init_zen_sg(int vid, int pid, const char* node) {
+    struct sSgDev*  dev;
+    char            path[SG_PATH_LEN];
+    int             version;
+
+    if(vid == 0)
+        vid = ZEN_VENDOR;
+
+    if(pid == 0)
+        pid = ZEN_PRODUCT;
+
+    if(node)
+        snprintf(path, sizeof(path), "%s", node);
+    else if(find_sg(vid, pid, path) != ZEN_SUCC)
+        return NULL;
+
+    if((dev = (struct sSgDev*)calloc(1, sizeof(struct sSgDev))) == NULL)
+        return NULL;
+
+    /* no O_EXCL, mounted filesystem keeps using the device */
+    if((dev->fd = open(path, O_RDWR | O_NONBLOCK)) < 0) {
+        zen_log("Opening %s failed: %s\n", path, strerror(errno));
+        free(dev);
+        return NULL;
+    }
+
+    if(ioctl(dev->fd, SG_GET_VERSION_NUM, &version) < 0 || version < SG_MIN_VERSION) {
+        zen_log("%s doesn't support SG_IO\n", path);
+        close(dev->fd);
+        free(dev);
+        return NULL;
+    }
+
+    if(zen_attach((usb_dev_handle*)dev, &sgTransport) != ZEN_SUCC) {
+        sg_close((usb_dev_handle*)dev);
+        return NULL;
+    }
+    zen_profile_select((usb_dev_handle*)dev, vid, pid);
+
+    return (usb_dev_handle*)dev;
+}
@@ -0,0 +1,40 @@
+/*
+ * Name        : sgopen.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Talks to Zen Stone through SG_IO of usb_storage, without detaching it
+ */
+
+#ifndef SGOPEN_H
+#define SGOPEN_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Device node like "/dev/sg2" or "/dev/sdb" */
+#define SG_PATH_LEN     64
+
+/**
+ * @brief
+ * Opens device node of usb_storage and sends commands with SG_IO ioctl (linux only),
+ * kernel driver stays bound, so filesystem can stay mounted and nothing is detached,
+ * reset or enumerated again. Vendor commands need CAP_SYS_RAWIO on /dev/sdX nodes,
+ * /dev/sg* nodes opened for writing accept them. Returned handle works with all libzen
+ * functions and has its own SG_IO transport attached with zen_attach(), it isn't libusb
+ * handle and must not be passed to libusb
+ * @param vid vendor id, 0 for default
+ * @param pid product id, 0 for default
+ * @param node device node like "/dev/sg2", NULL to find /dev/sg* of device by ids in sysfs
+ * @return handle, NULL if device wasn't found or node doesn't support SG_IO
+**/
+usb_dev_handle* init_zen_sg(int vid, int pid, const char* node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
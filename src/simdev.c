@@ -0,0 +1,589 @@
+/*
+ * Name        : simdev.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : In-process simulated Zen Stone, speaks Bulk-Only Transport
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "simdev.h"
+
+#ifndef WIN32
+# include <unistd.h>
+#endif
+
+/* errno values returned by libusb on linux */
+#define SIM_EPIPE       -32
+#define SIM_ETIMEDOUT   -110
+
+#define SIM_BANKS       6
+/* Physical type reported for the only logical media, NAND */
+#define SIM_MEDIA_TYPE  1
+
+/* Bulk-Only Transport phases */
+#define SIM_IDLE        0 /* waiting for CBW */
+#define SIM_DATA_IN     1 /* device -> host data phase */
+#define SIM_DATA_OUT    2 /* host -> device data phase */
+#define SIM_STATUS      3 /* waiting for CSW read */
+
+struct sSimBank {
+    u8      bankNo;
+    u8      type;
+    u8      tag;
+    u32     sectorSize;
+    u32     sectorsCount;
+    u8*     data;
+};
+
+struct sSimDev {
+    int             state;
+    struct sCBW     cbw;
+    struct sCSW     csw;
+    /** Data phase buffer. */
+    u8*             buf;
+    u32             bufSize;
+    /** Bytes device has for the host in DATA_IN phase. */
+    u32             dataLen;
+    u8              battLevel;
+    u8              battFull;
+    u8              volLimit;
+    struct sSimBank banks[SIM_BANKS];
+    /** Endpoints stalled until host clears halt, IN then OUT. */
+    int             halted[2];
+    int                     faulty;
+    struct sSimFaults       faults;
+    struct sSimFaultStats   faultStats;
+    /** xorshift state of fault generator. */
+    u32                     rnd;
+};
+
+static struct sSimDev sim;
+
+static const char simVersion[] = "Product Version: 001.006.001\r\nComponent Version: 001.006.001\r\n\x1A";
+
+/* SB1 image written after version prefix of system banks */
+#define SIM_SB_LOADS    8
+#define SIM_SB_PAYLOAD  1024
+#define SIM_SB_ADDR     0x8000
+
+/* resource table written at start of resource banks */
+#define SIM_RESOURCES   64
+
+static void put_be(u8* dst, u64 val, int bytes) {
+    while(bytes--) {
+        dst[bytes] = val & 0xFF;
+        val >>= 8;
+    }
+}
+
+static u64 get_be(const u8* src, int bytes) {
+    u64 val = 0;
+
+    while(bytes--)
+        val = (val << 8) | *src++;
+
+    return val;
+}
+
+static struct sSimBank* find_bank(u8 bankNo) {
+    int i;
+
+    for(i=0; i<SIM_BANKS; i++)
+        if(sim.banks[i].bankNo == bankNo)
+            return &sim.banks[i];
+
+    return NULL;
+}
+
+static int reserve(u32 size) {
+    u8* buf;
+
+    if(size <= sim.bufSize)
+        return ZEN_SUCC;
+
+    if((buf = (u8*)realloc(sim.buf, size)) == NULL)
+        return ZEN_ERROR;
+
+    sim.buf = buf;
+    sim.bufSize = size;
+
+    return ZEN_SUCC;
+}
+
+/** Fills data phase for device -> host commands, returns CSW status. */
+static u8 exec_in(const u8* cmd, u32 len) {
+    struct sSimBank* bank;
+    u64              start, count;
+    int              i;
+
+    memset(sim.buf, 0, len);
+
+    switch(cmd[0]) {
+        case CMD_SCSI_INQUIRY: {
+            struct sDevInfo info;
+
+            memset(&info, 0, sizeof(struct sDevInfo));
+            memcpy(info.vendorId, "CREATIVE", 8);
+            memcpy(info.productId, "ZEN Stone       ", 16);
+            memcpy(info.productRevisionLevel, "1.01", 4);
+            sim.dataLen = len < sizeof(struct sDevInfo) ? len : sizeof(struct sDevInfo);
+            memcpy(sim.buf, &info, sim.dataLen);
+            return CSW_OK;
+        }
+        case CMD_SCSI_CAPACITY: {
+            bank = find_bank(0);
+            if(len < 8)
+                return CSW_CMD_FAILED;
+            put_be(sim.buf, bank->sectorsCount - 1, 4);
+            put_be(sim.buf + 4, bank->sectorSize, 4);
+            sim.dataLen = 8;
+            return CSW_OK;
+        }
+        case CMD_SCSI_SERVICE_ACTION_IN: {
+            bank = find_bank(0);
+            if(cmd[1] != SAI_READ_CAPACITY_16 || len < 12)
+                return CSW_CMD_FAILED;
+            put_be(sim.buf, bank->sectorsCount - 1, 8);
+            put_be(sim.buf + 8, bank->sectorSize, 4);
+            sim.dataLen = len < sizeof(struct sCap16Resp) ? len : sizeof(struct sCap16Resp);
+            return CSW_OK;
+        }
+        case CMD_SCSI_READ_10:
+        case CMD_SCSI_READ_16: {
+            bank = find_bank(0);
+            if(cmd[0] == CMD_SCSI_READ_10) {
+                start = get_be(cmd + 2, 4);
+                count = get_be(cmd + 7, 2);
+            } else {
+                start = get_be(cmd + 2, 8);
+                count = get_be(cmd + 10, 4);
+            }
+            if(start + count > bank->sectorsCount || count * bank->sectorSize > len)
+                return CSW_CMD_FAILED;
+            sim.dataLen = (u32)(count * bank->sectorSize);
+            memcpy(sim.buf, bank->data + start * bank->sectorSize, sim.dataLen);
+            return CSW_OK;
+        }
+        case CMD_SCSI_SIGMATEL_READ:
+            break;
+        default:
+            return CSW_CMD_FAILED;
+    }
+
+    switch(cmd[1]) {
+        case CMD_SIGMATEL_GET_PROTOCOL_VERSION:
+            put_be(sim.buf, ZEN_PROTO_VER, 2);
+            sim.dataLen = 2;
+            return CSW_OK;
+        case CMD_SIGMATEL_GET_CHIP_ID:
+            put_be(sim.buf, ZEN_CHIP_ID, 2);
+            sim.dataLen = 2;
+            return CSW_OK;
+        case CMD_ZEN_BATT_LEVEL:
+            sim.buf[1] = sim.battLevel;
+            sim.buf[2] = sim.battFull;
+            sim.dataLen = sizeof(struct sBattResp);
+            return CSW_OK;
+        case CMD_ZEN_VOL_LIMIT_READ:
+            sim.buf[1] = sim.volLimit;
+            sim.dataLen = sizeof(struct sVolLimitRead);
+            return CSW_OK;
+        case CMD_SIGMATEL_GET_LOGICAL_MEDIA_NUM:
+            sim.buf[0] = 1;
+            sim.dataLen = 1;
+            return CSW_OK;
+        case CMD_SIGMATEL_GET_LOGICAL_MEDIA_INFO: {
+            if(cmd[2] == CMD2_SIGMATEL_MEDIA_DRIVES && len >= 2) {
+                put_be(sim.buf, SIM_BANKS, 2);
+                sim.dataLen = 2;
+                return CSW_OK;
+            }
+            if(cmd[2] == CMD2_SIGMATEL_MEDIA_SIZE && len >= 8) {
+                for(i=0, count=0; i<SIM_BANKS; i++)
+                    count += (u64)sim.banks[i].sectorsCount * sim.banks[i].sectorSize;
+                put_be(sim.buf, count, 8);
+                sim.dataLen = 8;
+                return CSW_OK;
+            }
+            if(cmd[2] == CMD2_SIGMATEL_MEDIA_TYPE && len >= 1) {
+                sim.buf[0] = SIM_MEDIA_TYPE;
+                sim.dataLen = 1;
+                return CSW_OK;
+            }
+            return CSW_CMD_FAILED;
+        }
+        case CMD_SIGMATEL_GET_ALLOCATION_TABLE: {
+            u8* row;
+
+            if(len < 2 + SIM_BANKS * 11)
+                return CSW_CMD_FAILED;
+            put_be(sim.buf, SIM_BANKS, 2);
+            for(i=0, row=sim.buf+2; i<SIM_BANKS; i++, row+=11) {
+                row[0] = sim.banks[i].bankNo;
+                row[1] = sim.banks[i].type;
+                row[2] = sim.banks[i].tag;
+                put_be(row + 3, (u64)sim.banks[i].sectorsCount * sim.banks[i].sectorSize, 8);
+            }
+            sim.dataLen = len;
+            return CSW_OK;
+        }
+        case CMD_SIGMATEL_GET_LOGICAL_DRIVE_INFO: {
+            if((bank = find_bank(cmd[2])) == NULL)
+                return CSW_CMD_FAILED;
+            if(cmd[3] == CMD2_SIGMATEL_SECTOR_SIZE && len >= 4) {
+                put_be(sim.buf, bank->sectorSize, 4);
+                sim.dataLen = 4;
+                return CSW_OK;
+            }
+            if(cmd[3] == CMD2_SIGMATEL_BANK_SIZE && len >= 8) {
+                put_be(sim.buf, bank->sectorsCount, 8);
+                sim.dataLen = 8;
+                return CSW_OK;
+            }
+            return CSW_CMD_FAILED;
+        }
+        case CMD_SIGMATEL_READ_LOGICAL_DRIVE_SECTOR: {
+            if((bank = find_bank(cmd[2])) == NULL)
+                return CSW_CMD_FAILED;
+            start = get_be(cmd + 3, 8);
+            count = get_be(cmd + 11, 4);
+            if(start + count > bank->sectorsCount || count * bank->sectorSize > len)
+                return CSW_CMD_FAILED;
+            sim.dataLen = (u32)(count * bank->sectorSize);
+            memcpy(sim.buf, bank->data + start * bank->sectorSize, sim.dataLen);
+            return CSW_OK;
+        }
+    }
+
+    return CSW_CMD_FAILED;
+}
+
+/** Consumes data phase of host -> device commands, returns CSW status. */
+static u8 exec_out(const u8* cmd, u32 len) {
+    struct sSimBank* bank;
+    u64              start, count;
+
+    if(cmd[0] != CMD_SCSI_SIGMATEL_WRITE)
+        return CSW_CMD_FAILED;
+
+    switch(cmd[1]) {
+        case CMD_ZEN_VOL_LIMIT_WRITE:
+            if(len < sizeof(struct sVolLimitWrite))
+                return CSW_CMD_FAILED;
+            sim.volLimit = ((struct sVolLimitWrite*)sim.buf)->limit;
+            return CSW_OK;
+        case CMD_SIGMATEL_WRITE_LOGICAL_DRIVE_SECTOR:
+            if((bank = find_bank(cmd[2])) == NULL)
+                return CSW_CMD_FAILED;
+            start = get_be(cmd + 3, 8);
+            count = get_be(cmd + 11, 4);
+            if(start + count > bank->sectorsCount || count * bank->sectorSize != len)
+                return CSW_CMD_FAILED;
+            memcpy(bank->data + start * bank->sectorSize, sim.buf, len);
+            return CSW_OK;
+    }
+
+    return CSW_CMD_FAILED;
+}
+
+static u32 sim_rand(void) {
+    sim.rnd ^= sim.rnd << 13;
+    sim.rnd ^= sim.rnd >> 17;
+    sim.rnd ^= sim.rnd << 5;
+    return sim.rnd;
+}
+
+static int roll(u32 ppm) {
+    return ppm && sim_rand() % 1000000 < ppm;
+}
+
+/** Index of endpoint in halted flags. */
+static int ep_index(int ep) {
+    return ep == ZEN_ENDP_IN ? 0 : 1;
+}
+
+/**
+ * Delays transfer and decides if endpoint stalls. Stalled CBW is dropped, stalled
+ * data phase ends with failed CSW, stalled CSW is sent after halt is cleared.
+ */
+static int inject_stall(int ep) {
+    if(sim.halted[ep_index(ep)])
+        return 1;
+
+    if(!sim.faulty)
+        return 0;
+
+    if(sim.faults.jitterUs) {
+#ifdef WIN32
+        Sleep((sim_rand() % sim.faults.jitterUs) / 1000);
+#else
+        usleep(sim_rand() % sim.faults.jitterUs);
+#endif
+    }
+
+    if(roll(sim.faults.stall)) {
+        sim.faultStats.stall++;
+        sim.halted[ep_index(ep)] = 1;
+        if(sim.state == SIM_DATA_IN || sim.state == SIM_DATA_OUT) {
+            sim.csw.dataResidue = sim.cbw.transferLength;
+            sim.csw.status = CSW_CMD_FAILED;
+            sim.state = SIM_STATUS;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Host waits for device which has nothing to say, real transfer takes whole timeout. */
+static int sim_timeout(void) {
+    sim.faultStats.timeouts++;
+    return SIM_ETIMEDOUT;
+}
+
+static int sim_bulk_write(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout) {
+    if(ep != ZEN_ENDP_OUT || inject_stall(ep))
+        return SIM_EPIPE;
+
+    if(sim.state == SIM_IDLE) {
+        if(size != sizeof(struct sCBW))
+            return SIM_EPIPE;
+
+        memcpy(&sim.cbw, bytes, sizeof(struct sCBW));
+        sim.csw.signature = CSW_SIG;
+        sim.csw.tag = sim.cbw.tag;
+        sim.csw.dataResidue = 0;
+        sim.dataLen = 0;
+
+        if(sim.cbw.signature != CBW_SIG || reserve(sim.cbw.transferLength) != ZEN_SUCC) {
+            sim.csw.status = CSW_PHASE_ERR;
+            sim.state = SIM_STATUS;
+        } else if(sim.cbw.transferLength == 0) {
+            /* TEST UNIT READY and other no data commands */
+            sim.csw.status = sim.cbw.command[0] == CMD_SCSI_TEST_UNIT_READY ? CSW_OK : CSW_CMD_FAILED;
+            sim.state = SIM_STATUS;
+        } else if(sim.cbw.direction == CBW_DIR_IN) {
+            sim.csw.status = exec_in(sim.cbw.command, sim.cbw.transferLength);
+            sim.state = SIM_DATA_IN;
+            if(sim.faulty && roll(sim.faults.skipData)) {
+                sim.faultStats.skipData++;
+                sim.csw.dataResidue = sim.cbw.transferLength;
+                sim.csw.status = CSW_CMD_FAILED;
+                sim.state = SIM_STATUS;
+            }
+        } else
+            sim.state = SIM_DATA_OUT;
+
+        return size;
+    }
+
+    if(sim.state == SIM_DATA_OUT) {
+        if((u32)size > sim.cbw.transferLength)
+            size = sim.cbw.transferLength;
+        memcpy(sim.buf, bytes, size);
+        sim.csw.dataResidue = sim.cbw.transferLength - size;
+        sim.csw.status = exec_out(sim.cbw.command, size);
+        sim.state = SIM_STATUS;
+        return size;
+    }
+
+    return SIM_EPIPE;
+}
+
+static int sim_bulk_read(usb_dev_handle* hdev, int ep, char* bytes, int size, int timeout) {
+    if(ep != ZEN_ENDP_IN || inject_stall(ep))
+        return SIM_EPIPE;
+
+    if(sim.state == SIM_DATA_IN) {
+        if((u32)size > sim.dataLen)
+            size = sim.dataLen;
+        if(sim.faulty && size > 1 && roll(sim.faults.shortData)) {
+            sim.faultStats.shortData++;
+            size /= 2;
+        }
+        memcpy(bytes, sim.buf, size);
+        sim.csw.dataResidue = sim.cbw.transferLength - size;
+        sim.state = SIM_STATUS;
+        return size;
+    }
+
+    if(sim.state == SIM_STATUS) {
+        if(size < (int)sizeof(struct sCSW))
+            return SIM_EPIPE;
+        memcpy(bytes, &sim.csw, sizeof(struct sCSW));
+        if(sim.faulty && roll(sim.faults.tagMismatch)) {
+            sim.faultStats.tagMismatch++;
+            ((struct sCSW*)bytes)->tag ^= 0x5A5A;
+        }
+        sim.state = SIM_IDLE;
+        return sizeof(struct sCSW);
+    }
+
+    return sim_timeout();
+}
+
+static int sim_clear_halt(usb_dev_handle* hdev, int ep) {
+    if(ep != ZEN_ENDP_IN && ep != ZEN_ENDP_OUT)
+        return SIM_EPIPE;
+
+    sim.halted[ep_index(ep)] = 0;
+    return 0;
+}
+
+static int sim_reset(usb_dev_handle* hdev) {
+    /* halts stay, host clears them after reset */
+    sim.state = SIM_IDLE;
+    return 0;
+}
+
+static void sim_close(usb_dev_handle* hdev) {
+    int i;
+
+    for(i=0; i<SIM_BANKS; i++)
+        free(sim.banks[i].data);
+    free(sim.buf);
+    memset(&sim, 0, sizeof(struct sSimDev));
+}
+
+static const struct sZenTransport simTransport = { sim_bulk_write, sim_bulk_read, sim_close, sim_clear_halt, sim_reset };
+
+static void put_le(u8* dst, u32 val) {
+    dst[0] = val & 0xFF;
+    dst[1] = (val >> 8) & 0xFF;
+    dst[2] = (val >> 16) & 0xFF;
+    dst[3] = (val >> 24) & 0xFF;
+}
+
+/** Writes version prefix and small SB1 image: a few LOADs and a JUMP, rest is 0xFF. */
+static void add_sb_image(u8* data, u32 size, u8 tag) {
+    u8* p = data + sizeof(simVersion) - 1;
+    u32 i, cmdBytes = SIM_SB_LOADS * (8 + SIM_SB_PAYLOAD) + 8;
+
+    memcpy(data, simVersion, sizeof(simVersion) - 1);
+
+    memset(p, 0, 52);
+    put_le(p, ZEN_CHIP_ID);
+    put_le(p + 4, 52 + cmdBytes);  /* image size */
+    put_le(p + 8, 52);             /* header size */
+    memcpy(p + 20, "STMP", 4);
+    put_le(p + 24, 0x0001);        /* product version 001.006.001 in BCD */
+    put_le(p + 28, 0x0006);
+    put_le(p + 32, 0x0001);
+    put_le(p + 36, 0x0001);        /* component version */
+    put_le(p + 40, 0x0006);
+    put_le(p + 44, 0x0001);
+    put_le(p + 48, tag);
+    p += 52;
+
+    for(i=0; i<SIM_SB_LOADS; i++, p+=8+SIM_SB_PAYLOAD) {
+        put_le(p, (((8 + SIM_SB_PAYLOAD) / 4) << 21) | (SIM_SB_PAYLOAD << 6) | 0x1);
+        put_le(p + 4, SIM_SB_ADDR + i * SIM_SB_PAYLOAD);
+    }
+    put_le(p, (2 << 21) | 0x3);
+    put_le(p + 4, SIM_SB_ADDR);
+    p += 8;
+
+    memset(p, 0xFF, size - (u32)(p - data));
+}
+
+/** Writes resource table: SIM_RESOURCES entries of varying size packed after the table. */
+static void add_resource_table(u8* data) {
+    u32 i, offset, len;
+
+    put_le(data, SIM_RESOURCES);
+    offset = 4 + SIM_RESOURCES * 8;
+    for(i=0; i<SIM_RESOURCES; i++) {
+        /* resource content is left random */
+        len = 64 + ((data[offset] | (data[offset + 1] << 8)) % 8192);
+        put_le(data + 4 + i * 8, offset);
+        put_le(data + 8 + i * 8, len);
+        offset = (offset + len + 3) & ~3;
+    }
+}
+
+static int add_bank(int i, u8 bankNo, u8 type, u8 tag, u32 sectorSize, u32 sectorsCount) {
+    struct sSimBank* bank = &sim.banks[i];
+    u32              j, size, seed;
+
+    bank->bankNo = bankNo;
+    bank->type = type;
+    bank->tag = tag;
+    bank->sectorSize = sectorSize;
+    bank->sectorsCount = sectorsCount;
+
+    size = sectorSize * sectorsCount;
+    if((bank->data = (u8*)malloc(size)) == NULL)
+        return ZEN_ERROR;
+
+    if(type == SIGMATEL_BANK_TYPE_DATA) {
+        memset(bank->data, 0, size);
+        return ZEN_SUCC;
+    }
+
+    /* xorshift, seeded with bank number so content is stable between runs */
+    seed = 0x9E3779B9 ^ bankNo;
+    for(j=0; j<size; j++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        bank->data[j] = seed & 0xFF;
+    }
+
+    if(tag != SIGMATEL_BANK_TAG_RESOURCE_BIN && tag != SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM)
+        add_sb_image(bank->data, size, tag);
+    else
+        add_resource_table(bank->data);
+
+    return ZEN_SUCC;
+}
+
+usb_dev_handle* sim_open(void) {
+    memset(&sim, 0, sizeof(struct sSimDev));
+    sim.battLevel = 87;
+    sim.battFull = ZEN_BATT_NOT_FULL;
+    sim.volLimit = 100;
+
+    if(add_bank(0, 0, SIGMATEL_BANK_TYPE_DATA, SIGMATEL_BANK_TAG_DATA, 512, SIM_DATA_SECTORS) != ZEN_SUCC
+        || add_bank(1, 4, SIGMATEL_BANK_TYPE_SYSTEM, SIGMATEL_BANK_TAG_BOOTMANAGER, 2048, SIM_BOOTMANAGER_SECTORS) != ZEN_SUCC
+        || add_bank(2, 5, SIGMATEL_BANK_TYPE_SYSTEM, SIGMATEL_BANK_TAG_USBMSC, 2048, SIM_USBMSC_SECTORS) != ZEN_SUCC
+        || add_bank(3, 6, SIGMATEL_BANK_TYPE_SYSTEM, SIGMATEL_BANK_TAG_STMPSYS, 2048, SIM_STMPSYS_SECTORS) != ZEN_SUCC
+        || add_bank(4, 7, SIGMATEL_BANK_TYPE_SYSTEM, SIGMATEL_BANK_TAG_RESOURCE_BIN, 2048, SIM_RESOURCE_SECTORS) != ZEN_SUCC
+        || add_bank(5, 8, SIGMATEL_BANK_TYPE_SYSTEM, SIGMATEL_BANK_TAG_RESOURCE_BIN_RAM, 2048, SIM_RESOURCE_SECTORS) != ZEN_SUCC) {
+        sim_close(NULL);
+        return NULL;
+    }
+
+    if(zen_attach((usb_dev_handle*)&sim, &simTransport) != ZEN_SUCC) {
+        sim_close(NULL);
+        return NULL;
+    }
+    zen_profile_select((usb_dev_handle*)&sim, ZEN_VENDOR, ZEN_PRODUCT);
+
+    return (usb_dev_handle*)&sim;
+}
+
+void sim_set_faults(const struct sSimFaults* faults) {
+    memset(&sim.faultStats, 0, sizeof(struct sSimFaultStats));
+    sim.faulty = faults != NULL;
+    if(faults == NULL)
+        return;
+
+    sim.faults = *faults;
+    sim.rnd = faults->seed ? faults->seed : 0x2545F491;
+}
+
+void sim_get_fault_stats(struct sSimFaultStats* st) {
+    *st = sim.faultStats;
+}
+
+const u8* sim_bank_data(u8 bank, u32* size) {
+    struct sSimBank* b = find_bank(bank);
+
+    if(b == NULL || b->data == NULL)
+        return NULL;
+
+    *size = b->sectorSize * b->sectorsCount;
+    return b->data;
+}
@@ -0,0 +1,85 @@
+/*
+ * Name        : simdev.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : In-process simulated Zen Stone, speaks Bulk-Only Transport
+ */
+
+#ifndef SIMDEV_H
+#define SIMDEV_H
+
+#include "libzen.h"
+
+/* Simulated bank sizes in sectors */
+#define SIM_DATA_SECTORS        8192 /* 512B sectors -> 4MB */
+#define SIM_BOOTMANAGER_SECTORS 32
+#define SIM_USBMSC_SECTORS      128
+#define SIM_STMPSYS_SECTORS     256
+#define SIM_RESOURCE_SECTORS    1024
+
+/** Fault rates in parts per million of bulk transfers. */
+struct sSimFaults {
+    /** CSW carries tag of other command. */
+    u32 tagMismatch;
+    /** Device -> host data phase delivers half of the data. */
+    u32 shortData;
+    /** Device -> host data phase is skipped, failed CSW comes instead of data. */
+    u32 skipData;
+    /**
+     * Transfer fails with -EPIPE and endpoint stays halted until cleared, stalled CBW
+     * is dropped, stalled data phase ends with failed CSW.
+     */
+    u32 stall;
+    /** Every transfer is delayed by random 0..jitterUs. */
+    u32 jitterUs;
+    /** Seed of fault generator, same seed gives same faults. */
+    u32 seed;
+};
+
+/** Number of injected faults. */
+struct sSimFaultStats {
+    u64 tagMismatch;
+    u64 shortData;
+    u64 skipData;
+    u64 stall;
+    /** Reads device had nothing for, each costs whole timeout on real device. */
+    u64 timeouts;
+};
+
+/**
+ * @brief
+ * Creates simulated device and attaches its transport with zen_attach(),
+ * deinit_zen() destroys it
+ *
+ * Layout mimics Zen Stone: data bank 0, bootmanager 4, usbmsc 5, stmpsys 6,
+ * resource.bin 7 and its RAM copy 8. Content of system banks is pseudo-random
+ * but the same on every run.
+ * @return handle usable with all libzen functions, NULL if out of memory
+**/
+usb_dev_handle* sim_open(void);
+
+/**
+ * @brief
+ * Starts injecting faults into transfers of simulated device, sim_open() turns them off
+ * @param faults fault rates, NULL to turn faults off
+**/
+void sim_set_faults(const struct sSimFaults* faults);
+
+/**
+ * @brief
+ * Copies counters of faults injected since sim_set_faults()
+ * @param st pointer to struct where counters will be saved
+**/
+void sim_get_fault_stats(struct sSimFaultStats* st);
+
+/**
+ * @brief
+ * Gives direct access to bank content, e.g. to check data read through libzen
+ * @param bank bank id
+ * @param size bank size in bytes
+ * @return bank content, NULL if there's no such bank
+**/
+const u8* sim_bank_data(u8 bank, u32* size);
+
+#endif
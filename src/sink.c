@@ -0,0 +1,171 @@
+/*
+ * Name        : sink.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Output sinks bank reads stream into
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "libzen.h"
+
+#ifdef WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+
+/* First buffer of growing memory sink */
+#define SINK_MEM_INITIAL    (64<<10)
+
+static void sink_reset(struct sZenSink* sink) {
+    memset(sink, 0, sizeof(struct sZenSink));
+    sink->fd = -1;
+}
+
+static int callback_write(struct sZenSink* sink, const u8* data, size_t len) {
+    return sink->cb(sink->ctx, data, len);
+}
+
+void zen_sink_callback(struct sZenSink* sink, int (*cb)(void* ctx, const u8* data, size_t len), void* ctx) {
+    sink_reset(sink);
+    sink->write = callback_write;
+    sink->cb = cb;
+    sink->ctx = ctx;
+}
+
+static int file_write(struct sZenSink* sink, const u8* data, size_t len) {
+    if(fwrite(data, 1, len, sink->f) != len) {
+        zen_log("Writing dump failed\n");
+        return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
+
+static int file_flush(struct sZenSink* sink, int ok) {
+    return fflush(sink->f) == 0 ? ZEN_SUCC : ZEN_ERROR;
+}
+
+static int path_close(struct sZenSink* sink, int ok) {
+    int res = fclose(sink->f) == 0 ? ZEN_SUCC : ZEN_ERROR;
+
+    sink->f = NULL;
+    return res;
+}
+
+void zen_sink_file(struct sZenSink* sink, FILE* f) {
+    sink_reset(sink);
+    sink->write = file_write;
+    sink->close = file_flush;
+    sink->f = f;
+}
+
+int zen_sink_path(struct sZenSink* sink, const char* path) {
+    FILE* f;
+
+    if((f = fopen(path, "wb")) == NULL) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    zen_sink_file(sink, f);
+    sink->close = path_close;
+
+    return ZEN_SUCC;
+}
+
+static int fd_write(struct sZenSink* sink, const u8* data, size_t len) {
+    int res;
+
+    /* pipes and sockets take part of data at a time */
+    while(len > 0) {
+        res = write(sink->fd, data, len);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res <= 0) {
+            zen_log("Writing dump failed: %s\n", strerror(errno));
+            return ZEN_ERROR;
+        }
+        data += res;
+        len -= res;
+    }
+
+    return ZEN_SUCC;
+}
+
+void zen_sink_fd(struct sZenSink* sink, int fd) {
+    sink_reset(sink);
+    sink->write = fd_write;
+    sink->fd = fd;
+}
+
+static int mem_write(struct sZenSink* sink, const u8* data, size_t len) {
+    size_t  capacity;
+    u8*     buff;
+
+    if(sink->size + len > sink->capacity) {
+        if(!sink->grow) {
+            zen_log("Dump doesn't fit in %luB buffer\n", (unsigned long)sink->capacity);
+            return ZEN_ERROR;
+        }
+
+        for(capacity = sink->capacity ? sink->capacity : SINK_MEM_INITIAL; capacity < sink->size + len; capacity *= 2)
+            ;
+
+        if((buff = (u8*)realloc(sink->data, capacity)) == NULL)
+            return ZEN_ERROR;
+
+        sink->data = buff;
+        sink->capacity = capacity;
+    }
+
+    memcpy(sink->data + sink->size, data, len);
+    sink->size += len;
+
+    return ZEN_SUCC;
+}
+
+void zen_sink_mem(struct sZenSink* sink, u8* buff, size_t capacity) {
+    sink_reset(sink);
+    sink->write = mem_write;
+    sink->data = buff;
+    sink->capacity = buff ? capacity : 0;
+    sink->grow = buff == NULL;
+
+    /* growing buffer is allocated on first write if this fails */
+    if(sink->grow && capacity && (sink->data = (u8*)malloc(capacity)) != NULL)
+        sink->capacity = capacity;
+}
+
+static int tee_write(struct sZenSink* sink, const u8* data, size_t len) {
+    if(sink->first->write(sink->first, data, len) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    return sink->second->write(sink->second, data, len);
+}
+
+static int tee_close(struct sZenSink* sink, int ok) {
+    int res = zen_sink_close(sink->first, ok);
+
+    if(zen_sink_close(sink->second, ok) != ZEN_SUCC)
+        res = ZEN_ERROR;
+
+    return res;
+}
+
+void zen_sink_tee(struct sZenSink* sink, struct sZenSink* first, struct sZenSink* second) {
+    sink_reset(sink);
+    sink->write = tee_write;
+    sink->close = tee_close;
+    sink->first = first;
+    sink->second = second;
+}
+
+int zen_sink_close(struct sZenSink* sink, int ok) {
+    if(sink->close == NULL)
+        return ZEN_SUCC;
+
+    return sink->close(sink, ok);
+}
@@ -0,0 +1,435 @@
+/*
+ * Name        : stress.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Soak test of libzen transport against simulated Zen Stone with injected faults
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libzen.h"
+#include "simdev.h"
+
+#if defined(__GLIBC__)
+# include <malloc.h>
+# if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+#  define heap_in_use() ((u64)mallinfo2().uordblks)
+# else
+#  define heap_in_use() ((u64)(unsigned)mallinfo().uordblks)
+# endif
+#else
+# define heap_in_use() ((u64)0)
+#endif
+
+/*
+ * Built with -DALLOC_COUNT and linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+ * every heap allocation is counted, so allocation-free read paths can be checked
+ */
+#ifdef ALLOC_COUNT
+static u64 allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+#define OP_READY        0
+#define OP_BATT         1
+#define OP_VOL_LIMIT    2
+#define OP_CHIP_ID      3
+#define OP_READ_BUF     4
+#define OP_READ_SECTOR  5
+#define OPS_COUNT       6
+
+static const char*  opNames[OPS_COUNT] = {"ready", "battery", "vol_limit", "chip_id", "read_buf", "read_sector"};
+/* Mix of queries and bank reads, sums to 100 */
+static const int    opWeights[OPS_COUNT] = {10, 30, 15, 10, 30, 5};
+
+/* Banks read by OP_READ_BUF and OP_READ_SECTOR */
+static const u8     readBanks[] = {4, 5, 6, 7};
+
+/* Report goes to stderr, libzen logs every failed transfer to stdout */
+
+#define READ_MAX_SECTORS    64
+/* Bank read whole by allocation check, and its size */
+#define ALLOC_BANK          7
+#define ALLOC_BANK_MAX      (4 << 20)
+/* Failed operations in a row after which device is opened again */
+#define REOPEN_STREAK       100
+/* Heap growth over whole run reported as leak */
+#define LEAK_LIMIT          (1 << 20)
+
+/* Latency histogram: values < 16 us exact, then 16 sub-buckets per power of two */
+#define HIST_SUB_BITS       4
+#define HIST_BUCKETS        1024
+
+struct sOpStats {
+    u64 count;
+    u64 errors;
+};
+
+static u64              hist[HIST_BUCKETS];
+static u64              latMax;
+static struct sOpStats  opStats[OPS_COUNT];
+
+static int hist_index(u64 v) {
+    int e;
+
+    if(v < (1 << HIST_SUB_BITS))
+        return (int)v;
+
+    for(e=0; (v >> e) > 1; e++);
+    return (e - HIST_SUB_BITS + 1) * (1 << HIST_SUB_BITS) + (int)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/** Lower bound of bucket. */
+static u64 hist_value(int i) {
+    int e, sub;
+
+    if(i < (1 << HIST_SUB_BITS))
+        return i;
+
+    e = i / (1 << HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = i % (1 << HIST_SUB_BITS);
+    return (u64)((1 << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+}
+
+static u64 percentile(u64 total, double p) {
+    u64 seen = 0, want = (u64)(total * p);
+    int i;
+
+    for(i=0; i<HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if(seen > want)
+            return hist_value(i);
+    }
+
+    return latMax;
+}
+
+static u32 rnd(void) {
+    static u32 x = 0x12345678;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static int pick_op(void) {
+    int r = rnd() % 100, i;
+
+    for(i=0; i<OPS_COUNT-1 && r >= opWeights[i]; i++)
+        r -= opWeights[i];
+
+    return i;
+}
+
+/** Reads random sectors and compares them with simulator memory, returns bytes read. */
+static int read_random(usb_dev_handle* hdev, u8* buff, FILE* f, int op, int* corrupt) {
+    struct sBankSize    size;
+    const u8*           data;
+    u32                 dataSize, from, count;
+    u8                  bank = readBanks[rnd() % sizeof(readBanks)];
+
+    if(read_bank_size(hdev, bank, &size) == ZEN_ERROR)
+        return ZEN_ERROR;
+
+    /* garbage accepted as bank geometry */
+    data = sim_bank_data(bank, &dataSize);
+    if(data == NULL || size.sectorSize == 0 || size.sectorSize > 2048 || (u64)size.sectorsCount * size.sectorSize != dataSize) {
+        (*corrupt)++;
+        return ZEN_ERROR;
+    }
+
+    if(op == OP_READ_SECTOR) {
+        from = (rnd() % (size.sectorsCount / 8 - 1)) * 8;
+        rewind(f);
+        return read_sector(hdev, f, bank, size.sectorSize, from, from + 16) == ZEN_SUCC ? (int)(16 * size.sectorSize) : ZEN_ERROR;
+    }
+
+    count = 1 + rnd() % (size.sectorsCount < READ_MAX_SECTORS * 2 ? size.sectorsCount / 2 : READ_MAX_SECTORS);
+    from = rnd() % (size.sectorsCount - count);
+    /* poison buffer, short transfer must not leave old data looking valid */
+    memset(buff, 0xA5, count * size.sectorSize);
+    if(read_sector_buf(hdev, buff, bank, size.sectorSize, from, count) != ZEN_SUCC)
+        return ZEN_ERROR;
+
+    if(memcmp(buff, data + from * size.sectorSize, count * size.sectorSize) != 0)
+        (*corrupt)++;
+
+    return (int)(count * size.sectorSize);
+}
+
+static int run_op(usb_dev_handle* hdev, int op, u8* buff, FILE* f, int* corrupt) {
+    struct sBattResp batt;
+
+    switch(op) {
+        case OP_READY:
+            return device_ready(hdev) == ZEN_SUCC ? 0 : ZEN_ERROR;
+        case OP_BATT:
+            return read_batt_info(hdev, &batt) == ZEN_SUCC ? 0 : ZEN_ERROR;
+        case OP_VOL_LIMIT:
+            return read_vol_limit(hdev) == ZEN_ERROR ? ZEN_ERROR : 0;
+        case OP_CHIP_ID:
+            return read_chip_id(hdev) == ZEN_ERROR ? ZEN_ERROR : 0;
+        default:
+            return read_random(hdev, buff, f, op, corrupt);
+    }
+}
+
+/** Reads whole bank twice through caller's buffers, second read must not allocate, returns allocations. */
+static int alloc_check(usb_dev_handle* hdev, u8* buff, int* corrupt) {
+#ifdef ALLOC_COUNT
+    struct sSimFaults   none;
+    struct sZenSink     sink;
+    const u8*           data;
+    u8*                 out;
+    u32                 dataSize;
+    u64                 before;
+    int                 i, res;
+
+    memset(&none, 0, sizeof(struct sSimFaults));
+    sim_set_faults(&none);
+
+    if((data = sim_bank_data(ALLOC_BANK, &dataSize)) == NULL || dataSize > ALLOC_BANK_MAX
+        || (out = (u8*)malloc(ALLOC_BANK_MAX)) == NULL)
+        return ZEN_ERROR;
+
+    res = 0;
+    for(i=0; i<2; i++) {
+        zen_sink_mem(&sink, out, ALLOC_BANK_MAX);
+        before = allocs;
+        if(read_bank_sink_buf(hdev, ALLOC_BANK, &sink, buff, READ_MAX_SECTORS * 2048) != ZEN_SUCC) {
+            res = ZEN_ERROR;
+            break;
+        }
+        /* first read warms up transport buffers */
+        res = (int)(allocs - before);
+        if(sink.size != dataSize || memcmp(out, data, dataSize) != 0)
+            (*corrupt)++;
+    }
+
+    free(out);
+    return res;
+#else
+    return 0;
+#endif
+}
+
+static usb_dev_handle* reopen(usb_dev_handle* hdev, const struct sSimFaults* faults) {
+    if(hdev)
+        deinit_zen(hdev);
+
+    if((hdev = sim_open()) != NULL)
+        sim_set_faults(faults);
+
+    return hdev;
+}
+
+int main(int argc, char* argv[]) {
+    struct sSimFaults       faults;
+    struct sSimFaultStats   fst;
+    usb_dev_handle*         hdev;
+    FILE*                   f;
+    u8*                     buff;
+    u64                     ops, maxOps, seconds, window, start, now, winStart, winBytes, winOps;
+    u64                     heapStart, heapEnd, errors, streak, maxStreak, recoveries, streakSum, reopens;
+    double                  firstRate, lastRate, rate;
+    int                     argpos, op, res, corrupt, allocCount, allocOnly, i;
+
+    memset(&faults, 0, sizeof(struct sSimFaults));
+    maxOps = 100000;
+    seconds = 0;
+    window = 10000;
+    allocOnly = 0;
+    for(argpos=1; argpos<argc; argpos++) {
+        if(strcmp(argv[argpos], "-n") == 0 && argpos + 1 < argc)
+            maxOps = strtoull(argv[++argpos], NULL, 0);
+        else if(strcmp(argv[argpos], "-t") == 0 && argpos + 1 < argc)
+            seconds = strtoull(argv[++argpos], NULL, 0);
+        else if(strcmp(argv[argpos], "-w") == 0 && argpos + 1 < argc)
+            window = strtoull(argv[++argpos], NULL, 0);
+        else if(strcmp(argv[argpos], "-tag") == 0 && argpos + 1 < argc)
+            faults.tagMismatch = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-short") == 0 && argpos + 1 < argc)
+            faults.shortData = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-skip") == 0 && argpos + 1 < argc)
+            faults.skipData = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-stall") == 0 && argpos + 1 < argc)
+            faults.stall = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-jitter") == 0 && argpos + 1 < argc)
+            faults.jitterUs = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-seed") == 0 && argpos + 1 < argc)
+            faults.seed = atoi(argv[++argpos]);
+        else if(strcmp(argv[argpos], "-alloc") == 0)
+            allocOnly = 1;
+        else {
+            printf("Usage: %s <options>\n", argv[0]);
+            puts("Option:");
+            puts("-n 100000 => number of operations, 0 for no limit");
+            puts("-t 60 => stops after 60 seconds");
+            puts("-w 10000 => prints throughput every 10000 operations");
+            puts("-tag 100 => CSW tag mismatch rate, per million transfers");
+            puts("-short 100 => short data phase rate, per million transfers");
+            puts("-skip 100 => skipped data phase rate, per million transfers");
+            puts("-stall 100 => endpoint stall rate, per million transfers");
+            puts("-jitter 200 => delays every transfer by random 0..200 us");
+            puts("-seed 1 => seed of fault generator");
+            puts("-alloc => only checks that full bank read allocates nothing, used by make check");
+            return ZEN_ERROR;
+        }
+    }
+    if(window == 0)
+        window = 10000;
+
+    buff = (u8*)malloc(READ_MAX_SECTORS * 2048);
+    f = tmpfile();
+    if(buff == NULL || f == NULL) {
+        puts("Out of memory or temporary file can't be created");
+        return ZEN_ERROR;
+    }
+
+    if((hdev = reopen(NULL, &faults)) == NULL) {
+        puts("Simulated device can't be created");
+        return ZEN_ERROR;
+    }
+
+    corrupt = 0;
+    if(allocOnly) {
+#ifdef ALLOC_COUNT
+        allocCount = alloc_check(hdev, buff, &corrupt);
+        if(allocCount == ZEN_ERROR)
+            fprintf(stderr, "allocations: bank %d can't be read\n", ALLOC_BANK);
+        else
+            fprintf(stderr, "allocations: %d during full read of bank %d with caller buffers\n", allocCount, ALLOC_BANK);
+#else
+        fputs("allocations aren't counted, build with -DALLOC_COUNT\n", stderr);
+        allocCount = ZEN_ERROR;
+#endif
+        deinit_zen(hdev);
+        fclose(f);
+        free(buff);
+
+        if(allocCount != 0 || corrupt) {
+            fputs("FAILED: allocations or corrupted data during full bank read\n", stderr);
+            return ZEN_ERROR;
+        }
+        return ZEN_SUCC;
+    }
+
+    /* first operations allocate buffers that are kept, measure after warm up */
+    for(op=0; op<OPS_COUNT; op++)
+        run_op(hdev, op, buff, f, &corrupt);
+    zen_reset_stats();
+    heapStart = heap_in_use();
+
+    ops = errors = streak = maxStreak = recoveries = streakSum = reopens = 0;
+    winBytes = winOps = 0;
+    firstRate = lastRate = 0;
+    start = winStart = zen_time_us();
+    for(;;) {
+        now = zen_time_us();
+        if((maxOps && ops >= maxOps) || (seconds && now - start >= seconds * 1000000))
+            break;
+
+        op = pick_op();
+        res = run_op(hdev, op, buff, f, &corrupt);
+        now = zen_time_us() - now;
+
+        hist[hist_index(now)]++;
+        if(now > latMax)
+            latMax = now;
+        opStats[op].count++;
+        ops++;
+        winOps++;
+
+        if(res == ZEN_ERROR) {
+            opStats[op].errors++;
+            errors++;
+            if(++streak == REOPEN_STREAK) {
+                reopens++;
+                if((hdev = reopen(hdev, &faults)) == NULL) {
+                    puts("Simulated device can't be created");
+                    return ZEN_ERROR;
+                }
+            }
+        } else {
+            winBytes += res;
+            if(streak) {
+                recoveries++;
+                streakSum += streak;
+                if(streak > maxStreak)
+                    maxStreak = streak;
+                streak = 0;
+            }
+        }
+
+        if(winOps == window) {
+            now = zen_time_us();
+            rate = winBytes / ((now - winStart) / 1e6) / (1 << 20);
+            if(firstRate == 0)
+                firstRate = rate;
+            lastRate = rate;
+            fprintf(stderr, "ops=%llu\t%.0f ops/s\t%.2f MB/s\terrors=%llu\theap=%llu\n", ops,
+                winOps / ((now - winStart) / 1e6), rate, errors, heap_in_use());
+            winStart = now;
+            winOps = winBytes = 0;
+        }
+    }
+    heapEnd = heap_in_use();
+    sim_get_fault_stats(&fst);
+    allocCount = alloc_check(hdev, buff, &corrupt);
+
+    fprintf(stderr, "\n%llu operations in %.1f s, %llu failed, %llu returned corrupted data\n",
+        ops, (zen_time_us() - start) / 1e6, errors, (u64)corrupt);
+    fprintf(stderr, "latency us: p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu\n",
+        percentile(ops, 0.5), percentile(ops, 0.9), percentile(ops, 0.99), percentile(ops, 0.999), latMax);
+    for(i=0; i<OPS_COUNT; i++)
+        fprintf(stderr, "  %-12s %llu ops, %llu failed\n", opNames[i], opStats[i].count, opStats[i].errors);
+    fprintf(stderr, "faults injected: tag mismatch=%llu, short data=%llu, skipped data=%llu, stall=%llu\n",
+        fst.tagMismatch, fst.shortData, fst.skipData, fst.stall);
+    fprintf(stderr, "timeouts: %llu reads waited for data device didn't have (%llu s on real device)\n",
+        fst.timeouts, fst.timeouts * zen_get_profile(hdev)->timeout / 1000);
+    fprintf(stderr, "recovery: %llu failure runs, mean %.2f failed ops, longest %llu, %llu reopens%s\n",
+        recoveries, recoveries ? (double)streakSum / recoveries : 0.0, maxStreak, reopens,
+        streak ? ", still failing at end" : "");
+    if(firstRate > 0)
+        fprintf(stderr, "throughput: first window %.2f MB/s, last window %.2f MB/s, change %+.1f%%\n",
+            firstRate, lastRate, (lastRate - firstRate) * 100 / firstRate);
+    fprintf(stderr, "heap: %llu bytes at start, %llu at end, %+lld\n", heapStart, heapEnd, (long long)(heapEnd - heapStart));
+#ifdef ALLOC_COUNT
+    if(allocCount == ZEN_ERROR)
+        fprintf(stderr, "allocations: bank %d can't be read\n", ALLOC_BANK);
+    else
+        fprintf(stderr, "allocations: %d during full read of bank %d with caller buffers\n", allocCount, ALLOC_BANK);
+#endif
+
+    deinit_zen(hdev);
+    fclose(f);
+    free(buff);
+
+    if((long long)(heapEnd - heapStart) > LEAK_LIMIT || corrupt || allocCount != 0) {
+        fputs("FAILED: memory leak, corrupted data or allocations in steady state\n", stderr);
+        return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
@@ -8,7 +8,48 @@
 
 
 #include <gtk/gtk.h>
+#include <time.h>
 #include "libzen.h"
+#include "battstore.h"
+
+/* How long to wait for device to become ready, ms */
+#define READY_WAIT 2000
+
+/* Battery history in home directory, tooltip shows change over last TREND_SECONDS */
+#define HISTORY_FILE    ".zen-battery-%.4x%.4x"
+#define TREND_SECONDS   3600
+/* Volume limit rarely changes, it's read every VOL_LIMIT_POLLS polls only */
+#define VOL_LIMIT_POLLS 30
+
+static struct sBattStore store;
+
+/** Saves sample and returns level change since TREND_SECONDS ago, 0 if unknown. */
+static int record_history(usb_dev_handle* hdev, const struct sBattResp* batt) {
+    static int          volLimit = ZEN_ERROR;
+    static int          polls;
+    struct sBattSample  old;
+    u32                 now = (u32)time(NULL);
+
+    if(store.header == NULL)
+        return 0;
+
+    if(polls++ % VOL_LIMIT_POLLS == 0 || volLimit == ZEN_ERROR)
+        volLimit = read_vol_limit(hdev);
+    batt_store_append(&store, now, batt, volLimit);
+
+    if(batt_store_query(&store, 0, now - TREND_SECONDS, now, &old, 1) != 1)
+        return 0;
+
+    return batt->level - old.level;
+}
+
+/** Counterpart of read_batt_level() keeping whole response for history. */
+static int read_level(usb_dev_handle* hdev, struct sBattResp* batt) {
+    if(read_batt_info(hdev, batt) != ZEN_SUCC || (batt->full != ZEN_BATT_NOT_FULL && batt->full != ZEN_BATT_FULL))
+        return ZEN_ERROR;
+
+    return batt->level;
+}
 
 static GtkStatusIcon *create_tray_icon() {
     GtkStatusIcon *tray_icon;
@@ -48,18 +89,26 @@ static GdkPixbuf* create_progress_pixbuf(int val) {
 
 static gboolean update_status(gpointer user_data) {
     GtkStatusIcon *tray_icon;
-    char battBuff[16];
+    struct sBattResp batt;
+    char battBuff[48];
     int  level = -1;
+    int  trend = 0;
 
     tray_icon = (GtkStatusIcon*)user_data;
 
     usb_dev_handle* hdev = init_zen(0, 0);
     if(hdev) {
         int iter = 0;
-        while((level = read_batt_level(hdev)) == ZEN_ERROR) {
-            if(iter++ > 10) /* Max 10 tries */
-            break;
+        /* level stays ZEN_ERROR if device isn't ready */
+        if(zen_wait_ready(hdev, READY_WAIT) == ZEN_SUCC) {
+            /* one command gives level and state for both icon and history */
+            while((level = read_level(hdev, &batt)) == ZEN_ERROR) {
+                if(iter++ > 10) /* Max 10 tries */
+                break;
+            }
         }
+        if(level != ZEN_ERROR)
+            trend = record_history(hdev, &batt);
         deinit_zen(hdev);
 
         if(level == ZEN_ERROR) {
@@ -69,7 +118,10 @@ static gboolean update_status(gpointer user_data) {
         } else {
             /* Set progress */
             if(level != 100) {
-                sprintf(battBuff,"Charging: %d%%",level);
+                if(trend > 0)
+                    sprintf(battBuff,"Charging: %d%% (+%d%% in last hour)",level,trend);
+                else
+                    sprintf(battBuff,"Charging: %d%%",level);
                 gtk_status_icon_set_tooltip_text(tray_icon, battBuff);
             } else
                 gtk_status_icon_set_tooltip_text(tray_icon, "Fully charged");
@@ -88,9 +140,17 @@ static gboolean update_status(gpointer user_data) {
 
 int main(int argc, char **argv) {
     GtkStatusIcon *tray_icon;
+    char historyName[32];
+    gchar* historyPath;
 
     /* Initialise */
     gtk_init(&argc, &argv);
+
+    /* history is optional, tray works without it */
+    sprintf(historyName, HISTORY_FILE, ZEN_VENDOR, ZEN_PRODUCT);
+    historyPath = g_build_filename(g_get_home_dir(), historyName, NULL);
+    batt_store_open(&store, historyPath, ZEN_VENDOR, ZEN_PRODUCT, 1);
+    g_free(historyPath);
     tray_icon = create_tray_icon();
 
     /* Start timer */
@@ -0,0 +1,389 @@
+/*
+ * Name        : verify.c
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Streaming comparison of device firmware with golden image or manifest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "verify.h"
+
+#define MANIFEST_VERSION    1
+
+/** State of verification shared by sinks of all banks. */
+struct sVerifyCtx {
+    /** Reference directory, NULL if manifest is used. */
+    const char*             dir;
+    struct sVerifyManifest* manifest;
+    struct sVerifyResult*   result;
+    /** Bank being compared: reference file or manifest entry. */
+    FILE*                   f;
+    struct sVerifyBank*     bank;
+    u64                     size;
+    u64                     pos;
+    u32                     crc;
+    u32                     fill;
+    /** Reference data of current chunk. */
+    u8*                     buff;
+    size_t                  buffSize;
+    /** Manifest being written. */
+    FILE*                   out;
+    /** Banks read from device, reference files of others are missing on device. */
+    char                    seen[VERIFY_BANKS_MAX][VERIFY_NAME_LEN];
+    int                     seenCount;
+};
+
+static int is_dir(const char* path) {
+    struct stat info;
+
+    return stat(path, &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+/** Records first difference, returns ZEN_ERROR so reading stops. */
+static int mismatch(struct sVerifyCtx* v, const char* reason, u64 from, u64 to) {
+    v->result->mismatch = 1;
+    v->result->reason = reason;
+    v->result->from = from;
+    v->result->to = to;
+
+    return ZEN_ERROR;
+}
+
+static int image_write(struct sZenSink* sink, const u8* data, size_t len) {
+    struct sVerifyCtx*  v = (struct sVerifyCtx*)sink->ctx;
+    size_t              got, first, last;
+    u8*                 buff;
+
+    if(len > v->buffSize) {
+        if((buff = (u8*)realloc(v->buff, len)) == NULL)
+            return ZEN_ERROR;
+        v->buff = buff;
+        v->buffSize = len;
+    }
+
+    /* sizes were checked, short read means the file changed meanwhile */
+    got = fread(v->buff, 1, len, v->f);
+    if(got == len && memcmp(data, v->buff, len) == 0) {
+        v->pos += len;
+        v->result->bytes += len;
+        return ZEN_SUCC;
+    }
+
+    for(first=0; first<got && data[first] == v->buff[first]; first++)
+        ;
+    for(last=len; last>first && last<=got && data[last - 1] == v->buff[last - 1]; last--)
+        ;
+
+    return mismatch(v, "content", v->pos + first, v->pos + last);
+}
+
+/** Compares crc32 of completed manifest chunk. */
+static int check_chunk(struct sVerifyCtx* v) {
+    u32 chunk = (u32)((v->pos - 1) / v->manifest->chunkSize);
+    u64 from = (u64)chunk * v->manifest->chunkSize;
+
+    v->fill = 0;
+    if(v->crc != v->bank->crc[chunk])
+        return mismatch(v, "content", from, v->pos);
+
+    v->crc = 0;
+    return ZEN_SUCC;
+}
+
+static int manifest_write(struct sZenSink* sink, const u8* data, size_t len) {
+    struct sVerifyCtx*  v = (struct sVerifyCtx*)sink->ctx;
+    size_t              n;
+
+    while(len > 0) {
+        n = v->manifest->chunkSize - v->fill;
+        if(n > len)
+            n = len;
+
+        v->crc = zen_crc32(v->crc, data, n);
+        v->fill += (u32)n;
+        v->pos += n;
+        v->result->bytes += n;
+        data += n;
+        len -= n;
+
+        if(v->fill == v->manifest->chunkSize && check_chunk(v) != ZEN_SUCC)
+            return ZEN_ERROR;
+    }
+
+    return ZEN_SUCC;
+}
+
+static int verify_close(struct sZenSink* sink, int ok) {
+    struct sVerifyCtx*  v = (struct sVerifyCtx*)sink->ctx;
+    int                 res = ZEN_SUCC;
+
+    /* device gave less than allocation table says, empty banks included */
+    if(ok && v->pos != v->size)
+        res = mismatch(v, "size", v->pos, v->size);
+    /* last chunk of bank may be shorter */
+    else if(ok && v->bank && v->fill > 0)
+        res = check_chunk(v);
+
+    if(v->f) {
+        fclose(v->f);
+        v->f = NULL;
+    }
+
+    if(ok && res == ZEN_SUCC)
+        v->result->banks++;
+
+    return res;
+}
+
+static int verify_factory(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink) {
+    struct sVerifyCtx*  v = (struct sVerifyCtx*)ctx;
+    char                path[1024];
+    u64                 refSize;
+    int                 i;
+
+    v->result->bankNo = row->bankNo;
+    snprintf(v->result->name, sizeof(v->result->name), "%s", name);
+    v->size = row->size;
+    v->pos = 0;
+    v->crc = 0;
+    v->fill = 0;
+    v->bank = NULL;
+    if(v->seenCount < VERIFY_BANKS_MAX)
+        snprintf(v->seen[v->seenCount++], VERIFY_NAME_LEN, "%s", name);
+
+    if(v->dir) {
+        snprintf(path, sizeof(path), "%s/%s", v->dir, name);
+        if((v->f = fopen(path, "rb")) == NULL)
+            return mismatch(v, "no reference", 0, row->size);
+
+        fseek(v->f, 0, SEEK_END);
+        refSize = (u64)ftell(v->f);
+        rewind(v->f);
+    } else {
+        for(i=0; i<v->manifest->count && strcmp(v->manifest->bank[i].name, name) != 0; i++)
+            ;
+        if(i == v->manifest->count)
+            return mismatch(v, "no reference", 0, row->size);
+
+        v->bank = &v->manifest->bank[i];
+        v->bank->seen = 1;
+        refSize = v->bank->size;
+    }
+
+    /* no need to read anything, differing size is a difference */
+    if(refSize != row->size) {
+        if(v->f) {
+            fclose(v->f);
+            v->f = NULL;
+        }
+        return mismatch(v, "size", refSize < row->size ? refSize : row->size, refSize > row->size ? refSize : row->size);
+    }
+
+    sink->write = v->dir ? image_write : manifest_write;
+    sink->close = verify_close;
+    sink->ctx = v;
+
+    return ZEN_SUCC;
+}
+
+/** Finds reference file read_firmware_dir() could have written for bank device doesn't have. */
+static int find_missing(struct sVerifyCtx* v) {
+    static const u8 tags[] = {SIGMATEL_BANK_TAG_STMPSYS, SIGMATEL_BANK_TAG_USBMSC, SIGMATEL_BANK_TAG_RESOURCE_BIN,
+        SIGMATEL_BANK_TAG_BOOTMANAGER};
+    struct stat     info;
+    char            path[1024], name[VERIFY_NAME_LEN];
+    int             i, j;
+
+    for(i=0; i<(int)sizeof(tags) + 256; i++) {
+        if(i < (int)sizeof(tags))
+            snprintf(name, sizeof(name), "%s", bank_tag_name(tags[i]));
+        else
+            snprintf(name, sizeof(name), "bank%d.bin", i - (int)sizeof(tags));
+
+        for(j=0; j<v->seenCount && strcmp(v->seen[j], name) != 0; j++)
+            ;
+        snprintf(path, sizeof(path), "%s/%s", v->dir, name);
+        if(j < v->seenCount || stat(path, &info) != 0 || (info.st_mode & S_IFMT) != S_IFREG)
+            continue;
+
+        v->result->bankNo = 0;
+        snprintf(v->result->name, sizeof(v->result->name), "%s", name);
+        return mismatch(v, "missing on device", 0, (u64)info.st_size);
+    }
+
+    return ZEN_SUCC;
+}
+
+int verify_firmware(usb_dev_handle* hdev, const char* ref, struct sVerifyResult* result) {
+    struct sVerifyManifest  manifest;
+    struct sVerifyCtx       v;
+    struct sBankSize        bankSize;
+    int                     res, i;
+
+    memset(result, 0, sizeof(struct sVerifyResult));
+    memset(&manifest, 0, sizeof(struct sVerifyManifest));
+    memset(&v, 0, sizeof(struct sVerifyCtx));
+    v.result = result;
+
+    if(is_dir(ref))
+        v.dir = ref;
+    else if(verify_manifest_load(ref, &manifest) == ZEN_SUCC)
+        v.manifest = &manifest;
+    else
+        return ZEN_ERROR;
+
+    res = read_firmware_sink(hdev, verify_factory, &v);
+
+    /* every bank of manifest has to be on device */
+    for(i=0; res == ZEN_SUCC && v.manifest && i<manifest.count; i++) {
+        if(!manifest.bank[i].seen) {
+            result->bankNo = 0;
+            snprintf(result->name, sizeof(result->name), "%s", manifest.bank[i].name);
+            res = mismatch(&v, "missing on device", 0, manifest.bank[i].size);
+        }
+    }
+    if(res == ZEN_SUCC && v.dir)
+        res = find_missing(&v);
+
+    if(v.f)
+        fclose(v.f);
+    free(v.buff);
+    verify_manifest_free(&manifest);
+
+    if(result->mismatch && strcmp(result->reason, "missing on device") != 0
+        && read_bank_size(hdev, result->bankNo, &bankSize) != ZEN_ERROR && bankSize.sectorSize) {
+        result->sectorFrom = (u32)(result->from / bankSize.sectorSize);
+        result->sectorTo = (u32)((result->to + bankSize.sectorSize - 1) / bankSize.sectorSize);
+    }
+
+    return result->mismatch ? ZEN_ERROR : res;
+}
+
+static int hash_write(struct sZenSink* sink, const u8* data, size_t len) {
+    struct sVerifyCtx*  v = (struct sVerifyCtx*)sink->ctx;
+    size_t              n;
+
+    while(len > 0) {
+        n = VERIFY_CHUNK - v->fill;
+        if(n > len)
+            n = len;
+
+        v->crc = zen_crc32(v->crc, data, n);
+        v->fill += (u32)n;
+        data += n;
+        len -= n;
+
+        if(v->fill == VERIFY_CHUNK) {
+            if(fprintf(v->out, "%08x\n", v->crc) < 0)
+                return ZEN_ERROR;
+            v->crc = 0;
+            v->fill = 0;
+        }
+    }
+
+    return ZEN_SUCC;
+}
+
+static int hash_close(struct sZenSink* sink, int ok) {
+    struct sVerifyCtx* v = (struct sVerifyCtx*)sink->ctx;
+
+    if(ok && v->fill > 0 && fprintf(v->out, "%08x\n", v->crc) < 0)
+        return ZEN_ERROR;
+
+    return ZEN_SUCC;
+}
+
+static int hash_factory(void* ctx, const struct sAllocTableRow* row, const char* name, struct sZenSink* sink) {
+    struct sVerifyCtx* v = (struct sVerifyCtx*)ctx;
+
+    v->crc = 0;
+    v->fill = 0;
+    if(fprintf(v->out, "bank %s %llu\n", name, row->size) < 0)
+        return ZEN_ERROR;
+
+    sink->write = hash_write;
+    sink->close = hash_close;
+    sink->ctx = v;
+
+    return ZEN_SUCC;
+}
+
+int verify_make_manifest(usb_dev_handle* hdev, const char* path) {
+    struct sVerifyCtx   v;
+    int                 res;
+
+    memset(&v, 0, sizeof(struct sVerifyCtx));
+    if((v.out = fopen(path, "w")) == NULL) {
+        zen_log("Creating %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    fprintf(v.out, "zen-manifest %d %d\n", MANIFEST_VERSION, VERIFY_CHUNK);
+    res = read_firmware_sink(hdev, hash_factory, &v);
+    if(fclose(v.out) != 0)
+        res = ZEN_ERROR;
+
+    if(res != ZEN_SUCC)
+        remove(path);
+
+    return res;
+}
+
+int verify_manifest_load(const char* path, struct sVerifyManifest* manifest) {
+    struct sVerifyBank* b;
+    FILE*               f;
+    unsigned long long  size;
+    unsigned            version, chunkSize, crc, i;
+
+    memset(manifest, 0, sizeof(struct sVerifyManifest));
+    if((f = fopen(path, "r")) == NULL) {
+        zen_log("Opening %s failed\n", path);
+        return ZEN_ERROR;
+    }
+
+    if(fscanf(f, "zen-manifest %u %u", &version, &chunkSize) != 2 || version != MANIFEST_VERSION || chunkSize == 0)
+        goto broken;
+    manifest->chunkSize = chunkSize;
+
+    while(manifest->count < VERIFY_BANKS_MAX) {
+        b = &manifest->bank[manifest->count];
+        if(fscanf(f, " bank %23s %llu", b->name, &size) != 2)
+            break;
+
+        b->size = size;
+        b->chunks = (u32)((size + chunkSize - 1) / chunkSize);
+        if((b->crc = (u32*)malloc(sizeof(u32) * (b->chunks ? b->chunks : 1))) == NULL)
+            goto broken;
+        manifest->count++;
+
+        for(i=0; i<b->chunks; i++) {
+            if(fscanf(f, "%x", &crc) != 1)
+                goto broken;
+            b->crc[i] = crc;
+        }
+    }
+
+    if(!feof(f) && fscanf(f, " %*s") != EOF)
+        goto broken;
+
+    fclose(f);
+    return ZEN_SUCC;
+
+broken:
+    zen_log("Manifest %s is broken\n", path);
+    fclose(f);
+    verify_manifest_free(manifest);
+    return ZEN_ERROR;
+}
+
+void verify_manifest_free(struct sVerifyManifest* manifest) {
+    int i;
+
+    for(i=0; i<manifest->count; i++)
+        free(manifest->bank[i].crc);
+    memset(manifest, 0, sizeof(struct sVerifyManifest));
+}
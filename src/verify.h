@@ -0,0 +1,108 @@
+/*
+ * Name        : verify.h
+ * Author      : Maciej Muszkowski
+ * Version     : 0.0.0.6
+ * Copyright   : GPL
+ * Description : Streaming comparison of device firmware with golden image or manifest
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "libzen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Banks are streamed as read_firmware() reads them and compared chunk by
+ * chunk, the first difference stops reading. Reference is either directory
+ * with firmware files saved by read_firmware_dir() or manifest with crc32 of
+ * every VERIFY_CHUNK of each bank, text file:
+ *   zen-manifest 1 65536
+ *   bank stmpsys.sb 524288
+ *   1c291ca3
+ *   ...
+ * crc32 finds corruption, not tampering.
+ */
+
+/* Bytes per manifest hash */
+#define VERIFY_CHUNK        65536
+#define VERIFY_NAME_LEN     24
+#define VERIFY_BANKS_MAX    10
+
+struct sVerifyBank {
+    char    name[VERIFY_NAME_LEN];
+    u64     size;
+    u32     chunks;
+    u32*    crc;
+    /** Set when bank was found on device. */
+    int     seen;
+};
+
+struct sVerifyManifest {
+    u32                 chunkSize;
+    int                 count;
+    struct sVerifyBank  bank[VERIFY_BANKS_MAX];
+};
+
+struct sVerifyResult {
+    /** 1 if device differs from reference, other failures leave it 0. */
+    int         mismatch;
+    /** What differs: "content", "size", "no reference" or "missing on device". */
+    const char* reason;
+    /** Bank of first difference and its file name. */
+    u8          bankNo;
+    char        name[VERIFY_NAME_LEN];
+    /** Differing bytes of bank [from, to), exact in image, whole chunk in manifest. */
+    u64         from;
+    u64         to;
+    /** Same range in sectors [sectorFrom, sectorTo), 0 if sector size is unknown. */
+    u32         sectorFrom;
+    u32         sectorTo;
+    /** Banks found equal and bytes compared. */
+    u32         banks;
+    u64         bytes;
+};
+
+/**
+ * @brief
+ * Compares firmware banks with reference while reading them, stops at first difference
+ * @param hdev pointer to ZenStone created with initZen()
+ * @param ref directory with firmware files or manifest file
+ * @param result details of difference and counters
+ * @return ZEN_SUCC if every bank equals reference, ZEN_ERROR if it differs (result->mismatch is 1) or on failure
+**/
+int verify_firmware(usb_dev_handle* hdev, const char* ref, struct sVerifyResult* result);
+
+/**
+ * @brief
+ * Reads firmware and writes its manifest
+ * @param hdev pointer to ZenStone created with initZen(), should have golden firmware
+ * @param path manifest file to create
+ * @return ZEN_SUCC if succeded
+**/
+int verify_make_manifest(usb_dev_handle* hdev, const char* path);
+
+/**
+ * @brief
+ * Loads manifest file
+ * @param path manifest file
+ * @param manifest result, free with verify_manifest_free()
+ * @return ZEN_SUCC if succeded, ZEN_ERROR if file is missing or broken
+**/
+int verify_manifest_load(const char* path, struct sVerifyManifest* manifest);
+
+/**
+ * @brief
+ * Frees hashes of manifest
+ * @param manifest loaded manifest
+**/
+void verify_manifest_free(struct sVerifyManifest* manifest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif